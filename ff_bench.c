@@ -0,0 +1,568 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Force feedback round trip benchmark for the handheld device wrapper
+ *
+ * Copyright (c) 2024 Chris Morgan <macromorgan@hotmail.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#define GAMEPAD_NAME		"Virtual Gamepad"
+#define VIBRATOR_NAME		"pwm-vibrator"
+#define KEYS_NAME		"gpio-keys"
+
+/* Most samples kept per measurement, and how long to wait for one. */
+#define MAX_SAMPLES		4096
+#define SAMPLE_TIMEOUT_MS	500
+
+/* FF commands sent ahead of every button press under load. */
+#define LOAD_BURST		16
+
+/* What the fake vibrator reports back to the benchmark. */
+enum notice_kind {
+	NOTICE_UPLOAD,
+	NOTICE_ERASE,
+	NOTICE_PLAY,
+	NOTICE_GAIN,
+};
+
+struct notice {
+	uint32_t kind;
+	int32_t value;
+	uint64_t time_us;
+};
+
+/* Artificial delays of the fake vibrator, in us. */
+struct delays {
+	long upload_us;
+	long erase_us;
+	long play_us;
+};
+
+/* Samples of one measurement, kept sorted. */
+struct samples {
+	uint32_t us[MAX_SAMPLES];
+	int count;
+	int lost;
+};
+
+/**
+ * now_us() - Current CLOCK_MONOTONIC time in microseconds
+ */
+uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+/**
+ * sample_add() - Add a sample to a measurement
+ * @s: measurement
+ * @us: sample in microseconds
+ */
+void sample_add(struct samples *s, uint64_t us)
+{
+	int j;
+
+	if (s->count == MAX_SAMPLES)
+		return;
+	for (j = s->count++; j > 0 && s->us[j - 1] > us; j--)
+		s->us[j] = s->us[j - 1];
+	s->us[j] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+/**
+ * sample_print() - Print a measurement
+ * @name: what was measured
+ * @s: measurement
+ */
+void sample_print(const char *name, const struct samples *s)
+{
+	if (!s->count) {
+		printf("%-22s no samples, %d lost\n", name, s->lost);
+		return;
+	}
+	printf("%-22s n=%d min=%u median=%u p99=%u max=%u us, %d lost\n",
+	       name, s->count, s->us[0], s->us[s->count / 2],
+	       s->us[(s->count - 1) * 99 / 100], s->us[s->count - 1],
+	       s->lost);
+}
+
+/**
+ * create_device() - Create a fake source device
+ * @name: device name
+ * @ff: whether to create a rumble device rather than a key device
+ *
+ * Return the uinput file descriptor, negative on error.
+ */
+int create_device(const char *name, int ff)
+{
+	struct uinput_setup usetup = {
+		.id.bustype = BUS_HOST,
+		.ff_effects_max = ff ? 16 : 0,
+	};
+	int fd;
+
+	fd = open("/dev/uinput", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	snprintf(usetup.name, sizeof(usetup.name), "%s", name);
+	if (ff) {
+		ioctl(fd, UI_SET_EVBIT, EV_FF);
+		ioctl(fd, UI_SET_FFBIT, FF_RUMBLE);
+		ioctl(fd, UI_SET_FFBIT, FF_GAIN);
+	} else {
+		ioctl(fd, UI_SET_EVBIT, EV_KEY);
+		ioctl(fd, UI_SET_KEYBIT, BTN_SOUTH);
+		ioctl(fd, UI_SET_KEYBIT, BTN_EAST);
+	}
+
+	if (ioctl(fd, UI_DEV_SETUP, &usetup) ||
+	    ioctl(fd, UI_DEV_CREATE)) {
+		close(fd);
+		return -errno;
+	}
+	return fd;
+}
+
+/**
+ * notify() - Report a request the fake vibrator handled
+ * @out: pipe to the benchmark
+ * @kind: enum notice_kind
+ * @value: request specific
+ */
+void notify(int out, int kind, int value)
+{
+	struct notice n = {
+		.kind = kind,
+		.value = value,
+		.time_us = now_us(),
+	};
+
+	if (write(out, &n, sizeof(n)) != sizeof(n))
+		exit(1);
+}
+
+/**
+ * run_vibrator() - Behave as a vibrator driver until told to stop
+ * @fd: uinput file descriptor of the fake vibrator
+ * @d: artificial delays
+ * @in: pipe from the benchmark, closed to stop
+ * @out: pipe to the benchmark
+ *
+ * Effect uploads and erases are acknowledged after their delay, play
+ * and gain requests are reported and then take their delay, as a
+ * driver programming the motor would.
+ */
+void run_vibrator(int fd, const struct delays *d, int in, int out)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = fd, .events = POLLIN },
+		{ .fd = in, .events = POLLIN },
+	};
+	struct input_event ev;
+
+	while (poll(pfd, 2, -1) > 0 && !pfd[1].revents) {
+		if (read(fd, &ev, sizeof(ev)) != sizeof(ev))
+			continue;
+
+		if (ev.type == EV_UINPUT && ev.code == UI_FF_UPLOAD) {
+			struct uinput_ff_upload up = {
+				.request_id = ev.value,
+			};
+
+			ioctl(fd, UI_BEGIN_FF_UPLOAD, &up);
+			usleep(d->upload_us);
+			up.retval = 0;
+			ioctl(fd, UI_END_FF_UPLOAD, &up);
+			notify(out, NOTICE_UPLOAD, up.effect.id);
+		} else if (ev.type == EV_UINPUT && ev.code == UI_FF_ERASE) {
+			struct uinput_ff_erase er = {
+				.request_id = ev.value,
+			};
+
+			ioctl(fd, UI_BEGIN_FF_ERASE, &er);
+			usleep(d->erase_us);
+			er.retval = 0;
+			ioctl(fd, UI_END_FF_ERASE, &er);
+			notify(out, NOTICE_ERASE, er.effect_id);
+		} else if (ev.type == EV_FF) {
+			notify(out, ev.code == FF_GAIN ? NOTICE_GAIN :
+			       NOTICE_PLAY, ev.value);
+			usleep(d->play_us);
+		}
+	}
+}
+
+/**
+ * open_gamepad() - Open the virtual device of virtual_controller
+ * @name: name of the virtual device
+ * @timeout_s: how long to wait for it to appear
+ *
+ * Return the file descriptor, negative on error.
+ */
+int open_gamepad(const char *name, int timeout_s)
+{
+	for (int wait = 0; wait < timeout_s * 10; wait++) {
+		for (int i = 0; i < 256; i++) {
+			char path[32], dev_name[256] = "";
+			int fd;
+
+			snprintf(path, sizeof(path), "/dev/input/event%d", i);
+			fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+			if (fd == -1)
+				continue;
+			ioctl(fd, EVIOCGNAME(sizeof(dev_name) - 1), dev_name);
+			if (!strcmp(dev_name, name))
+				return fd;
+			close(fd);
+		}
+		usleep(100000);
+	}
+
+	return -ENODEV;
+}
+
+/**
+ * wait_notice() - Wait for the fake vibrator to report a request
+ * @in: pipe from the fake vibrator
+ * @kind: enum notice_kind to wait for
+ * @timeout_ms: how long to wait
+ *
+ * Other reports are skipped. Return the time the request was handled,
+ * 0 on timeout.
+ */
+uint64_t wait_notice(int in, int kind, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = in, .events = POLLIN };
+	struct notice n;
+
+	while (poll(&pfd, 1, timeout_ms) > 0) {
+		if (read(in, &n, sizeof(n)) != sizeof(n))
+			return 0;
+		if (n.kind == (uint32_t)kind)
+			return n.time_us;
+	}
+	return 0;
+}
+
+/**
+ * drain() - Discard whatever is pending on a file descriptor
+ * @fd: file descriptor
+ * @size: size of the records read from it
+ *
+ * Return the number of records discarded.
+ */
+int drain(int fd, size_t size)
+{
+	char buf[4096];
+	int count = 0, len;
+
+	while ((len = read(fd, buf, sizeof(buf) / size * size)) > 0)
+		count += len / size;
+	return count;
+}
+
+/**
+ * play() - Start or stop an effect as a game would
+ * @pad: virtual device
+ * @id: effect id
+ * @value: 1 to start the effect, 0 to stop it
+ */
+int play(int pad, int id, int value)
+{
+	struct input_event ev = {
+		.type = EV_FF,
+		.code = id,
+		.value = value,
+	};
+
+	return write(pad, &ev, sizeof(ev)) == sizeof(ev) ? 0 : -errno;
+}
+
+/**
+ * bench_upload() - Measure effect upload and erase
+ * @pad: virtual device
+ * @in: pipe from the fake vibrator
+ * @count: number of effects
+ */
+void bench_upload(int pad, int in, int count)
+{
+	static struct samples upload, erase;
+	struct ff_effect effect = {
+		.type = FF_RUMBLE,
+		.u.rumble.strong_magnitude = 0x8000,
+		.replay.length = 100,
+	};
+
+	for (int i = 0; i < count; i++) {
+		uint64_t start = now_us();
+
+		effect.id = -1;
+		if (ioctl(pad, EVIOCSFF, &effect)) {
+			upload.lost++;
+			continue;
+		}
+		sample_add(&upload, now_us() - start);
+
+		start = now_us();
+		if (ioctl(pad, EVIOCRMFF, effect.id))
+			erase.lost++;
+		else
+			sample_add(&erase, now_us() - start);
+	}
+	drain(in, sizeof(struct notice));
+
+	sample_print("upload", &upload);
+	sample_print("erase", &erase);
+}
+
+/**
+ * bench_play() - Measure play latency and throughput
+ * @pad: virtual device
+ * @in: pipe from the fake vibrator
+ * @id: uploaded effect
+ * @count: number of commands
+ *
+ * Latency is from the game writing a play or stop command until the
+ * vibrator driver receives it. Throughput is measured with a burst of
+ * commands written back to back, counting how many reach the driver.
+ */
+void bench_play(int pad, int in, int id, int count)
+{
+	static struct samples latency;
+	uint64_t start, end;
+	int reached;
+
+	for (int i = 0; i < count; i++) {
+		start = now_us();
+		if (play(pad, id, !(i & 1))) {
+			latency.lost++;
+			continue;
+		}
+		end = wait_notice(in, NOTICE_PLAY, SAMPLE_TIMEOUT_MS);
+		if (end)
+			sample_add(&latency, end - start);
+		else
+			latency.lost++;
+	}
+	sample_print("play", &latency);
+
+	start = now_us();
+	for (int i = 0; i < count; i++)
+		play(pad, id, !(i & 1));
+	end = now_us();
+	usleep(SAMPLE_TIMEOUT_MS * 1000);
+	reached = drain(in, sizeof(struct notice));
+
+	printf("%-22s %d commands in %llu us, %.0f/s, %d reached the "
+	       "driver\n", "play burst", count,
+	       (unsigned long long)(end - start),
+	       end > start ? count * 1e6 / (end - start) : 0, reached);
+	play(pad, id, 0);
+}
+
+/**
+ * press() - Measure one button press through the virtual device
+ * @keys: fake key device
+ * @pad: virtual device
+ * @value: button value
+ *
+ * Return the time until the press arrived in us, 0 if it did not.
+ */
+uint64_t press(int keys, int pad, int value)
+{
+	struct input_event evs[2] = {
+		{ .type = EV_KEY, .code = BTN_SOUTH, .value = value },
+		{ .type = EV_SYN, .code = SYN_REPORT },
+	};
+	struct pollfd pfd = { .fd = pad, .events = POLLIN };
+	uint64_t start = now_us();
+	struct input_event ev;
+	int key = 0;
+
+	if (write(keys, evs, sizeof(evs)) != sizeof(evs))
+		return 0;
+
+	while (poll(&pfd, 1, SAMPLE_TIMEOUT_MS) > 0) {
+		while (read(pad, &ev, sizeof(ev)) == sizeof(ev)) {
+			if (ev.type == EV_KEY)
+				key = 1;
+			else if (key && ev.type == EV_SYN &&
+				 ev.code == SYN_REPORT)
+				return now_us() - start;
+		}
+	}
+	return 0;
+}
+
+/**
+ * bench_buttons() - Measure how FF traffic delays button forwarding
+ * @keys: fake key device
+ * @pad: virtual device
+ * @in: pipe from the fake vibrator
+ * @id: uploaded effect
+ * @count: number of presses
+ *
+ * Button presses are measured once on their own and once each right
+ * after a burst of FF commands, which the daemon handles in the same
+ * loop as the buttons.
+ */
+void bench_buttons(int keys, int pad, int in, int id, int count)
+{
+	static struct samples idle, loaded;
+	uint64_t t;
+
+	for (int i = 0; i < count; i++) {
+		drain(pad, sizeof(struct input_event));
+		t = press(keys, pad, !(i & 1));
+		if (t)
+			sample_add(&idle, t);
+		else
+			idle.lost++;
+	}
+
+	for (int i = 0; i < count; i++) {
+		drain(pad, sizeof(struct input_event));
+		for (int j = 0; j < LOAD_BURST; j++)
+			play(pad, id, !(j & 1));
+		t = press(keys, pad, !(i & 1));
+		if (t)
+			sample_add(&loaded, t);
+		else
+			loaded.lost++;
+		drain(in, sizeof(struct notice));
+	}
+	play(pad, id, 0);
+
+	sample_print("button", &idle);
+	sample_print("button under FF load", &loaded);
+}
+
+/**
+ * usage() - Print command line help
+ * @prog: program name
+ */
+void usage(const char *prog)
+{
+	printf("Usage: %s [-n count] [-u us] [-e us] [-p us] [-t seconds]\n"
+	       "  -n count    commands per measurement (default 1000)\n"
+	       "  -u us       upload delay of the fake vibrator\n"
+	       "  -e us       erase delay of the fake vibrator\n"
+	       "  -p us       play delay of the fake vibrator\n"
+	       "  -t seconds  how long to wait for %s (default 30)\n"
+	       "\n"
+	       "Creates a fake %s and %s, then waits for\n"
+	       "virtual_controller to be started and capture them.\n",
+	       prog, GAMEPAD_NAME, VIBRATOR_NAME, KEYS_NAME);
+}
+
+int main(int argc, char **argv)
+{
+	struct delays d = { 0 };
+	struct ff_effect effect = {
+		.type = FF_RUMBLE,
+		.u.rumble.strong_magnitude = 0xc000,
+		.u.rumble.weak_magnitude = 0x4000,
+		.replay.length = 0xffff,
+		.id = -1,
+	};
+	int to_child[2], from_child[2];
+	int vibrator, keys, pad, opt;
+	long count = 1000, timeout = 30;
+	pid_t child;
+
+	while ((opt = getopt(argc, argv, "n:u:e:p:t:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtol(optarg, NULL, 0);
+			break;
+		case 'u':
+			d.upload_us = strtol(optarg, NULL, 0);
+			break;
+		case 'e':
+			d.erase_us = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			d.play_us = strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			timeout = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -EINVAL;
+		}
+	}
+	if (count <= 0 || count > MAX_SAMPLES) {
+		printf("Count must be 1..%d\n", MAX_SAMPLES);
+		return -EINVAL;
+	}
+
+	vibrator = create_device(VIBRATOR_NAME, 1);
+	keys = create_device(KEYS_NAME, 0);
+	if (vibrator < 0 || keys < 0) {
+		printf("Unable to create fake devices: %d\n",
+		       vibrator < 0 ? vibrator : keys);
+		return -ENODEV;
+	}
+
+	if (pipe(to_child) || pipe(from_child))
+		return -errno;
+	child = fork();
+	if (child == -1)
+		return -errno;
+	if (child == 0) {
+		close(to_child[1]);
+		close(from_child[0]);
+		run_vibrator(vibrator, &d, to_child[0], from_child[1]);
+		_exit(0);
+	}
+	close(to_child[0]);
+	close(from_child[1]);
+	fcntl(from_child[0], F_SETFL, O_NONBLOCK);
+
+	printf("Created fake %s and %s, waiting for %s\n", VIBRATOR_NAME,
+	       KEYS_NAME, GAMEPAD_NAME);
+	pad = open_gamepad(GAMEPAD_NAME, timeout);
+	if (pad < 0) {
+		printf("%s did not appear\n", GAMEPAD_NAME);
+		kill(child, SIGTERM);
+		return pad;
+	}
+	/* Let the daemon finish starting up */
+	sleep(1);
+
+	bench_upload(pad, from_child[0], count);
+
+	if (ioctl(pad, EVIOCSFF, &effect)) {
+		printf("Unable to upload an effect: %d\n", -errno);
+	} else {
+		bench_play(pad, from_child[0], effect.id, count);
+		bench_buttons(keys, pad, from_child[0], effect.id, count);
+		ioctl(pad, EVIOCRMFF, effect.id);
+	}
+
+	close(to_child[1]);
+	waitpid(child, NULL, 0);
+	close(pad);
+	ioctl(keys, UI_DEV_DESTROY);
+	ioctl(vibrator, UI_DEV_DESTROY);
+	return 0;
+}
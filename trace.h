@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Event trace format shared by virtual_controller and trace_analyzer
+ *
+ * Copyright (c) 2024 Chris Morgan <macromorgan@hotmail.com>
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <linux/input.h>
+
+/* Event trace identification, "VCTR". */
+#define TRACE_MAGIC		0x52544356
+#define TRACE_VERSION		1
+
+/* Maximum number of sources described in a trace header. */
+#define TRACE_SOURCES		16
+
+/*
+ * A source as it was when recording started: its device node and name,
+ * and the axis range its driver reported for every axis in abs_bits.
+ */
+struct trace_source {
+	char node[16];
+	char name[48];
+	uint64_t abs_bits;
+	int32_t abs_min[ABS_CNT];
+	int32_t abs_max[ABS_CNT];
+};
+
+/*
+ * A trace starts with this header, followed by records until the end
+ * of the file. Fields are in host byte order.
+ */
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t sources;
+	struct trace_source source[TRACE_SOURCES];
+};
+
+/*
+ * An event as read from a source, SYN events included, with its
+ * CLOCK_MONOTONIC timestamp in microseconds.
+ */
+struct trace_record {
+	uint64_t time_us;
+	uint8_t source;
+	uint8_t type;
+	uint16_t code;
+	int32_t value;
+};
+
+#endif /* TRACE_H */
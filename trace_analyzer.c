@@ -0,0 +1,518 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Offline analyzer for event traces of the handheld device wrapper
+ *
+ * Copyright (c) 2024 Chris Morgan <macromorgan@hotmail.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+/*
+ * Inter-frame intervals are counted in buckets of INTERVAL_BUCKET_US,
+ * anything from INTERVAL_BUCKETS buckets up lands in the last one.
+ */
+#define INTERVAL_BUCKET_US	10
+#define INTERVAL_BUCKETS	10000
+
+/*
+ * Axis noise is measured over windows of REST_WINDOW_US. An axis is at
+ * rest during a window if it moved by at most 1/REST_SPREAD of its
+ * range, and its peak-to-peak noise is counted in buckets of 1/1000 of
+ * the range.
+ */
+#define REST_WINDOW_US		200000
+#define REST_SPREAD		16
+#define REST_MIN_SAMPLES	4
+#define NOISE_BUCKETS		(1000 / REST_SPREAD + 1)
+
+/* Frames of more events than this are counted as this many. */
+#define FRAME_EVENTS_MAX	64
+
+struct axis_stats {
+	uint64_t events;
+	int32_t min;
+	int32_t max;
+	int32_t win_min;
+	int32_t win_max;
+	uint32_t win_events;
+	uint64_t rest_windows;
+	double rest_center;
+	uint64_t noise[NOISE_BUCKETS];
+};
+
+struct source_stats {
+	struct trace_source info;
+	uint64_t events;
+	uint64_t frames;
+	uint64_t dropped;
+	uint64_t first_us;
+	uint64_t last_us;
+	uint64_t frame_us;
+	uint64_t window_us;
+	double interval_mean;
+	double interval_m2;
+	uint64_t interval_max;
+	uint32_t interval[INTERVAL_BUCKETS];
+	int frame_events;
+	int frame_keys;
+	int frame_axes;
+	uint64_t key_frames;
+	uint64_t axis_frames;
+	uint64_t frame_size[FRAME_EVENTS_MAX + 1];
+	uint64_t abs_seen;
+	struct axis_stats axis[ABS_CNT];
+};
+
+static struct source_stats stats[TRACE_SOURCES];
+static int sources;
+
+static const char * const abs_names[ABS_CNT] = {
+	[ABS_X] = "ABS_X", [ABS_Y] = "ABS_Y", [ABS_Z] = "ABS_Z",
+	[ABS_RX] = "ABS_RX", [ABS_RY] = "ABS_RY", [ABS_RZ] = "ABS_RZ",
+	[ABS_THROTTLE] = "ABS_THROTTLE", [ABS_RUDDER] = "ABS_RUDDER",
+	[ABS_WHEEL] = "ABS_WHEEL", [ABS_GAS] = "ABS_GAS",
+	[ABS_BRAKE] = "ABS_BRAKE",
+	[ABS_HAT0X] = "ABS_HAT0X", [ABS_HAT0Y] = "ABS_HAT0Y",
+	[ABS_HAT1X] = "ABS_HAT1X", [ABS_HAT1Y] = "ABS_HAT1Y",
+	[ABS_HAT2X] = "ABS_HAT2X", [ABS_HAT2Y] = "ABS_HAT2Y",
+	[ABS_HAT3X] = "ABS_HAT3X", [ABS_HAT3Y] = "ABS_HAT3Y",
+	[ABS_PRESSURE] = "ABS_PRESSURE", [ABS_DISTANCE] = "ABS_DISTANCE",
+	[ABS_TILT_X] = "ABS_TILT_X", [ABS_TILT_Y] = "ABS_TILT_Y",
+	[ABS_MISC] = "ABS_MISC",
+};
+
+/**
+ * axis_range() - Range of an axis
+ * @s: source of the axis
+ * @code: axis code
+ *
+ * The range the driver reported if known, otherwise the range seen so
+ * far. Return 0 if neither is usable.
+ */
+int64_t axis_range(const struct source_stats *s, int code)
+{
+	if ((s->info.abs_bits & (1ull << code)) &&
+	    s->info.abs_max[code] > s->info.abs_min[code])
+		return (int64_t)s->info.abs_max[code] - s->info.abs_min[code];
+	if (s->axis[code].events && s->axis[code].max > s->axis[code].min)
+		return (int64_t)s->axis[code].max - s->axis[code].min;
+	return 0;
+}
+
+/**
+ * close_window() - Account the rest window of a source that just ended
+ * @s: source
+ *
+ * Every axis that moved by less than 1/REST_SPREAD of its range during
+ * the window, with enough samples to tell, was at rest and its spread
+ * is its peak-to-peak noise.
+ */
+void close_window(struct source_stats *s)
+{
+	for (uint64_t bits = s->abs_seen; bits; bits &= bits - 1) {
+		struct axis_stats *a = &s->axis[__builtin_ctzll(bits)];
+		int64_t range = axis_range(s, __builtin_ctzll(bits));
+		int64_t spread = (int64_t)a->win_max - a->win_min;
+
+		if (a->win_events >= REST_MIN_SAMPLES && range &&
+		    spread * REST_SPREAD <= range) {
+			a->noise[spread * 1000 / range]++;
+			a->rest_center += ((double)a->win_min + a->win_max) / 2;
+			a->rest_windows++;
+		}
+		a->win_events = 0;
+	}
+}
+
+/**
+ * end_frame() - Account a SYN_REPORT of a source
+ * @s: source
+ * @time_us: timestamp of the SYN_REPORT
+ */
+void end_frame(struct source_stats *s, uint64_t time_us)
+{
+	if (s->frames) {
+		uint64_t interval = time_us - s->frame_us;
+		uint64_t bucket = interval / INTERVAL_BUCKET_US;
+		double delta = interval - s->interval_mean;
+
+		s->interval[bucket < INTERVAL_BUCKETS ? bucket :
+			    INTERVAL_BUCKETS - 1]++;
+		if (interval > s->interval_max)
+			s->interval_max = interval;
+		/* Welford's running mean and variance */
+		s->interval_mean += delta / s->frames;
+		s->interval_m2 += delta * (interval - s->interval_mean);
+	}
+
+	s->frames++;
+	s->frame_us = time_us;
+	s->frame_size[s->frame_events < FRAME_EVENTS_MAX ?
+		      s->frame_events : FRAME_EVENTS_MAX]++;
+	s->key_frames += !!s->frame_keys;
+	s->axis_frames += !!s->frame_axes;
+	s->frame_events = 0;
+	s->frame_keys = 0;
+	s->frame_axes = 0;
+}
+
+/**
+ * add_event() - Account one event of the trace
+ * @source: source index
+ * @time_us: event timestamp
+ * @type: event type
+ * @code: event code
+ * @value: event value
+ */
+void add_event(int source, uint64_t time_us, int type, int code,
+	       int32_t value)
+{
+	struct source_stats *s;
+	struct axis_stats *a;
+
+	if (source >= TRACE_SOURCES)
+		return;
+	if (source >= sources)
+		sources = source + 1;
+
+	s = &stats[source];
+	if (!s->events)
+		s->first_us = s->window_us = time_us;
+	s->last_us = time_us;
+	s->events++;
+
+	if (time_us - s->window_us >= REST_WINDOW_US) {
+		close_window(s);
+		s->window_us = time_us;
+	}
+
+	switch (type) {
+	case EV_SYN:
+		if (code == SYN_REPORT)
+			end_frame(s, time_us);
+		else if (code == SYN_DROPPED)
+			s->dropped++;
+		return;
+	case EV_KEY:
+		s->frame_keys++;
+		break;
+	case EV_ABS:
+		if (code >= ABS_CNT)
+			return;
+		a = &s->axis[code];
+		if (!a->events || value < a->min)
+			a->min = value;
+		if (!a->events || value > a->max)
+			a->max = value;
+		if (!a->win_events || value < a->win_min)
+			a->win_min = value;
+		if (!a->win_events || value > a->win_max)
+			a->win_max = value;
+		a->win_events++;
+		a->events++;
+		s->abs_seen |= 1ull << code;
+		s->frame_axes++;
+		break;
+	}
+	s->frame_events++;
+}
+
+/**
+ * parse_binary() - Analyze a trace recorded by virtual_controller -r
+ * @data: mapped trace
+ * @size: size of the trace
+ *
+ * Return 0 on success, negative if the trace is not usable.
+ */
+int parse_binary(const char *data, size_t size)
+{
+	const struct trace_header *hdr = (const void *)data;
+	const struct trace_record *rec;
+	size_t count;
+
+	if (size < sizeof(*hdr) || hdr->version != TRACE_VERSION ||
+	    hdr->record_size != sizeof(*rec) || hdr->sources > TRACE_SOURCES) {
+		fprintf(stderr, "Unsupported trace version\n");
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < hdr->sources; i++)
+		stats[i].info = hdr->source[i];
+	sources = hdr->sources;
+
+	rec = (const void *)(data + sizeof(*hdr));
+	count = (size - sizeof(*hdr)) / sizeof(*rec);
+	for (size_t i = 0; i < count; i++)
+		add_event(rec[i].source, rec[i].time_us, rec[i].type,
+			  rec[i].code, rec[i].value);
+	return 0;
+}
+
+/**
+ * parse_evtest() - Analyze the output of evtest
+ * @data: mapped output
+ * @size: size of the output
+ *
+ * The device description at the start provides the device name and
+ * the reported axis ranges, followed by one line per event. Event
+ * lines are parsed in place, the whole output is taken as a single
+ * source. SYN lines are told apart by the name of their code, as
+ * evtest marks each kind differently. Return 0 on success, negative if no events were found.
+ */
+int parse_evtest(const char *data, size_t size)
+{
+	struct trace_source *info = &stats[0].info;
+	const char *end = data + size;
+	int abs_section = 0, code = -1;
+
+	snprintf(info->node, sizeof(info->node), "evtest");
+	for (const char *line = data; line < end; ) {
+		const char *next = memchr(line, '\n', end - line);
+		char buf[160];
+		unsigned long sec, usec;
+		int type, n, value;
+		size_t len;
+
+		next = next ? next + 1 : end;
+		len = next - line < (long)sizeof(buf) ? (size_t)(next - line) :
+			sizeof(buf) - 1;
+		memcpy(buf, line, len);
+		buf[len] = '\0';
+		line = next;
+
+		if (sscanf(buf, "Event: time %lu.%lu, type %d (%*[^)]), "
+			   "code %d (%*[^)]), value %d", &sec, &usec, &type,
+			   &n, &value) == 5) {
+			add_event(0, sec * 1000000ull + usec, type, n, value);
+		} else if (sscanf(buf, "Event: time %lu.%lu, %n", &sec, &usec,
+				  &n) == 2) {
+			/* SYN_MT_REPORT lines are ignored */
+			if (strstr(buf + n, "SYN_REPORT"))
+				add_event(0, sec * 1000000ull + usec, EV_SYN,
+					  SYN_REPORT, 0);
+			else if (strstr(buf + n, "SYN_DROPPED"))
+				add_event(0, sec * 1000000ull + usec, EV_SYN,
+					  SYN_DROPPED, 0);
+		} else if (sscanf(buf, "Input device name: \"%47[^\"]",
+				  info->name) == 1) {
+			continue;
+		} else if (sscanf(buf, " Event type %d", &type) == 1) {
+			abs_section = type == EV_ABS;
+		} else if (sscanf(buf, " Event code %d", &n) == 1) {
+			code = abs_section && n < ABS_CNT ? n : -1;
+			if (code >= 0)
+				info->abs_bits |= 1ull << code;
+		} else if (code >= 0 && sscanf(buf, " Min %d", &value) == 1) {
+			info->abs_min[code] = value;
+		} else if (code >= 0 && sscanf(buf, " Max %d", &value) == 1) {
+			info->abs_max[code] = value;
+		}
+	}
+
+	if (!stats[0].events) {
+		fprintf(stderr, "No events found\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * interval_percentile() - Inter-frame interval percentile of a source
+ * @s: source
+ * @pct: percentile
+ *
+ * Return the interval in us, to INTERVAL_BUCKET_US.
+ */
+uint64_t interval_percentile(const struct source_stats *s, int pct)
+{
+	uint64_t target = (s->frames - 1) * pct / 100, seen = 0;
+
+	for (int i = 0; i < INTERVAL_BUCKETS; i++) {
+		seen += s->interval[i];
+		if (seen > target)
+			return (uint64_t)i * INTERVAL_BUCKET_US;
+	}
+	return s->interval_max;
+}
+
+/**
+ * noise_percentile() - Peak-to-peak rest noise percentile of an axis
+ * @a: axis
+ * @pct: percentile
+ *
+ * Return the noise in 1/1000 of the axis range.
+ */
+int noise_percentile(const struct axis_stats *a, int pct)
+{
+	uint64_t target = (a->rest_windows - 1) * pct / 100, seen = 0;
+
+	for (int i = 0; i < NOISE_BUCKETS; i++) {
+		seen += a->noise[i];
+		if (seen > target)
+			return i;
+	}
+	return NOISE_BUCKETS - 1;
+}
+
+/**
+ * report_axis() - Print the statistics and suggestions for an axis
+ * @s: source of the axis
+ * @code: axis code
+ *
+ * The suggested deadzone, in percent of the half range like the stick
+ * directive takes it, covers the offset of the rest center from the
+ * middle of the range plus half the 95th percentile rest noise, with
+ * 1% of margin. Axes noisier than 0.5% of their range get a 1-euro
+ * filter suggested, with a lower cutoff the noisier they are.
+ */
+void report_axis(const struct source_stats *s, int code)
+{
+	const struct axis_stats *a = &s->axis[code];
+	int64_t range = axis_range(s, code);
+	double center, offset;
+	int p50, p95, deadzone;
+
+	if (abs_names[code])
+		printf("  axis %s", abs_names[code]);
+	else
+		printf("  axis ABS:%d", code);
+	printf(" events=%llu seen=%d..%d", (unsigned long long)a->events,
+	       a->min, a->max);
+	if (s->info.abs_bits & (1ull << code))
+		printf(" reported=%d..%d", s->info.abs_min[code],
+		       s->info.abs_max[code]);
+
+	if (!a->rest_windows || !range) {
+		printf(" rest=none\n");
+		return;
+	}
+
+	center = a->rest_center / a->rest_windows;
+	offset = fabs(center - (s->info.abs_bits & (1ull << code) ?
+				(s->info.abs_min[code] +
+				 (double)s->info.abs_max[code]) / 2 :
+				(a->min + (double)a->max) / 2));
+	p50 = noise_percentile(a, 50);
+	p95 = noise_percentile(a, 95);
+	printf(" rest_windows=%llu center=%.0f noise_pp=%.1f%%,%.1f%%\n",
+	       (unsigned long long)a->rest_windows, center, p50 / 10.0,
+	       p95 / 10.0);
+
+	deadzone = ceil((offset + p95 * range / 2000.0) * 200 / range) + 1;
+	printf("  suggest deadzone=%d", deadzone > 100 ? 100 : deadzone);
+	if (p95 > 5)
+		printf(" filter mincutoff=%d beta=10",
+		       p95 > 50 ? 200 : 10000 / p95);
+	printf("\n");
+}
+
+/**
+ * report_source() - Print the statistics of a source
+ * @s: source
+ * @index: source index in the trace
+ */
+void report_source(const struct source_stats *s, int index)
+{
+	double duration = (s->last_us - s->first_us) / 1e6;
+	double stddev = s->frames > 2 ?
+			sqrt(s->interval_m2 / (s->frames - 2)) : 0;
+	uint64_t events = s->events - s->frames - s->dropped;
+	int largest = 0;
+
+	printf("source %d node=%s name=\"%s\"\n", index, s->info.node,
+	       s->info.name);
+	if (!s->frames) {
+		printf("  no frames\n");
+		return;
+	}
+
+	for (int i = 0; i <= FRAME_EVENTS_MAX; i++)
+		if (s->frame_size[i])
+			largest = i;
+
+	printf("  frames=%llu duration_s=%.1f rate_hz=%.1f dropped=%llu\n",
+	       (unsigned long long)s->frames, duration,
+	       duration > 0 ? (s->frames - 1) / duration : 0,
+	       (unsigned long long)s->dropped);
+	printf("  interval_us mean=%.0f stddev=%.0f p50=%llu p99=%llu "
+	       "max=%llu\n", s->interval_mean, stddev,
+	       (unsigned long long)interval_percentile(s, 50),
+	       (unsigned long long)interval_percentile(s, 99),
+	       (unsigned long long)s->interval_max);
+	printf("  frame events_mean=%.2f events_max=%d%s with_keys=%.1f%% "
+	       "with_axes=%.1f%%\n", (double)events / s->frames, largest,
+	       largest == FRAME_EVENTS_MAX ? "+" : "",
+	       100.0 * s->key_frames / s->frames,
+	       100.0 * s->axis_frames / s->frames);
+
+	for (uint64_t bits = s->abs_seen; bits; bits &= bits - 1)
+		report_axis(s, __builtin_ctzll(bits));
+}
+
+/**
+ * usage() - Print command line help
+ * @prog: program name
+ */
+void usage(const char *prog)
+{
+	printf("Usage: %s trace\n"
+	       "  trace  event trace recorded with virtual_controller -r,\n"
+	       "         or the output of evtest\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct stat st;
+	char *data;
+	int fd, ret;
+
+	if (argc != 2 || argv[1][0] == '-') {
+		usage(argv[0]);
+		return argc == 2 && !strcmp(argv[1], "-h") ? 0 : -EINVAL;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd == -1 || fstat(fd, &st)) {
+		printf("Unable to open %s\n", argv[1]);
+		return -errno;
+	}
+	if (!st.st_size) {
+		printf("%s is empty\n", argv[1]);
+		return -EINVAL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		printf("Unable to map %s\n", argv[1]);
+		return -errno;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	if (st.st_size >= 4 && *(uint32_t *)data == TRACE_MAGIC)
+		ret = parse_binary(data, st.st_size);
+	else
+		ret = parse_evtest(data, st.st_size);
+	if (ret)
+		return ret;
+
+	for (int i = 0; i < sources; i++) {
+		close_window(&stats[i]);
+		report_source(&stats[i], i);
+	}
+
+	munmap(data, st.st_size);
+	return 0;
+}
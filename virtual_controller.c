@@ -5,620 +5,7757 @@
  * Copyright (c) 2024 Chris Morgan <macromorgan@hotmail.com>
  */
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <linux/input.h>
+#include <linux/sched.h>
+#include <linux/sched/types.h>
 #include <linux/uinput.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include "trace.h"
 
 #define DEVICE_NAME		"Virtual Gamepad"
 #define DEVICE_VID		0x1234
 #define DEVICE_PID		0x5678
 
+#define CONFIG_FILE		"/etc/virtual_controller.conf"
+#define PROFILE_DB		"/usr/share/virtual_controller/profiles.bin"
+#define CAL_FILE		"/var/lib/virtual_controller/calibration"
+#define SYSFS_INPUT		"/sys/class/input"
+#define POWER_SUPPLY		"/sys/class/power_supply"
+#define CPU_DMA_LATENCY		"/dev/cpu_dma_latency"
+#define SYSFS_DMI		"/sys/class/dmi/id"
+#define DT_COMPATIBLE		"/proc/device-tree/compatible"
+
+/* Binary profile database header identification, "VCPD". */
+#define PROFILE_MAGIC		0x44504356
+#define PROFILE_VERSION		18
+
 #define MAX_EVENTS		64
 
+/*
+ * Maximum number of events read from a source at once, and buffered
+ * towards uinput before a frame is written out.
+ */
+#define READ_BATCH		64
+#define OUT_FRAME_MAX		64
+
+/*
+ * Key events held back while uinput does not accept output, and the
+ * delay between retries once EPOLLOUT did not help.
+ */
+#define QUEUE_KEYS		128
+#define QUEUE_RETRY_US		4000
+
 /* Maximum number of devices of each type we support (arbitrary). */
 #define MAX_DEVS		8
+#define MAX_SOURCES		(MAX_DEVS * 2)
+
+/*
+ * Growth of CLOCK_BOOTTIME over CLOCK_MONOTONIC above which we assume
+ * the system was suspended.
+ */
+#define SUSPEND_THRESHOLD_US	100000
+
+/*
+ * Maximum number of device match rules. Rule sets are handled as
+ * 32-bit masks so this may not be raised past 32.
+ */
+#define MAX_RULES		32
+#define RULE_HASH_SIZE		64
+
+/*
+ * Maximum number of profiles in a profile database, and of DT
+ * compatible strings and DMI matches each profile may list.
+ */
+#define MAX_PROFILES		32
+#define PROFILE_MATCHES		4
+
+/* Maximum number of remap directives per profile. */
+#define MAX_REMAPS		64
+
+/*
+ * Maximum number of sticks with deadzone processing, and the size of
+ * the lookup tables used for them. Tables are indexed by a Q15
+ * magnitude shifted down by STICK_LUT_SHIFT and interpolated.
+ */
+#define MAX_STICKS		4
+#define STICK_LUT_SHIFT		5
+#define STICK_LUT_SIZE		((32768 >> STICK_LUT_SHIFT) + 1)
+#define STICK_SQRT_SIZE		1024
+
+/*
+ * Maximum number of filtered axes, and the number of speed buckets the
+ * latency added by the filters is reported in. Bucket n covers speeds
+ * below FILTER_SPEED_BASE * 10^n units per second.
+ */
+#define MAX_FILTERS		8
+#define FILTER_BUCKETS		4
+#define FILTER_SPEED_BASE	100
+
+/*
+ * Interval in us at which a filter that has not reached the last raw
+ * value is stepped toward it once its source stops sending events.
+ */
+#define FILTER_SETTLE_US	8000
+
+/*
+ * Maximum number of normalized axes, and the largest shift their
+ * fixed-point rescale factors use.
+ */
+#define MAX_NORMS		8
+#define NORM_SHIFT_MAX		16
+
+/* Maximum number of trigger axes synthesizing a button */
+#define MAX_TRIGGERS		4
+
+/* Maximum number of turbo keys */
+#define MAX_TURBOS		8
+
+/*
+ * Maximum number of hotkey chords and of keys in a chord. Chord state
+ * is kept in key bitmaps of KEY_CNT bits.
+ */
+#define MAX_CHORDS		16
+#define CHORD_KEYS		4
+
+/* Key events chords can queue for the end of a source frame */
+#define CHORD_QUEUE		16
+
+/* Effect ids tracked by the FF output stage, all ids below FF_GAIN. */
+#define FF_EFFECTS		FF_GAIN
+
+/* Written to the CPU latency request to release it. */
+#define PM_QOS_DEFAULT		-1
+
+/* Battery capacity thresholds at which rumble is scaled down. */
+#define BATTERY_POINTS		4
+
+/*
+ * Entries kept by the flight recorder, a power of two, and the minimum
+ * time between two dumps of it, in us.
+ */
+#define FLIGHT_SIZE		256
+#define STALL_DUMP_US		10000000
+
+/*
+ * Event trace records buffered before they are written out, and the
+ * longest they are held back, in us.
+ */
+#define TRACE_BATCH		1024
+#define TRACE_FLUSH_US		1000000
+
+/*
+ * Frames injected by the startup self-test by default and at most,
+ * and how long to wait for each to come back, in ms.
+ */
+#define SELFTEST_FRAMES		64
+#define SELFTEST_MAX		512
+#define SELFTEST_TIMEOUT_MS	100
+
+/*
+ * Maximum number of D-pad conversions, and the number of cells per
+ * axis of the sector table that stick input is classified with.
+ */
+#define MAX_DPADS		2
+#define DPAD_GRID		64
+
+/*
+ * Share of its absinfo range, in percent, an axis must have been seen
+ * to travel before its observed range replaces the absinfo one.
+ */
+#define CAL_MIN_TRAVEL		60
+
+/*
+ * Distance from the current center, in percent of the absinfo range,
+ * within which an idle stick is taken to be at rest. The driver's flat
+ * range is used instead when it is larger.
+ */
+#define CAL_REST_RANGE		10
 
 #define ARRAY_SIZE(array)	(sizeof(array) / sizeof(*array))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
 #define	TEST_BIT(bit, array)	(array[bit / 8] & (1 << (bit % 8)))
 
+/* Bitmaps kept in arrays of uint64_t */
+#define BITMAP_TEST(map, bit)	((map)[(bit) / 64] & (1ull << ((bit) % 64)))
+#define BITMAP_SET(map, bit)	((map)[(bit) / 64] |= 1ull << ((bit) % 64))
+#define BITMAP_CLEAR(map, bit)	((map)[(bit) / 64] &= ~(1ull << ((bit) % 64)))
+
+/*
+ * A single device match rule. Every field whose RULE_* flag is set must
+ * match for the rule to select a device. Name and phys may be given as
+ * fnmatch() style glob patterns.
+ */
+#define RULE_NAME		(1 << 0)
+#define RULE_NAME_GLOB		(1 << 1)
+#define RULE_PHYS		(1 << 2)
+#define RULE_PHYS_GLOB		(1 << 3)
+#define RULE_BUSTYPE		(1 << 4)
+#define RULE_VENDOR		(1 << 5)
+#define RULE_PRODUCT		(1 << 6)
+#define RULE_EVBITS		(1 << 7)
+#define RULE_FF			(1 << 8)
+
+struct dev_rule {
+	char name[64];
+	char phys[64];
+	uint32_t flags;
+	uint32_t evbits;
+	uint16_t bustype;
+	uint16_t vendor;
+	uint16_t product;
+};
+
+/*
+ * The compiled rule set. Rules matching on an exact name are indexed
+ * by the hash of that name so looking up a device is a single probe
+ * of name_hash[], rules using a name glob (or no name at all) are kept
+ * in glob_mask and are the only ones that need to be walked. Rules
+ * marked RULE_FF are collected in ff_mask; when any exist only devices
+ * matching them are used for force feedback.
+ */
+struct rule_set {
+	struct dev_rule rule[MAX_RULES];
+	uint32_t name_hash[RULE_HASH_SIZE];
+	uint32_t name_mask[RULE_HASH_SIZE];
+	uint32_t glob_mask;
+	uint32_t ff_mask;
+	int count;
+};
+
+/*
+ * A remap directive as written in the configuration, applied in order
+ * by remap_build() to produce the key_map[] and abs_map[] tables. For
+ * REMAP_KEY_TO_ABS arg[] holds the axis value on release and press,
+ * for REMAP_ABS_ABOVE/REMAP_ABS_BELOW arg[0] is the threshold.
+ */
+enum remap_op {
+	REMAP_CODE,
+	REMAP_DROP,
+	REMAP_INVERT,
+	REMAP_SWAP,
+	REMAP_KEY_TO_ABS,
+	REMAP_ABS_ABOVE,
+	REMAP_ABS_BELOW,
+};
+
+struct remap_entry {
+	uint8_t op;
+	uint8_t type;
+	uint16_t code;
+	uint16_t target;
+	int32_t arg[2];
+};
+
+/*
+ * Flat per-code action as used in the forwarding path, one table each
+ * for EV_KEY and EV_ABS indexed by source code. The entry is chosen
+ * so that the common case is a single load and an unconditional
+ * rewrite:
+ *  ACTION_PASS:       emit code, (value * arg[0] + arg[1]) >> shift
+ *                     for ABS
+ *  ACTION_DROP:       emit nothing
+ *  ACTION_KEY_TO_ABS: emit ABS code with arg[!!value]
+ *  ACTION_ABS_TO_KEY: emit key code while value >= arg[0] and key
+ *                     code2 while value <= arg[1]
+ *  ACTION_STICK:      as ACTION_PASS, but the value is held for stick
+ *                     processing at the end of the frame; code2 is the
+ *                     stick index times two plus the axis
+ *  ACTION_TRIGGER:    as ACTION_PASS, and also press or release the
+ *                     button of trigger code2 as the value crosses
+ *                     its current threshold
+ *  ACTION_TURBO:      key code2 of the turbo table, toggled by the
+ *                     turbo timer while held
+ *  ACTION_CHORD:      key code, part of a hotkey chord
+ * A non-zero filter is the index plus one of the smoothing filter ABS
+ * values are passed through before being used.
+ */
+enum remap_action_op {
+	ACTION_PASS,
+	ACTION_DROP,
+	ACTION_KEY_TO_ABS,
+	ACTION_ABS_TO_KEY,
+	ACTION_STICK,
+	ACTION_TRIGGER,
+	ACTION_TURBO,
+	ACTION_CHORD,
+};
+
+struct remap_action {
+	uint8_t op;
+	uint8_t filter;
+	uint16_t code;
+	uint16_t code2;
+	uint16_t shift;
+	int32_t arg[2];
+};
+
+/*
+ * Stick processing parameters, all in percent of the axis half range
+ * except curve which is a STICK_CURVE_* value. Axial deadzone is
+ * applied to each axis on its own, the remaining parameters to the
+ * radial distance of the X/Y pair from center.
+ */
+enum stick_curve {
+	STICK_CURVE_LINEAR,
+	STICK_CURVE_QUADRATIC,
+	STICK_CURVE_CUBIC,
+};
+
+struct stick_config {
+	uint16_t code[2];
+	uint8_t deadzone;
+	uint8_t axial;
+	uint8_t outer;
+	uint8_t anti;
+	uint8_t curve;
+};
+
+/*
+ * Runtime state of a processed stick. Axis values are normalized to
+ * Q15 around the center of the range advertised in uabssetup[], with
+ * separate spans either side of center for ranges of even length,
+ * axial[] maps the magnitude of a single axis through the axial
+ * deadzone and gain[] maps the radial magnitude to a Q16 gain applied
+ * to both axes, with deadzone, saturation, anti-deadzone and the
+ * response curve folded in.
+ */
+struct stick {
+	uint16_t code[2];
+	int32_t center[2];
+	int32_t span[2][2];
+	int32_t scale[2][2];
+	int32_t minimum[2];
+	int32_t maximum[2];
+	int32_t raw[2];
+	int32_t out[2];
+	int has_axial;
+	uint16_t axial[STICK_LUT_SIZE];
+	uint32_t gain[STICK_LUT_SIZE];
+};
+
+/*
+ * Parameters of a 1-euro smoothing filter on an axis of the virtual
+ * device: the cutoff frequency at rest and for the derivative in mHz,
+ * and beta, the cutoff increase in mHz per unit/s of axis speed.
+ */
+struct filter_config {
+	uint16_t code;
+	uint32_t mincutoff;
+	uint32_t beta;
+	uint32_t dcutoff;
+};
+
+/*
+ * An axis of the virtual device that also drives a button: pressed
+ * once the axis reaches press, released once it drops to release.
+ */
+struct trigger_config {
+	uint16_t code;
+	uint16_t key;
+	int32_t press;
+	int32_t release;
+};
+
+/*
+ * Runtime state of a trigger. threshold is the value the axis is
+ * compared against to get the next button state: press while the
+ * button is up and release + 1 while it is down, so that a single
+ * compare implements the hysteresis.
+ */
+struct trigger {
+	uint16_t key;
+	uint8_t state;
+	int32_t threshold;
+	int32_t press;
+	int32_t release;
+};
+
+/* A key of the virtual device that repeats rate times a second */
+struct turbo_config {
+	uint16_t code;
+	uint16_t rate;
+};
+
+/*
+ * Runtime state of a turbo key: whether its source key is held, the
+ * state of the output key and when it is toggled next.
+ */
+struct turbo {
+	uint16_t code;
+	uint8_t held;
+	uint8_t state;
+	uint32_t period_us;
+	uint64_t deadline_us;
+};
+
+/*
+ * A hotkey chord: keys to be pressed in order, the last one firing the
+ * action, which is to send key code, run cmd or dump statistics.
+ */
+enum chord_action {
+	CHORD_KEY,
+	CHORD_EXEC,
+	CHORD_STATS,
+};
+
+struct chord_config {
+	uint16_t key[CHORD_KEYS];
+	uint8_t keys;
+	uint8_t action;
+	uint16_t code;
+	char cmd[128];
+};
+
+struct chord {
+	uint16_t key[CHORD_KEYS];
+	uint8_t keys;
+	uint8_t action;
+	uint16_t code;
+	const char *cmd;
+	uint64_t fired;
+};
+
+/*
+ * A D-pad conversion from one of keys (BTN_DPAD_*), a hat or a stick
+ * to another. in_code[] are the input axes unless the input is keys,
+ * out_code[] the output axes unless the output is keys. deadzone is
+ * in percent of the stick half range, ways is 4 or 8.
+ */
+enum dpad_kind {
+	DPAD_KEYS,
+	DPAD_HAT,
+	DPAD_STICK,
+};
+
+#define DPAD_UP			(1 << 0)
+#define DPAD_DOWN		(1 << 1)
+#define DPAD_LEFT		(1 << 2)
+#define DPAD_RIGHT		(1 << 3)
+
+struct dpad_config {
+	uint8_t from;
+	uint8_t to;
+	uint8_t ways;
+	uint8_t deadzone;
+	uint16_t in_code[2];
+	uint16_t out_code[2];
+};
+
+/*
+ * Runtime state of a D-pad conversion. held is the set of pressed
+ * input keys and value[] the last input axis values, both as DPAD_*
+ * direction bits, out the direction last emitted. Stick input is
+ * quantized to the sector table by (value - center) * scale >> 16,
+ * stick output takes out_value[] for negative, centered and positive.
+ */
+struct dpad {
+	uint8_t from;
+	uint8_t to;
+	uint8_t held;
+	uint8_t out;
+	uint16_t out_code[2];
+	int32_t value[2];
+	int32_t center[2];
+	int32_t scale[2];
+	int32_t out_value[2][3];
+	uint8_t sector[DPAD_GRID][DPAD_GRID];
+};
+
+/*
+ * Range an axis of the virtual device is normalized to.
+ */
+struct norm_config {
+	uint16_t code;
+	int32_t minimum;
+	int32_t maximum;
+};
+
+/*
+ * Normalization of an output axis as set up: the source range it was
+ * computed from and the fixed-point factor, mul / 2^shift, applied.
+ */
+struct axis_norm {
+	uint16_t code;
+	int32_t minimum;
+	int32_t maximum;
+	int32_t in_min;
+	int32_t in_max;
+	int32_t mul;
+	int shift;
+};
+
+/*
+ * Runtime state of a 1-euro filter. The filtered value and speed are
+ * kept in Q8 so that sub-unit movement still accumulates, timestamps
+ * are the low 32 bits of the source event time in microseconds. raw is
+ * the last unfiltered value and act the remap action it came through,
+ * for settling the filter once events stop.
+ */
+struct axis_filter {
+	int32_t value;
+	int32_t speed;
+	int32_t out;
+	int32_t raw;
+	const struct remap_action *act;
+	uint32_t last_us;
+	uint32_t mincutoff;
+	uint32_t beta;
+	uint32_t dtau;
+	uint16_t code;
+	uint8_t primed;
+	uint64_t passed;
+	uint64_t suppressed;
+	uint64_t settled;
+	uint64_t lag_sum[FILTER_BUCKETS];
+	uint32_t lag_count[FILTER_BUCKETS];
+};
+
+/*
+ * Adaptive poll interval of polled sources, in ms: fast while input is
+ * active, slow once there was no input for idle_ms. Disabled if
+ * fast_ms is zero.
+ */
+struct poll_config {
+	uint16_t fast_ms;
+	uint16_t slow_ms;
+	uint32_t idle_ms;
+};
+
+/*
+ * Reconnecting of lost source devices, in ms: the first retry is made
+ * initial_ms after the loss and the interval doubles up to max_ms.
+ * Disabled if initial_ms is zero.
+ */
+struct reconnect_config {
+	uint32_t initial_ms;
+	uint32_t max_ms;
+};
+
+/*
+ * Calibration learning of normalized axes, enabled if idle_ms is not
+ * zero: the rest center is sampled once input has been idle for
+ * idle_ms, and calibrations are stored in path.
+ */
+struct cal_config {
+	uint32_t idle_ms;
+	char path[128];
+};
+
+/*
+ * FF output stage: commands to the physical device are collected for
+ * window_ms after the first one and written at most rate_hz times per
+ * second. Both are disabled if zero.
+ */
+struct ff_config {
+	uint32_t window_ms;
+	uint32_t rate_hz;
+};
+
+/*
+ * Battery aware rumble scaling, disabled if there are no points. The
+ * battery is checked every interval_s seconds. At or below capacity[i]
+ * percent, rumble plays at gain[i] percent of its strength. Points are
+ * sorted by decreasing capacity.
+ */
+struct battery_config {
+	char supply[32];
+	uint32_t interval_s;
+	uint8_t points;
+	uint8_t capacity[BATTERY_POINTS];
+	uint8_t gain[BATTERY_POINTS];
+};
+
+/*
+ * CPU latency control: a latency_us PM QoS request is held while input
+ * has been seen within idle_ms, disabled if idle_ms is zero. The timer
+ * slack of the daemon is set to slack_ns, unless zero.
+ */
+struct qos_config {
+	int32_t latency_us;
+	uint32_t idle_ms;
+	uint32_t slack_ns;
+};
+
+/*
+ * Input boost: on the first input after idle_ms without any, the
+ * minimum utilization clamp of the daemon, and of the cgroup at path
+ * cgroup if set, is raised to min (of 1024) for window_ms. Disabled if
+ * window_ms is zero.
+ */
+struct boost_config {
+	uint32_t min;
+	uint32_t window_ms;
+	uint32_t idle_ms;
+	char cgroup[96];
+};
+
+/*
+ * Main loop stall detection, disabled if budget_ms is zero. A loop
+ * iteration taking longer than budget_ms dumps the flight recorder.
+ */
+struct stall_config {
+	uint32_t budget_ms;
+};
+
+/*
+ * Startup latency self-test, looping frames back through the virtual
+ * device. Disabled if frames is zero.
+ */
+struct selftest_config {
+	uint32_t frames;
+};
+
+/*
+ * Tracks whether input has been seen recently. Activity is recorded
+ * with a single store, the timerfd is only armed when going from idle
+ * to active and re-armed on expiry if activity happened meanwhile.
+ */
+struct idle_timer {
+	int fd;
+	int active;
+	uint64_t timeout_us;
+	uint64_t last_us;
+};
+
+/*
+ * A per-handheld profile: what to match it against, which devices to
+ * capture and what identity the virtual device presents. Profiles only
+ * contain plain data so that a compiled profile database can be loaded
+ * with a single mmap() and used as is. A profile with no compatible or
+ * dmi entries is a fallback that matches any system. DMI entries take
+ * the form "field:glob" and must all match.
+ */
+struct profile {
+	char name[32];
+	char compatible[PROFILE_MATCHES][64];
+	char dmi[PROFILE_MATCHES][64];
+	char output_name[UINPUT_MAX_NAME_SIZE];
+	uint16_t output_bustype;
+	uint16_t output_vendor;
+	uint16_t output_product;
+	struct rule_set rules;
+	struct remap_entry remap[MAX_REMAPS];
+	int remaps;
+	struct stick_config stick[MAX_STICKS];
+	int sticks;
+	struct filter_config filter[MAX_FILTERS];
+	int filters;
+	struct norm_config norm[MAX_NORMS];
+	int norms;
+	struct trigger_config trigger[MAX_TRIGGERS];
+	int triggers;
+	struct dpad_config dpad[MAX_DPADS];
+	int dpads;
+	struct turbo_config turbo[MAX_TURBOS];
+	int turbos;
+	struct chord_config chord[MAX_CHORDS];
+	int chords;
+	struct poll_config poll;
+	struct reconnect_config reconnect;
+	struct cal_config cal;
+	struct selftest_config selftest;
+	struct stall_config stall;
+	struct ff_config ff;
+	struct battery_config battery;
+	struct qos_config qos;
+	struct boost_config boost;
+};
+
+/* Header of the binary profile database, followed by the profiles. */
+struct profile_db_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t profile_size;
+	uint32_t count;
+};
+
+struct profile_db {
+	struct profile *profile;
+	int count;
+};
+
+/*
+ * Identity of an input device as read from sysfs. Only the name is
+ * read up front, the remaining fields are filled in on demand when a
+ * candidate rule needs them.
+ */
+struct dev_id {
+	char name[256];
+	char phys[256];
+	uint16_t bustype;
+	uint16_t vendor;
+	uint16_t product;
+	uint32_t evbits;
+	int have_id;
+};
+
+/*
+ * An opened source device. buf holds events read from the device, of
+ * which the first pending ones are an incomplete frame. The shadow
+ * state in keys[] and abs[] is the state of the device as of the last
+ * frame forwarded, and key_bits[] and abs_bits the keys and axes the
+ * device has. A lost source keeps its entry with fd set to -1 until
+ * it is reconnected; node and rule identify the device to look for,
+ * type and fd_slot the abs_fd[] or key_fd[] entry it was opened as.
+ * abs_map is the abs remap table events of the source are looked up
+ * in, which differs from the shared one if some of its axes were
+ * moved to avoid a conflict with another source. unit identifies the
+ * physical device for stored calibrations; cal_min[] and cal_max[]
+ * are the observed travel of each axis and cal_center[] its rest
+ * center, in use for the cal_learned axes out of the cal_axes ones.
+ */
+struct source {
+	int fd;
+	int pending;
+	int dropping;
+	struct input_event buf[READ_BATCH];
+	uint8_t key_bits[KEY_CNT / 8];
+	uint8_t keys[KEY_CNT / 8];
+	uint64_t abs_bits;
+	int32_t abs[ABS_CNT];
+	int32_t abs_center[ABS_CNT];
+	int32_t abs_flat[ABS_CNT];
+	int32_t abs_min[ABS_CNT];
+	int32_t abs_max[ABS_CNT];
+	uint32_t unit;
+	uint64_t cal_axes;
+	uint64_t cal_learned;
+	uint64_t cal_centered;
+	int32_t cal_min[ABS_CNT];
+	int32_t cal_max[ABS_CNT];
+	int32_t cal_center[ABS_CNT];
+	char node[16];
+	int rule;
+	int type;
+	int *fd_slot;
+	struct remap_action *abs_map;
+	uint32_t backoff_ms;
+	uint64_t retry_us;
+};
+
+/*
+ * Output that could not be written to uinput yet. Key events are kept
+ * in order, axes only keep their latest value.
+ */
+struct out_queue {
+	struct input_event key[QUEUE_KEYS];
+	int keys;
+	uint64_t abs_dirty;
+	int32_t abs[ABS_CNT];
+	int pollout;
+	int retry_fd;
+	uint64_t queued;
+	uint64_t coalesced;
+	uint64_t collapsed;
+	uint64_t retries;
+};
+
+/*
+ * State of the FF output stage: the gain and effect status games asked
+ * for, what the physical device was last told, and which effects have
+ * changes pending. length_ms is the length of each uploaded effect,
+ * zero for effects that play until stopped. The gain is applied scaled
+ * to scale percent.
+ */
+struct ff_output {
+	int32_t req[FF_EFFECTS];
+	int32_t hw[FF_EFFECTS];
+	uint16_t length_ms[FF_EFFECTS];
+	uint8_t dirty[FF_EFFECTS];
+	uint8_t restart[FF_EFFECTS];
+	uint8_t pending_id[FF_EFFECTS];
+	int pending;
+	int32_t gain_req;
+	int32_t gain_hw;
+	int gain_dirty;
+	uint32_t scale;
+	int timer_fd;
+	int armed;
+	uint64_t interval_us;
+	uint64_t last_us;
+	uint64_t commands;
+	uint64_t dropped;
+	uint64_t coalesced;
+	uint64_t writes;
+	uint64_t events;
+};
+
+/* What a flight recorder entry records. */
+enum flight_kind {
+	FLIGHT_WAKE,
+	FLIGHT_HANDLER,
+	FLIGHT_EVENT,
+	FLIGHT_CALL,
+	FLIGHT_DONE,
+};
+
+/* Potentially blocking calls timed by the flight recorder. */
+enum flight_call {
+	CALL_FF_UPLOAD,
+	CALL_FF_ERASE,
+	CALL_FF_PLAY,
+	CALL_STATS,
+};
+
+/*
+ * A flight recorder entry. For a wake value is the number of ready
+ * fds, for a handler arg is the epoll event mask and value the fd, for
+ * an event arg, code and value are those of the source event and time
+ * is its timestamp, for a call arg is the enum flight_call and value
+ * the time it took, as it is for the end of an iteration.
+ */
+struct flight_entry {
+	uint64_t time_us;
+	uint8_t kind;
+	uint8_t arg;
+	uint16_t code;
+	int32_t value;
+};
+
 /*
  * The struct that contains the necessary data to manage the virtual
  * input device. We currently support a single force feedback device,
  * multiple abs devices, and multiple key devices.
  */
 struct virtual_device {
+	struct profile profile;
+	struct remap_action key_map[KEY_CNT];
+	struct remap_action abs_map[ABS_CNT];
+	struct remap_action merge_map[MAX_DEVS][ABS_CNT];
+	int merge_maps;
+	uint8_t abs_key_state[ABS_CNT];
+	struct stick stick[MAX_STICKS];
+	uint16_t stick_sqrt[STICK_SQRT_SIZE];
+	uint32_t sticks_dirty;
+	struct axis_filter filter[MAX_FILTERS];
+	int filters;
+	uint32_t filters_unsettled;
+	int filter_fd;
+	int filter_armed;
+	struct axis_norm norm[MAX_NORMS];
+	int norms;
+	struct trigger trigger[MAX_TRIGGERS];
+	int triggers;
+	struct dpad dpad[MAX_DPADS];
+	int dpads;
+	uint8_t dpad_key_route[KEY_CNT];
+	uint8_t dpad_abs_route[ABS_CNT];
+	struct turbo turbo[MAX_TURBOS];
+	int turbos;
+	int turbo_fd;
+	uint8_t turbo_queue[MAX_TURBOS];
+	int turbo_queued;
+	uint64_t turbo_ticks;
+	struct chord chord[MAX_CHORDS];
+	int chords;
+	uint32_t chord_trigger[KEY_CNT];
+	uint64_t chord_modifier[KEY_CNT / 64];
+	uint64_t chord_pressed[KEY_CNT / 64];
+	uint64_t chord_deferred[KEY_CNT / 64];
+	uint64_t chord_consumed[KEY_CNT / 64];
+	int chords_deferred;
+	struct input_event chord_queue[CHORD_QUEUE];
+	int chord_queued;
+	const char *stats_path;
+	struct idle_timer poll_timer;
+	struct idle_timer cal_timer;
+	struct idle_timer qos_timer;
+	int qos_fd;
+	uint64_t qos_holds;
+	int boost_fd;
+	int boost_cgroup_fd;
+	int boosted;
+	uint64_t boost_last_us;
+	uint64_t boosts;
+	char boost_cgroup_on[16];
+	char boost_cgroup_off[16];
+	int poll_fd[MAX_DEVS * 2];
+	int polled;
+	uint64_t poll_raised;
+	uint64_t poll_dropped;
+	struct source src[MAX_SOURCES];
+	int sources;
+	int64_t suspend_offset;
+	uint64_t sync_dropped;
+	uint64_t resumes;
+	uint64_t resync_events;
+	int reconnect_fd;
+	uint64_t sources_lost;
+	uint64_t sources_reconnected;
+	int ep_fd;
+	struct input_event out[OUT_FRAME_MAX];
+	int out_len;
+	uint64_t frame_us;
+	uint32_t selftest_frames;
+	uint32_t selftest_lost;
+	uint32_t selftest_min_ns;
+	uint32_t selftest_median_ns;
+	uint32_t selftest_p99_ns;
+	struct flight_entry flight[FLIGHT_SIZE];
+	uint32_t flight_head;
+	uint64_t stall_input_us;
+	uint64_t stall_dump_us;
+	uint64_t stalls;
+	uint64_t late_wakes;
+	uint64_t stall_worst_us;
+	uint64_t late_worst_us;
+	int trace_fd;
+	int traced;
+	uint64_t trace_flush_us;
+	uint64_t trace_records;
+	struct trace_record trace[TRACE_BATCH];
+	struct out_queue queue;
 	struct uinput_setup usetup;
 	struct uinput_abs_setup uabssetup[ABS_MAX];
 	int uinput_fd;
 	int ff_fd;
+	struct ff_output ff;
+	int battery_fd;
+	int battery_capacity;
+	int battery_charging;
+	char battery_supply[64];
 	int abs_fd[MAX_DEVS];
 	int key_fd[MAX_DEVS];
 };
 
-struct dev_info {
-	const char name[256];
-};
+struct dev_info {
+	const char name[256];
+};
+
+/* Set from the SIGUSR1 handler, handled from the main loop. */
+static volatile sig_atomic_t stats_requested;
+
+/* Set from the SIGTERM and SIGINT handler while recording a trace. */
+static volatile sig_atomic_t stop_requested;
+
+_Static_assert(MAX_SOURCES <= TRACE_SOURCES, "trace header too small");
+
+/*
+ * Default list of all the "devices of interest" that we're looking to
+ * capture, used when no configuration file provides device rules. Only
+ * the first 8 key and abs devices and last ff device that match will
+ * be used by the driver.
+ */
+static struct dev_info input_devs[] = {
+	{ .name = "adc-joystick" },
+	{ .name = "adc-keys" },
+	{ .name = "adc-trigger" },
+	{ .name = "gpio-keys" },
+	{ .name = "gpio-keys-control" },
+	{ .name = "gpio-keys-vol" },
+	{ .name = "gpio-vibrator" },
+	{ .name = "gpio-vibrator-l" },
+	{ .name = "gpio-vibrator-r" },
+	{ .name = "pwm-vibrator" },
+	{ .name = "pwm-vibrator-l" },
+	{ .name = "pwm-vibrator-r" },
+};
+
+/**
+ * remap_build() - Build the flat remap tables from the profile
+ * @v_dev: main virtual device struct
+ *
+ * Start from identity tables and apply the profile's remap directives
+ * in order. The tables are only built once at startup; the forwarding
+ * path just indexes them by event code.
+ */
+void remap_build(struct virtual_device *v_dev)
+{
+	const struct remap_entry *entry;
+	struct remap_action *act, *other, tmp;
+
+	for (int i = 0; i < KEY_CNT; i++) {
+		act = &v_dev->key_map[i];
+		memset(act, 0, sizeof(*act));
+		act->op = ACTION_PASS;
+		act->code = i;
+	}
+
+	for (int i = 0; i < ABS_CNT; i++) {
+		act = &v_dev->abs_map[i];
+		memset(act, 0, sizeof(*act));
+		act->op = ACTION_PASS;
+		act->code = i;
+		act->arg[0] = 1;
+	}
+
+	for (int i = 0; i < v_dev->profile.remaps; i++) {
+		entry = &v_dev->profile.remap[i];
+		act = entry->type == EV_KEY ? &v_dev->key_map[entry->code] :
+					      &v_dev->abs_map[entry->code];
+
+		switch (entry->op) {
+		case REMAP_CODE:
+			act->code = entry->target;
+			break;
+		case REMAP_DROP:
+			act->op = ACTION_DROP;
+			break;
+		case REMAP_INVERT:
+			act->arg[0] = -1;
+			break;
+		case REMAP_SWAP:
+			other = &v_dev->abs_map[entry->target];
+			tmp = *act;
+			act->code = other->code;
+			other->code = tmp.code;
+			break;
+		case REMAP_KEY_TO_ABS:
+			act->op = ACTION_KEY_TO_ABS;
+			act->code = entry->target;
+			act->arg[0] = entry->arg[0];
+			act->arg[1] = entry->arg[1];
+			break;
+		case REMAP_ABS_ABOVE:
+		case REMAP_ABS_BELOW:
+			if (act->op != ACTION_ABS_TO_KEY) {
+				act->op = ACTION_ABS_TO_KEY;
+				act->code = KEY_RESERVED;
+				act->code2 = KEY_RESERVED;
+				act->arg[0] = INT32_MAX;
+				act->arg[1] = INT32_MIN;
+			}
+			if (entry->op == REMAP_ABS_ABOVE) {
+				act->code = entry->target;
+				act->arg[0] = entry->arg[0];
+			} else {
+				act->code2 = entry->target;
+				act->arg[1] = entry->arg[0];
+			}
+			break;
+		}
+	}
+
+	v_dev->norms = v_dev->profile.norms;
+	for (int i = 0; i < v_dev->norms; i++) {
+		memset(&v_dev->norm[i], 0, sizeof(v_dev->norm[i]));
+		v_dev->norm[i].code = v_dev->profile.norm[i].code;
+		v_dev->norm[i].minimum = v_dev->profile.norm[i].minimum;
+		v_dev->norm[i].maximum = v_dev->profile.norm[i].maximum;
+	}
+}
+
+/**
+ * remap_set_key() - Advertise a key synthesized by the remap stage
+ * @v_dev: main virtual device struct
+ * @code: key code, KEY_RESERVED is ignored
+ */
+void remap_set_key(struct virtual_device *v_dev, int code)
+{
+	if (code == KEY_RESERVED)
+		return;
+
+	ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(v_dev->uinput_fd, UI_SET_KEYBIT, code);
+}
+
+/*
+ * Axis codes handed out, in order of preference, to source axes that
+ * would otherwise collide with an axis of another source.
+ */
+static const uint8_t merge_spare_codes[] = {
+	ABS_RX, ABS_RY, ABS_Z, ABS_RZ,
+	ABS_HAT0X, ABS_HAT0Y, ABS_HAT1X, ABS_HAT1Y,
+	ABS_HAT2X, ABS_HAT2Y, ABS_HAT3X, ABS_HAT3Y,
+	ABS_THROTTLE, ABS_RUDDER, ABS_WHEEL, ABS_GAS, ABS_BRAKE, ABS_MISC,
+};
+
+/**
+ * merge_plan() - Resolve axis code conflicts between ABS sources
+ * @v_dev: main virtual device struct
+ *
+ * Sources claim their output axes in order. When an axis of a source
+ * comes out on a code already claimed by an earlier source, the source
+ * gets a private copy of the abs remap table with that axis moved to
+ * a spare code no source uses. The forwarding path looks events up in
+ * the table of their source, so the merge costs nothing per event.
+ * Return number of axes moved.
+ */
+int merge_plan(struct virtual_device *v_dev)
+{
+	uint64_t wanted = 0, taken = 0;
+	int moved = 0;
+
+	for (int i = 0; i < KEY_CNT; i++) {
+		if (v_dev->key_map[i].op == ACTION_KEY_TO_ABS)
+			wanted |= 1ull << v_dev->key_map[i].code;
+	}
+	for (int i = 0; i < v_dev->sources; i++) {
+		struct source *src = &v_dev->src[i];
+
+		if (src->type != EV_ABS)
+			continue;
+		for (uint64_t bits = src->abs_bits; bits; bits &= bits - 1) {
+			struct remap_action *act =
+				&v_dev->abs_map[__builtin_ctzll(bits)];
+
+			if (act->op == ACTION_PASS)
+				wanted |= 1ull << act->code;
+		}
+	}
+
+	for (int i = 0; i < v_dev->sources; i++) {
+		struct source *src = &v_dev->src[i];
+		struct remap_action *map = v_dev->abs_map;
+		uint64_t own = 0;
+
+		if (src->type != EV_ABS)
+			continue;
+		for (uint64_t bits = src->abs_bits; bits; bits &= bits - 1) {
+			int code = __builtin_ctzll(bits);
+			uint64_t used = wanted | taken | own;
+			int spare = -1;
+
+			if (map[code].op != ACTION_PASS)
+				continue;
+			if (!(taken & (1ull << map[code].code))) {
+				own |= 1ull << map[code].code;
+				continue;
+			}
+
+			for (int s = 0; s < (int)ARRAY_SIZE(merge_spare_codes);
+			     s++) {
+				if (!(used & (1ull << merge_spare_codes[s]))) {
+					spare = merge_spare_codes[s];
+					break;
+				}
+			}
+			if (spare < 0 || (map == v_dev->abs_map &&
+					  v_dev->merge_maps == MAX_DEVS)) {
+				printf("No free axis for axis %d of %s\n",
+				       code, src->node);
+				continue;
+			}
+
+			if (map == v_dev->abs_map) {
+				map = v_dev->merge_map[v_dev->merge_maps++];
+				memcpy(map, v_dev->abs_map,
+				       sizeof(v_dev->abs_map));
+			}
+			printf("Moving axis %d of %s to axis %d\n",
+			       map[code].code, src->node, spare);
+			map[code].code = spare;
+			own |= 1ull << spare;
+			moved++;
+		}
+		taken |= own;
+		src->abs_map = map;
+	}
+
+	return moved;
+}
+
+/**
+ * norm_find() - Look up the normalization of an output axis
+ * @v_dev: main virtual device struct
+ * @code: axis code on the virtual device
+ *
+ * Return the normalization state, or NULL if the axis keeps the range
+ * of its source.
+ */
+struct axis_norm *norm_find(struct virtual_device *v_dev, int code)
+{
+	for (int i = 0; i < v_dev->norms; i++) {
+		if (v_dev->norm[i].code == code)
+			return &v_dev->norm[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * norm_apply() - Fold an axis normalization into its remap action
+ * @act: remap action of the source axis
+ * @norm: normalization of the output axis
+ * @in_min: lowest value of the source axis
+ * @in_max: highest value of the source axis
+ *
+ * Set the multiplier, offset and shift of @act so that [@in_min,
+ * @in_max] maps linearly onto the normalized range, keeping the axis
+ * inverted if it was. The shift is chosen as large as possible without
+ * the multiplier or offset overflowing, and the multiplier is rounded
+ * down so that @in_max never maps past the top of the range.
+ */
+void norm_apply(struct remap_action *act, struct axis_norm *norm,
+		int32_t in_min, int32_t in_max)
+{
+	int64_t out_span = (int64_t)norm->maximum - norm->minimum;
+	int64_t in_span = max((int64_t)in_max - in_min, 1);
+	int64_t base = act->arg[0] < 0 ? (int64_t)in_min + in_max : 0;
+	int64_t mul = 0, add = 0;
+	int shift;
+
+	for (shift = NORM_SHIFT_MAX; shift >= 0; shift--) {
+		mul = (out_span << shift) / in_span;
+		add = (base - in_min) * mul +
+		      ((int64_t)norm->minimum << shift) +
+		      ((1 << shift) >> 1);
+		if (mul <= INT32_MAX && add >= INT32_MIN && add <= INT32_MAX)
+			break;
+	}
+
+	act->arg[0] = act->arg[0] < 0 ? -mul : mul;
+	act->arg[1] = add;
+	act->shift = max(shift, 0);
+	norm->in_min = in_min;
+	norm->in_max = in_max;
+	norm->mul = mul;
+	norm->shift = act->shift;
+}
+
+/**
+ * norm_absinfo() - Rescale the absinfo of a normalized axis
+ * @act: remap action of the source axis, as set by norm_apply()
+ * @norm: normalization of the output axis
+ * @absinfo: absinfo of the source axis, rewritten in place
+ */
+void norm_absinfo(const struct remap_action *act,
+		  const struct axis_norm *norm,
+		  struct input_absinfo *absinfo)
+{
+	absinfo->value = ((int64_t)absinfo->value * act->arg[0] +
+			  act->arg[1]) >> act->shift;
+	absinfo->fuzz = ((int64_t)absinfo->fuzz * norm->mul) >> act->shift;
+	absinfo->flat = ((int64_t)absinfo->flat * norm->mul) >> act->shift;
+	absinfo->minimum = norm->minimum;
+	absinfo->maximum = norm->maximum;
+	absinfo->resolution = 0;
+}
+
+/**
+ * cal_range() - Source range to normalize a calibrated axis from
+ * @src: source of the axis
+ * @code: axis code on the source
+ * @norm: normalization of the output axis
+ * @lo: returned bottom of the range
+ * @hi: returned top of the range
+ *
+ * Until an axis has been calibrated its absinfo range is used. Once
+ * it has, the observed travel is used instead, and for stick ranges it
+ * is made symmetric around the observed rest center so that the rest
+ * position maps to zero. The absinfo center stands in until a rest
+ * center has been observed.
+ */
+void cal_range(const struct source *src, int code,
+	       const struct axis_norm *norm, int32_t *lo, int32_t *hi)
+{
+	int32_t center, half;
+
+	center = src->cal_centered & (1ull << code) ?
+		 src->cal_center[code] : src->abs_center[code];
+	if (!(src->cal_learned & (1ull << code))) {
+		*lo = src->abs_min[code];
+		*hi = src->abs_max[code];
+		return;
+	}
+
+	*lo = src->cal_min[code];
+	*hi = src->cal_max[code];
+	if (norm->minimum < 0 && center > *lo && center < *hi) {
+		half = max(center - *lo, *hi - center);
+		*lo = center - half;
+		*hi = center + half;
+	}
+}
+
+/**
+ * cal_load() - Load the stored calibration of all sources
+ * @v_dev: main virtual device struct
+ *
+ * Each line of the calibration file holds one axis of one unit as
+ * "unit=<hex> axis=<code> min=<n> max=<n> center=<n>". Entries of
+ * units that are not present are ignored.
+ */
+void cal_load(struct virtual_device *v_dev)
+{
+	int32_t lo, hi, center;
+	unsigned int unit;
+	char line[128];
+	FILE *in;
+	int code;
+
+	in = fopen(v_dev->profile.cal.path, "r");
+	if (!in)
+		return;
+
+	while (fgets(line, sizeof(line), in)) {
+		if (sscanf(line, "unit=%x axis=%d min=%d max=%d center=%d",
+			   &unit, &code, &lo, &hi, &center) != 5 ||
+		    code < 0 || code >= ABS_CNT || lo >= hi)
+			continue;
+
+		for (int i = 0; i < v_dev->sources; i++) {
+			struct source *src = &v_dev->src[i];
+
+			if (src->unit != unit)
+				continue;
+			src->cal_min[code] = lo;
+			src->cal_max[code] = hi;
+			src->cal_center[code] = center;
+			src->cal_learned |= 1ull << code;
+			src->cal_centered |= 1ull << code;
+		}
+	}
+
+	fclose(in);
+}
+
+/**
+ * abs_map_entry() - Index the shared and private abs remap tables
+ * @v_dev: main virtual device struct
+ * @i: index, the first ABS_CNT entries are in the shared table
+ *
+ * Lets setup code that patches remap actions by output code walk every
+ * abs remap table in one loop.
+ */
+struct remap_action *abs_map_entry(struct virtual_device *v_dev, int i)
+{
+	if (i < ABS_CNT)
+		return &v_dev->abs_map[i];
+	return &v_dev->merge_map[i / ABS_CNT - 1][i % ABS_CNT];
+}
+
+/**
+ * trigger_build() - Route trigger axes through ACTION_TRIGGER
+ * @v_dev: main virtual device struct
+ *
+ * Set up the button of every trigger in the profile and advertise it.
+ * Must be called once the axis codes of all sources are final and
+ * before the virtual device is created. Return number of triggers.
+ */
+int trigger_build(struct virtual_device *v_dev)
+{
+	v_dev->triggers = v_dev->profile.triggers;
+	for (int i = 0; i < v_dev->triggers; i++) {
+		const struct trigger_config *cfg = &v_dev->profile.trigger[i];
+		struct trigger *trig = &v_dev->trigger[i];
+
+		trig->key = cfg->key;
+		trig->press = cfg->press;
+		trig->release = cfg->release + 1;
+		trig->threshold = trig->press;
+		trig->state = 0;
+		remap_set_key(v_dev, trig->key);
+
+		for (int j = 0; j < ABS_CNT * (v_dev->merge_maps + 1); j++) {
+			struct remap_action *act = abs_map_entry(v_dev, j);
+
+			if (act->op == ACTION_PASS && act->code == cfg->code) {
+				act->op = ACTION_TRIGGER;
+				act->code2 = i;
+			}
+		}
+	}
+
+	return v_dev->triggers;
+}
+
+/**
+ * enumerate_abs_devices() - Identify ABS axes and features
+ * @v_dev: pointer to virtual_device struct
+ *
+ * Enumerate ABS axes and add them to the uinput virtual device, as
+ * rewritten by the remap tables. Return number of devices found on
+ * success or negative on error.
+ */
+int enumerate_abs_devices(struct virtual_device *v_dev)
+{
+	uint8_t abs_b[ABS_MAX/8 + 1];
+	int dev_count = 0;
+	int ret = 0;
+	uint8_t abs_index = 0;
+
+	if (v_dev->abs_fd[0] <= 0)
+		return 0;
+
+	for (int dev_num = 0; dev_num < MAX_DEVS; dev_num++) {
+		if (v_dev->abs_fd[dev_num] > 0)
+			dev_count += 1;
+	}
+
+	merge_plan(v_dev);
+	trigger_build(v_dev);
+	if (v_dev->profile.cal.idle_ms)
+		cal_load(v_dev);
+
+	for (int k = 0; k < v_dev->sources; k++) {
+		struct source *src = &v_dev->src[k];
+		struct remap_action *map = src->abs_map;
+
+		if (src->type != EV_ABS)
+			continue;
+		ioctl(src->fd, EVIOCGBIT(EV_ABS, sizeof(abs_b)), abs_b);
+
+		for (int i = 0; i < ABS_MAX; i++) {
+			struct remap_action *act = &map[i];
+			struct input_absinfo absinfo;
+			struct axis_norm *norm;
+			int code = act->code;
+
+			if (!TEST_BIT(i, abs_b))
+				continue;
+
+			ret = ioctl(src->fd, EVIOCGABS(i), &absinfo);
+			if (ret)
+				continue;
+
+			if (act->op == ACTION_DROP)
+				continue;
+			if (act->op == ACTION_ABS_TO_KEY) {
+				remap_set_key(v_dev, act->code);
+				remap_set_key(v_dev, act->code2);
+				continue;
+			}
+
+			/* An inverted axis mirrors around its own range */
+			if (act->arg[0] < 0)
+				act->arg[1] = absinfo.minimum +
+					      absinfo.maximum;
+
+			norm = norm_find(v_dev, code);
+			if (norm) {
+				int32_t lo, hi;
+
+				if (v_dev->profile.cal.idle_ms)
+					src->cal_axes |= 1ull << i;
+				norm_apply(act, norm, absinfo.minimum,
+					   absinfo.maximum);
+				norm_absinfo(act, norm, &absinfo);
+				cal_range(src, i, norm, &lo, &hi);
+				norm_apply(act, norm, lo, hi);
+			}
+
+			v_dev->uabssetup[code].absinfo = absinfo;
+			ret = ioctl(v_dev->uinput_fd, UI_SET_ABSBIT, code);
+			if (ret)
+				continue;
+			abs_index |= code;
+			v_dev->uabssetup[code].code = code;
+			ret = ioctl(v_dev->uinput_fd, UI_ABS_SETUP,
+				    &v_dev->uabssetup[code]);
+			if (ret)
+				printf("Unable to set abs axis %d\n", code);
+		}
+	}
+
+	v_dev->usetup.id.version |= abs_index;
+	return dev_count;
+}
+
+/**
+ * enumerate_ff_device() - Identify supported force feedback features
+ * @v_dev: pointer to virtual_device struct
+ *
+ * Enumerate force feedback features and add them to the uinput virtual
+ * device. Return 0 on success.
+ */
+int enumerate_ff_device(struct virtual_device *v_dev)
+{
+	uint8_t ff_b[FF_MAX/8 + 1];
+	int ret = 0;
+	uint8_t ff_index = 0;
+
+	if (v_dev->ff_fd <= 0)
+		return 0;
+
+	ret = ioctl(v_dev->ff_fd,
+		    EVIOCGBIT(EV_FF, sizeof(ff_b)), ff_b);
+	if (ret < 0) {
+		printf("Unable to enumerate FF device: %d\n", ret);
+		return -ENODEV;
+	}
+
+	for (int i = 0; i < FF_MAX; i++) {
+		if (TEST_BIT(i, ff_b)) {
+			ioctl(v_dev->uinput_fd, UI_SET_FFBIT, i);
+			ff_index |= i;
+		}
+	}
+
+	ret = ioctl(v_dev->ff_fd, EVIOCGEFFECTS, &v_dev->usetup.ff_effects_max);
+	if (ret < 0) {
+		printf("Unable to determine max FF effects\n");
+		return -EIO;
+	};
+
+	v_dev->usetup.id.version ^= ff_index;
+	return 0;
+}
+
+/**
+ * enumerate_key_devices() - Identify supported keys
+ * @v_dev: pointer to virtual_device struct
+ *
+ * Enumerate keys and add them to the uinput virtual device, as
+ * rewritten by the remap tables. Return number of keys identified.
+ */
+int enumerate_key_devices(struct virtual_device *v_dev)
+{
+	uint8_t key_b[KEY_MAX/8 + 1];
+	int dev_count = 0;
+	int keys = 0;
+	uint16_t key_index = 0;
+
+	for (int dev_num = 0; dev_num < MAX_DEVS; dev_num++) {
+		if (v_dev->key_fd[dev_num] > 0)
+			dev_count += 1;
+	}
+
+	for (int k = 0; k < dev_count; k++) {
+		ioctl(v_dev->key_fd[k],
+		      EVIOCGBIT(EV_KEY, sizeof(key_b)), key_b);
+		for (int i = 0; i < KEY_MAX; i++) {
+			struct remap_action *act = &v_dev->key_map[i];
+
+			if (!TEST_BIT(i, key_b))
+				continue;
+
+			if (act->op == ACTION_PASS) {
+				ioctl(v_dev->uinput_fd, UI_SET_KEYBIT,
+				      act->code);
+			} else if (act->op == ACTION_KEY_TO_ABS) {
+				struct input_absinfo *absinfo =
+					&v_dev->uabssetup[act->code].absinfo;
+
+				ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_ABS);
+				ioctl(v_dev->uinput_fd, UI_SET_ABSBIT,
+				      act->code);
+				v_dev->uabssetup[act->code].code = act->code;
+				absinfo->minimum = min(act->arg[0],
+						       act->arg[1]);
+				absinfo->maximum = max(act->arg[0],
+						       act->arg[1]);
+				ioctl(v_dev->uinput_fd, UI_ABS_SETUP,
+				      &v_dev->uabssetup[act->code]);
+			}
+			key_index |= (i << 6);
+			keys += 1;
+		}
+	}
+
+	v_dev->usetup.id.version ^= key_index;
+	return keys;
+}
+
+/**
+ * rule_hash() - Hash a device name for the rule lookup table
+ * @name: NUL terminated device name
+ *
+ * FNV-1a hash of the device name. A hash of 0 is reserved to mark an
+ * empty slot in the lookup table.
+ */
+uint32_t rule_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash ? hash : 1;
+}
+
+/**
+ * rule_set_compile() - Build the lookup tables for a set of rules
+ * @rules: rule set with rule[] and count filled in
+ *
+ * Index every exact name rule by the hash of its name and collect the
+ * remaining rules into glob_mask. Must be called whenever rule[]
+ * changes and before input_device_match() is used.
+ */
+void rule_set_compile(struct rule_set *rules)
+{
+	memset(rules->name_hash, 0, sizeof(rules->name_hash));
+	memset(rules->name_mask, 0, sizeof(rules->name_mask));
+	rules->glob_mask = 0;
+	rules->ff_mask = 0;
+
+	for (int i = 0; i < rules->count; i++) {
+		struct dev_rule *rule = &rules->rule[i];
+		uint32_t hash, slot;
+
+		if (rule->flags & RULE_FF)
+			rules->ff_mask |= 1u << i;
+
+		if (!(rule->flags & RULE_NAME) ||
+		    (rule->flags & RULE_NAME_GLOB)) {
+			rules->glob_mask |= 1u << i;
+			continue;
+		}
+
+		hash = rule_hash(rule->name);
+		slot = hash & (RULE_HASH_SIZE - 1);
+		while (rules->name_hash[slot] &&
+		       rules->name_hash[slot] != hash)
+			slot = (slot + 1) & (RULE_HASH_SIZE - 1);
+
+		rules->name_hash[slot] = hash;
+		rules->name_mask[slot] |= 1u << i;
+	}
+}
+
+/**
+ * rule_set_add() - Append a rule to a rule set
+ * @rules: rule set to add to
+ * @rule: rule to copy into the set
+ *
+ * Return index of the new rule, or -ENOSPC if the set is full. The
+ * set must be recompiled with rule_set_compile() afterwards.
+ */
+int rule_set_add(struct rule_set *rules, const struct dev_rule *rule)
+{
+	if (rules->count >= MAX_RULES)
+		return -ENOSPC;
+
+	rules->rule[rules->count] = *rule;
+	return rules->count++;
+}
+
+/**
+ * load_default_rules() - Populate the rule set from input_devs[]
+ * @rules: rule set to fill
+ *
+ * Used when no configuration file supplies any device rules, this
+ * reproduces the historic behavior of matching on name alone.
+ */
+void load_default_rules(struct rule_set *rules)
+{
+	struct dev_rule rule;
+
+	memset(rules, 0, sizeof(*rules));
+	for (int i = 0; i < (int)ARRAY_SIZE(input_devs); i++) {
+		memset(&rule, 0, sizeof(rule));
+		strncpy(rule.name, input_devs[i].name, sizeof(rule.name) - 1);
+		rule.flags = RULE_NAME;
+		rule_set_add(rules, &rule);
+	}
+
+	rule_set_compile(rules);
+}
+
+/**
+ * read_sysfs_attr() - Read a single attribute of an input device
+ * @node: event node name, such as "event3"
+ * @attr: attribute path relative to the device directory
+ * @buf: buffer for the attribute contents
+ * @len: size of buf
+ *
+ * Read an attribute from /sys/class/input/<node>/device/ and strip the
+ * trailing newline. Return length read, negative on error.
+ */
+int read_sysfs_attr(const char *node, const char *attr, char *buf,
+		    size_t len)
+{
+	char path[128];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), SYSFS_INPUT "/%s/device/%s", node,
+		 attr);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret < 0)
+		return -errno;
+
+	while (ret > 0 && buf[ret - 1] == '\n')
+		ret--;
+	buf[ret] = '\0';
+
+	return ret;
+}
+
+/**
+ * read_dev_id() - Fill in the identity fields needed by detailed rules
+ * @node: event node name, such as "event3"
+ * @id: device identity with the name already filled in
+ *
+ * Read phys, input_id and supported event types from sysfs. Missing
+ * attributes are left zeroed.
+ */
+void read_dev_id(const char *node, struct dev_id *id)
+{
+	char buf[32];
+
+	if (id->have_id)
+		return;
+
+	if (read_sysfs_attr(node, "phys", id->phys, sizeof(id->phys)) < 0)
+		id->phys[0] = '\0';
+	if (read_sysfs_attr(node, "id/bustype", buf, sizeof(buf)) > 0)
+		id->bustype = strtoul(buf, NULL, 16);
+	if (read_sysfs_attr(node, "id/vendor", buf, sizeof(buf)) > 0)
+		id->vendor = strtoul(buf, NULL, 16);
+	if (read_sysfs_attr(node, "id/product", buf, sizeof(buf)) > 0)
+		id->product = strtoul(buf, NULL, 16);
+	if (read_sysfs_attr(node, "capabilities/ev", buf, sizeof(buf)) > 0)
+		id->evbits = strtoul(buf, NULL, 16);
+
+	id->have_id = 1;
+}
+
+/**
+ * rule_match() - Check a single rule against a device
+ * @rule: rule to check
+ * @node: event node name of the device
+ * @id: identity of the device, extended on demand
+ *
+ * Return 1 if every field the rule cares about matches, 0 otherwise.
+ */
+int rule_match(const struct dev_rule *rule, const char *node,
+	       struct dev_id *id)
+{
+	if (rule->flags & RULE_NAME) {
+		if (rule->flags & RULE_NAME_GLOB) {
+			if (fnmatch(rule->name, id->name, 0))
+				return 0;
+		} else if (strcmp(rule->name, id->name)) {
+			return 0;
+		}
+	}
+
+	if (!(rule->flags & ~(RULE_NAME | RULE_NAME_GLOB | RULE_FF)))
+		return 1;
+
+	read_dev_id(node, id);
+
+	if (rule->flags & RULE_PHYS) {
+		if (rule->flags & RULE_PHYS_GLOB) {
+			if (fnmatch(rule->phys, id->phys, 0))
+				return 0;
+		} else if (strcmp(rule->phys, id->phys)) {
+			return 0;
+		}
+	}
+
+	if ((rule->flags & RULE_BUSTYPE) && rule->bustype != id->bustype)
+		return 0;
+	if ((rule->flags & RULE_VENDOR) && rule->vendor != id->vendor)
+		return 0;
+	if ((rule->flags & RULE_PRODUCT) && rule->product != id->product)
+		return 0;
+	if ((rule->flags & RULE_EVBITS) &&
+	    (id->evbits & rule->evbits) != rule->evbits)
+		return 0;
+
+	return 1;
+}
+
+/**
+ * input_device_match() - Check input device against the rule set
+ * @rules: compiled rule set
+ * @node: event node name of the device, such as "event3"
+ * @id: device identity, returned filled in
+ *
+ * Check if the device is one that we want to monitor. Only the device
+ * name is read up front; it selects the candidate rules with a single
+ * hash probe, and devices for which no candidate exists are rejected
+ * without any further sysfs reads or ioctls. Return the index of the
+ * first matching rule, or -ENOENT if there is no match.
+ */
+int input_device_match(const struct rule_set *rules, const char *node,
+		       struct dev_id *id)
+{
+	uint32_t hash, slot, candidates;
+
+	memset(id, 0, sizeof(*id));
+	if (read_sysfs_attr(node, "name", id->name, sizeof(id->name)) < 0)
+		return -ENOENT;
+
+	candidates = rules->glob_mask;
+	hash = rule_hash(id->name);
+	slot = hash & (RULE_HASH_SIZE - 1);
+	while (rules->name_hash[slot]) {
+		if (rules->name_hash[slot] == hash) {
+			candidates |= rules->name_mask[slot];
+			break;
+		}
+		slot = (slot + 1) & (RULE_HASH_SIZE - 1);
+	}
+
+	while (candidates) {
+		int i = __builtin_ctz(candidates);
+
+		if (rule_match(&rules->rule[i], node, id))
+			return i;
+		candidates &= candidates - 1;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * now_us() - Current CLOCK_MONOTONIC time in microseconds
+ */
+uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+/**
+ * event_us() - Timestamp of a source event in microseconds
+ * @ev: event read from a source, which uses CLOCK_MONOTONIC
+ */
+static inline uint64_t event_us(const struct input_event *ev)
+{
+	return ev->input_event_sec * 1000000ull + ev->input_event_usec;
+}
+
+/**
+ * flight_record() - Add an entry to the flight recorder
+ * @v_dev: main virtual device struct
+ * @kind: enum flight_kind
+ * @arg: kind specific
+ * @code: kind specific
+ * @value: kind specific
+ * @time_us: CLOCK_MONOTONIC time of the entry
+ */
+static inline void flight_record(struct virtual_device *v_dev, int kind,
+				 int arg, int code, int32_t value,
+				 uint64_t time_us)
+{
+	struct flight_entry *e;
+
+	e = &v_dev->flight[v_dev->flight_head++ % FLIGHT_SIZE];
+	e->time_us = time_us;
+	e->kind = kind;
+	e->arg = arg;
+	e->code = code;
+	e->value = value;
+}
+
+/**
+ * flight_now() - Current time, if the stall detector is enabled
+ * @v_dev: main virtual device struct
+ *
+ * Return the current time in microseconds, or 0 if stall detection is
+ * disabled so that no clock is read at all.
+ */
+static inline uint64_t flight_now(struct virtual_device *v_dev)
+{
+	return v_dev->profile.stall.budget_ms ? now_us() : 0;
+}
+
+/**
+ * flight_call() - Record how long a potentially blocking call took
+ * @v_dev: main virtual device struct
+ * @call: enum flight_call
+ * @start_us: time the call started, from flight_now()
+ */
+static inline void flight_call(struct virtual_device *v_dev, int call,
+			       uint64_t start_us)
+{
+	if (start_us)
+		flight_record(v_dev, FLIGHT_CALL, call, 0,
+			      now_us() - start_us, start_us);
+}
+
+/**
+ * idle_timer_init() - Create the timerfd behind an idle timer
+ * @t: idle timer
+ * @timeout_ms: inactivity after which the timer reports idle
+ *
+ * Return 0 on success, negative on error.
+ */
+int idle_timer_init(struct idle_timer *t, uint32_t timeout_ms)
+{
+	t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (t->fd == -1)
+		return -errno;
+
+	t->timeout_us = timeout_ms * 1000ull;
+	t->active = 0;
+	t->last_us = 0;
+	return 0;
+}
+
+/**
+ * idle_timer_arm() - Arm an idle timer to fire at a given time
+ * @t: idle timer
+ * @when_us: CLOCK_MONOTONIC expiry in microseconds
+ */
+void idle_timer_arm(struct idle_timer *t, uint64_t when_us)
+{
+	struct itimerspec its = {
+		.it_value.tv_sec = when_us / 1000000,
+		.it_value.tv_nsec = (when_us % 1000000) * 1000,
+	};
+
+	timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * idle_timer_kick() - Record input activity on an idle timer
+ * @t: idle timer
+ * @when_us: time of the activity
+ *
+ * While active this is a single store; the timer is only armed on the
+ * transition from idle. Return 1 if the timer just became active.
+ */
+static inline int idle_timer_kick(struct idle_timer *t, uint64_t when_us)
+{
+	t->last_us = when_us;
+	if (t->active)
+		return 0;
+
+	t->active = 1;
+	idle_timer_arm(t, when_us + t->timeout_us);
+	return 1;
+}
+
+/**
+ * idle_timer_expired() - Handle expiry of an idle timer
+ * @t: idle timer
+ *
+ * If there was activity since the timer was armed, re-arm it for the
+ * remaining time instead of going idle. Return 1 if the timer just
+ * became idle.
+ */
+int idle_timer_expired(struct idle_timer *t)
+{
+	uint64_t expirations;
+	uint64_t now = now_us();
+
+	if (read(t->fd, &expirations, sizeof(expirations)) < 0 ||
+	    !t->active)
+		return 0;
+
+	if (now < t->last_us + t->timeout_us) {
+		idle_timer_arm(t, t->last_us + t->timeout_us);
+		return 0;
+	}
+
+	t->active = 0;
+	return 1;
+}
+
+/**
+ * poll_set_interval() - Write a poll interval to all polled sources
+ * @v_dev: main virtual device struct
+ * @interval: poll interval in ms
+ *
+ * Sources whose device has gone away are no longer controlled; they
+ * are added again when the device is reconnected.
+ */
+void poll_set_interval(struct virtual_device *v_dev, int interval)
+{
+	char buf[16];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%d", interval);
+	for (int i = 0; i < v_dev->polled; i++) {
+		if (pwrite(v_dev->poll_fd[i], buf, len, 0) == len)
+			continue;
+		if (errno != ENODEV) {
+			printf("Unable to set poll interval of source %d\n", i);
+			continue;
+		}
+		close(v_dev->poll_fd[i]);
+		v_dev->poll_fd[i--] = v_dev->poll_fd[--v_dev->polled];
+	}
+}
+
+/**
+ * poll_add_device() - Take over poll interval control of a source
+ * @v_dev: main virtual device struct
+ * @node: event node name of the source
+ *
+ * Sources driven by a polling input driver expose a writable "poll"
+ * attribute with the interval in ms. Sources without it are ignored.
+ */
+void poll_add_device(struct virtual_device *v_dev, const char *node)
+{
+	char path[128];
+	int fd;
+
+	if (!v_dev->profile.poll.fast_ms || v_dev->polled == MAX_DEVS * 2)
+		return;
+
+	snprintf(path, sizeof(path), SYSFS_INPUT "/%s/device/poll", node);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	printf("Controlling poll interval of %s\n", node);
+	v_dev->poll_fd[v_dev->polled++] = fd;
+}
+
+/**
+ * poll_setup() - Start adaptive poll interval control
+ * @v_dev: main virtual device struct
+ *
+ * Sources start at the idle interval until input arrives. Return 0 on
+ * success, negative on error.
+ */
+int poll_setup(struct virtual_device *v_dev)
+{
+	int ret;
+
+	v_dev->poll_timer.fd = -1;
+	if (!v_dev->polled)
+		return 0;
+
+	ret = idle_timer_init(&v_dev->poll_timer, v_dev->profile.poll.idle_ms);
+	if (ret)
+		return ret;
+
+	poll_set_interval(v_dev, v_dev->profile.poll.slow_ms);
+	return 0;
+}
+
+/**
+ * poll_activity() - Switch polled sources to the fast interval
+ * @v_dev: main virtual device struct
+ * @when_us: time of the input
+ */
+static inline void poll_activity(struct virtual_device *v_dev,
+				 uint64_t when_us)
+{
+	if (v_dev->polled && idle_timer_kick(&v_dev->poll_timer, when_us)) {
+		poll_set_interval(v_dev, v_dev->profile.poll.fast_ms);
+		v_dev->poll_raised++;
+	}
+}
+
+/**
+ * poll_idle() - Handle the poll idle timer
+ * @v_dev: main virtual device struct
+ *
+ * Drop polled sources back to the slow interval once input has been
+ * idle for the configured time.
+ */
+void poll_idle(struct virtual_device *v_dev)
+{
+	if (idle_timer_expired(&v_dev->poll_timer)) {
+		poll_set_interval(v_dev, v_dev->profile.poll.slow_ms);
+		v_dev->poll_dropped++;
+	}
+}
+
+/**
+ * qos_set() - Update the CPU latency request
+ * @v_dev: main virtual device struct
+ * @latency_us: latency limit, or PM_QOS_DEFAULT to release it
+ */
+void qos_set(struct virtual_device *v_dev, int32_t latency_us)
+{
+	if (write(v_dev->qos_fd, &latency_us, sizeof(latency_us)) !=
+	    sizeof(latency_us))
+		printf("Unable to update CPU latency request\n");
+}
+
+/**
+ * qos_setup() - Set up CPU latency control
+ * @v_dev: main virtual device struct
+ *
+ * The timer slack applies to the daemon at all times. The latency
+ * request is only held while input is active, and starts out released.
+ * If it cannot be opened, for lack of permission or kernel support,
+ * the daemon runs without it. Return 0 on success, negative on error.
+ */
+int qos_setup(struct virtual_device *v_dev)
+{
+	const struct qos_config *cfg = &v_dev->profile.qos;
+
+	v_dev->qos_fd = -1;
+	v_dev->qos_timer.fd = -1;
+	if (cfg->slack_ns && prctl(PR_SET_TIMERSLACK, cfg->slack_ns))
+		printf("Unable to set timer slack: %d\n", -errno);
+
+	if (!cfg->idle_ms)
+		return 0;
+
+	v_dev->qos_fd = open(CPU_DMA_LATENCY, O_WRONLY | O_CLOEXEC);
+	if (v_dev->qos_fd == -1) {
+		printf("Unable to open %s: %d\n", CPU_DMA_LATENCY, -errno);
+		return 0;
+	}
+	qos_set(v_dev, PM_QOS_DEFAULT);
+
+	return idle_timer_init(&v_dev->qos_timer, cfg->idle_ms);
+}
+
+/**
+ * qos_activity() - Hold the CPU latency request while input is active
+ * @v_dev: main virtual device struct
+ * @when_us: time of the input
+ */
+static inline void qos_activity(struct virtual_device *v_dev,
+				uint64_t when_us)
+{
+	if (v_dev->qos_fd > 0 && idle_timer_kick(&v_dev->qos_timer, when_us)) {
+		qos_set(v_dev, v_dev->profile.qos.latency_us);
+		v_dev->qos_holds++;
+	}
+}
+
+/**
+ * qos_idle() - Handle the CPU latency idle timer
+ * @v_dev: main virtual device struct
+ *
+ * Release the CPU latency request once input has been idle for the
+ * configured time, letting the CPUs use their deep idle states again.
+ */
+void qos_idle(struct virtual_device *v_dev)
+{
+	if (idle_timer_expired(&v_dev->qos_timer))
+		qos_set(v_dev, PM_QOS_DEFAULT);
+}
+
+/**
+ * boost_set() - Apply or remove the input boost
+ * @v_dev: main virtual device struct
+ * @on: whether to boost
+ *
+ * The minimum utilization clamp of the daemon, and of the configured
+ * cgroup if any, is raised to the boost value, and reset to the
+ * default afterwards. Return 0 on success, negative on error.
+ */
+int boost_set(struct virtual_device *v_dev, int on)
+{
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_flags = SCHED_FLAG_KEEP_ALL | SCHED_FLAG_UTIL_CLAMP_MIN,
+		/* (u32)-1 resets the clamp to the default */
+		.sched_util_min = on ? v_dev->profile.boost.min : UINT32_MAX,
+	};
+	char buf[16];
+	int len, ret = 0;
+
+	if (syscall(SYS_sched_setattr, 0, &attr, 0))
+		ret = -errno;
+
+	if (v_dev->boost_cgroup_fd > 0) {
+		len = snprintf(buf, sizeof(buf), "%s",
+			       on ? v_dev->boost_cgroup_on :
+				    v_dev->boost_cgroup_off);
+		if (pwrite(v_dev->boost_cgroup_fd, buf, len, 0) != len)
+			ret = -errno;
+	}
+
+	return ret;
+}
+
+/**
+ * boost_start() - Boost for the configured window
+ * @v_dev: main virtual device struct
+ */
+void boost_start(struct virtual_device *v_dev)
+{
+	uint32_t window_ms = v_dev->profile.boost.window_ms;
+	struct itimerspec its = {
+		.it_value.tv_sec = window_ms / 1000,
+		.it_value.tv_nsec = window_ms % 1000 * 1000000,
+	};
+
+	boost_set(v_dev, 1);
+	timerfd_settime(v_dev->boost_fd, 0, &its, NULL);
+	v_dev->boosted = 1;
+	v_dev->boosts++;
+}
+
+/**
+ * boost_activity() - Boost on the first input after idle
+ * @v_dev: main virtual device struct
+ * @when_us: time of the input
+ *
+ * While input keeps coming this is a single store.
+ */
+static inline void boost_activity(struct virtual_device *v_dev,
+				  uint64_t when_us)
+{
+	uint64_t last_us = v_dev->boost_last_us;
+
+	v_dev->boost_last_us = when_us;
+	if (v_dev->boost_fd > 0 && !v_dev->boosted &&
+	    when_us - last_us > v_dev->profile.boost.idle_ms * 1000ull)
+		boost_start(v_dev);
+}
+
+/**
+ * boost_tick() - End the boost window
+ * @v_dev: main virtual device struct
+ */
+void boost_tick(struct virtual_device *v_dev)
+{
+	uint64_t expirations;
+
+	if (read(v_dev->boost_fd, &expirations, sizeof(expirations)) !=
+	    sizeof(expirations))
+		return;
+
+	boost_set(v_dev, 0);
+	v_dev->boosted = 0;
+}
+
+/**
+ * boost_setup() - Set up the input boost
+ * @v_dev: main virtual device struct
+ *
+ * The current clamp of the cgroup is restored at the end of every
+ * boost window. A cgroup that cannot be read, for instance because it
+ * has not been created yet, is left alone. If neither the daemon nor
+ * the cgroup can be clamped, the daemon runs without the boost. Return
+ * 0 on success, negative on error.
+ */
+int boost_setup(struct virtual_device *v_dev)
+{
+	const struct boost_config *cfg = &v_dev->profile.boost;
+	char path[PATH_MAX];
+	int len, ret;
+
+	v_dev->boost_fd = -1;
+	v_dev->boost_cgroup_fd = -1;
+	if (!cfg->window_ms)
+		return 0;
+
+	if (cfg->cgroup[0]) {
+		snprintf(path, sizeof(path), "%s/cpu.uclamp.min",
+			 cfg->cgroup);
+		v_dev->boost_cgroup_fd = open(path, O_RDWR | O_CLOEXEC);
+		len = v_dev->boost_cgroup_fd == -1 ? -1 :
+		      read(v_dev->boost_cgroup_fd, v_dev->boost_cgroup_off,
+			   sizeof(v_dev->boost_cgroup_off) - 1);
+		if (len <= 0) {
+			printf("Unable to read %s, not boosting the cgroup\n",
+			       path);
+			if (v_dev->boost_cgroup_fd != -1)
+				close(v_dev->boost_cgroup_fd);
+			v_dev->boost_cgroup_fd = -1;
+		} else {
+			v_dev->boost_cgroup_off[len] = '\0';
+			snprintf(v_dev->boost_cgroup_on,
+				 sizeof(v_dev->boost_cgroup_on), "%u.%02u",
+				 cfg->min * 100 / 1024,
+				 cfg->min * 10000 / 1024 % 100);
+		}
+	}
+
+	ret = boost_set(v_dev, 0);
+	if (ret && v_dev->boost_cgroup_fd <= 0) {
+		printf("Utilization clamping not supported: %d\n", ret);
+		return 0;
+	}
+
+	v_dev->boost_fd = timerfd_create(CLOCK_MONOTONIC,
+					 TFD_NONBLOCK | TFD_CLOEXEC);
+	if (v_dev->boost_fd == -1)
+		return -errno;
+	return 0;
+}
+
+/**
+ * cal_save() - Store the calibration of all sources
+ * @v_dev: main virtual device struct
+ *
+ * Entries of units that are not present are kept, the file is
+ * replaced atomically.
+ */
+void cal_save(struct virtual_device *v_dev)
+{
+	char tmp[PATH_MAX], line[128];
+	unsigned int unit;
+	FILE *in, *out;
+	int present;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", v_dev->profile.cal.path);
+	out = fopen(tmp, "w");
+	if (!out) {
+		printf("Unable to write calibration: %d\n", -errno);
+		return;
+	}
+
+	in = fopen(v_dev->profile.cal.path, "r");
+	while (in && fgets(line, sizeof(line), in)) {
+		if (sscanf(line, "unit=%x", &unit) != 1)
+			continue;
+		present = 0;
+		for (int i = 0; i < v_dev->sources; i++)
+			present |= v_dev->src[i].unit == unit;
+		if (!present)
+			fputs(line, out);
+	}
+	if (in)
+		fclose(in);
+
+	for (int i = 0; i < v_dev->sources; i++) {
+		struct source *src = &v_dev->src[i];
+
+		for (uint64_t bits = src->cal_learned; bits;
+		     bits &= bits - 1) {
+			int code = __builtin_ctzll(bits);
+			int32_t center = src->cal_centered & (1ull << code) ?
+					 src->cal_center[code] :
+					 src->abs_center[code];
+
+			fprintf(out, "unit=%08x axis=%d min=%d max=%d "
+				"center=%d\n", src->unit, code,
+				src->cal_min[code], src->cal_max[code],
+				center);
+		}
+	}
+
+	if (fclose(out) || rename(tmp, v_dev->profile.cal.path))
+		printf("Unable to write calibration: %d\n", -errno);
+}
+
+/**
+ * cal_update() - Learn from the sticks at rest and apply calibration
+ * @v_dev: main virtual device struct
+ *
+ * Called once input has been idle for a while. The current position of
+ * a calibrated stick axis is then taken as a rest center sample, unless
+ * it is further than CAL_REST_RANGE from the center: a stick held
+ * against its gate is idle too, since the input core drops repeated
+ * values. Trigger axes have no rest center to learn. An axis
+ * counts as calibrated once its observed travel covers CAL_MIN_TRAVEL
+ * percent of its absinfo range. The normalization of an axis is only
+ * recomputed, and the calibration only stored, when its range moved
+ * by more than 1/256 of its span.
+ */
+void cal_update(struct virtual_device *v_dev)
+{
+	int changed = 0;
+
+	for (int i = 0; i < v_dev->sources; i++) {
+		struct source *src = &v_dev->src[i];
+
+		if (src->fd < 0)
+			continue;
+		for (uint64_t bits = src->cal_axes; bits; bits &= bits - 1) {
+			int code = __builtin_ctzll(bits);
+			uint64_t bit = 1ull << code;
+			struct remap_action *act = &src->abs_map[code];
+			struct axis_norm *norm = norm_find(v_dev, act->code);
+			int64_t travel, span, rest;
+			int32_t lo, hi, center;
+
+			span = (int64_t)src->abs_max[code] -
+			       src->abs_min[code];
+			rest = max(span * CAL_REST_RANGE / 100,
+				   (int64_t)src->abs_flat[code]);
+			center = src->cal_centered & bit ?
+				 src->cal_center[code] : src->abs_center[code];
+			if (norm && norm->minimum < 0 &&
+			    llabs((int64_t)src->abs[code] - center) <= rest) {
+				if (src->cal_centered & bit)
+					src->cal_center[code] =
+						(3ll * center +
+						 src->abs[code]) / 4;
+				else
+					src->cal_center[code] = src->abs[code];
+				src->cal_centered |= bit;
+			}
+
+			travel = (int64_t)src->cal_max[code] -
+				 src->cal_min[code];
+			if (travel * 100 >= span * CAL_MIN_TRAVEL)
+				src->cal_learned |= bit;
+
+			if (!norm)
+				continue;
+			cal_range(src, code, norm, &lo, &hi);
+			span = max(((int64_t)hi - lo) >> 8, 1);
+			if (llabs((int64_t)lo - norm->in_min) < span &&
+			    llabs((int64_t)hi - norm->in_max) < span)
+				continue;
+
+			norm_apply(act, norm, lo, hi);
+			changed = 1;
+		}
+	}
+
+	if (changed)
+		cal_save(v_dev);
+}
+
+/**
+ * cal_setup() - Start calibration learning
+ * @v_dev: main virtual device struct
+ *
+ * Return 0 on success or if no axis is calibrated, negative on error.
+ */
+int cal_setup(struct virtual_device *v_dev)
+{
+	int axes = 0;
+
+	v_dev->cal_timer.fd = -1;
+	for (int i = 0; i < v_dev->sources; i++)
+		axes |= !!v_dev->src[i].cal_axes;
+	if (!axes)
+		return 0;
+
+	return idle_timer_init(&v_dev->cal_timer, v_dev->profile.cal.idle_ms);
+}
+
+/**
+ * cal_activity() - Record input for calibration learning
+ * @v_dev: main virtual device struct
+ * @when_us: time of the input
+ */
+static inline void cal_activity(struct virtual_device *v_dev,
+				uint64_t when_us)
+{
+	if (v_dev->cal_timer.fd >= 0)
+		idle_timer_kick(&v_dev->cal_timer, when_us);
+}
+
+/**
+ * cal_idle() - Handle the calibration idle timer
+ * @v_dev: main virtual device struct
+ */
+void cal_idle(struct virtual_device *v_dev)
+{
+	if (idle_timer_expired(&v_dev->cal_timer))
+		cal_update(v_dev);
+}
+
+/**
+ * source_open() - Open the device node of a source
+ * @src: source with node filled in
+ *
+ * Open the event node, switch it to monotonic timestamps and record
+ * which keys and axes it has and where its axes are centered. Return
+ * the file descriptor, negative on error.
+ */
+int source_open(struct source *src)
+{
+	struct input_absinfo absinfo;
+	uint8_t abs_b[ABS_CNT / 8];
+	int clock = CLOCK_MONOTONIC;
+	char fd_dev[32];
+	int fd;
+
+	snprintf(fd_dev, sizeof(fd_dev), "/dev/input/%s", src->node);
+	fd = open(fd_dev, O_RDONLY | O_NONBLOCK);
+	if (fd == -1)
+		return -errno;
+
+	ioctl(fd, EVIOCSCLOCKID, &clock);
+	ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(src->key_bits)), src->key_bits);
+
+	memset(abs_b, 0, sizeof(abs_b));
+	ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs_b)), abs_b);
+	src->abs_bits = 0;
+	for (int i = 0; i < ABS_CNT; i++) {
+		if (!TEST_BIT(i, abs_b) || ioctl(fd, EVIOCGABS(i), &absinfo))
+			continue;
+		src->abs_bits |= 1ull << i;
+		src->abs_min[i] = absinfo.minimum;
+		src->abs_max[i] = absinfo.maximum;
+		src->abs_center[i] = ((int64_t)absinfo.minimum +
+				      absinfo.maximum) / 2;
+		src->abs_flat[i] = absinfo.flat;
+	}
+
+	src->fd = fd;
+	src->pending = 0;
+	src->dropping = 0;
+	return fd;
+}
+
+/**
+ * source_add() - Open and register a source device
+ * @v_dev: main virtual device struct
+ * @node: event node name of the device
+ * @rule: index of the rule the device matched
+ * @type: EV_ABS or EV_KEY, the role the source was opened for
+ * @fd_slot: entry of abs_fd[] or key_fd[] to hold the descriptor
+ *
+ * The current state of the device becomes the initial shadow state
+ * without being forwarded. The unit of the source is the hash of its
+ * name, physical path and unique id. Return 0 on success, negative on
+ * error.
+ */
+int source_add(struct virtual_device *v_dev, const char *node, int rule,
+	       int type, int *fd_slot)
+{
+	struct input_absinfo absinfo;
+	struct source *src;
+	char ident[256 * 3];
+	int fd, len = 0;
+
+	if (v_dev->sources == MAX_SOURCES)
+		return -ENOSPC;
+
+	src = &v_dev->src[v_dev->sources];
+	memset(src, 0, sizeof(*src));
+	snprintf(src->node, sizeof(src->node), "%s", node);
+	src->rule = rule;
+	src->type = type;
+	src->fd_slot = fd_slot;
+	src->abs_map = v_dev->abs_map;
+
+	fd = source_open(src);
+	if (fd < 0)
+		return fd;
+
+	ioctl(fd, EVIOCGKEY(sizeof(src->keys)), src->keys);
+	for (uint64_t bits = src->abs_bits; bits; bits &= bits - 1) {
+		int code = __builtin_ctzll(bits);
+
+		if (!ioctl(fd, EVIOCGABS(code), &absinfo))
+			src->abs[code] = absinfo.value;
+	}
+
+	for (int i = 0; i < ABS_CNT; i++) {
+		src->cal_min[i] = INT32_MAX;
+		src->cal_max[i] = INT32_MIN;
+	}
+	/* The lengths returned include the terminating NUL, so skip it */
+	memset(ident, 0, sizeof(ident));
+	if (ioctl(fd, EVIOCGNAME(255), ident) > 0)
+		len = strlen(ident);
+	if (ioctl(fd, EVIOCGPHYS(255), ident + len) > 0)
+		len += strlen(ident + len);
+	ioctl(fd, EVIOCGUNIQ(255), ident + len);
+	src->unit = rule_hash(ident);
+
+	*fd_slot = fd;
+	v_dev->sources++;
+	return 0;
+}
+
+/**
+ * iterate_input_devices() - Identify input devices to be monitored
+ * @v_dev: pointer to virtual_device struct
+ *
+ * Iterate over all of the event input devices to find the ones we
+ * want to monitor and start adding them to the virtual_device struct.
+ * Devices are identified from sysfs, so only devices that match a rule
+ * are ever opened. FF devices are opened write-only, since we need to
+ * write to them but not necessarily read them, and if the profile
+ * routes FF to specific rules only devices matching those rules are
+ * used. Sources are switched to monotonic timestamps, which the
+ * processing stages rely on. Return is total number of devices found.
+ *
+ */
+int iterate_input_devices(struct virtual_device *v_dev)
+{
+	struct dev_id id;
+	char fd_dev[32];
+	char node[16];
+	uint32_t ff_mask;
+	int ret;
+	int count = 0;
+	int key_devs = 0;
+	int abs_devs = 0;
+
+	for (int i = 0; i < 256; i++) {
+		snprintf(node, sizeof(node), "event%d", i);
+		ret = input_device_match(&v_dev->profile.rules, node, &id);
+		if (ret < 0)
+			continue;
+
+		read_dev_id(node, &id);
+		snprintf(fd_dev, sizeof(fd_dev), "/dev/input/%s", node);
+
+		if (id.evbits & ((1 << EV_ABS) | (1 << EV_KEY)))
+			poll_add_device(v_dev, node);
+
+		ff_mask = v_dev->profile.rules.ff_mask;
+		if ((id.evbits & (1 << EV_FF)) &&
+		    (!ff_mask || (ff_mask & (1u << ret)))) {
+			v_dev->ff_fd = open(fd_dev, O_WRONLY);
+			printf("Found EV_FF: %s\n", fd_dev);
+			count += 1;
+		}
+
+		if (id.evbits & (1 << EV_ABS)) {
+			if (abs_devs >= MAX_DEVS)
+				continue;
+
+			if (source_add(v_dev, node, ret, EV_ABS,
+				       &v_dev->abs_fd[abs_devs]))
+				continue;
+			printf("Found EV_ABS: %s\n", fd_dev);
+			count += 1;
+			abs_devs += 1;
+		}
+
+		if (id.evbits & (1 << EV_KEY)) {
+			if (key_devs >= MAX_DEVS)
+				continue;
+
+			if (source_add(v_dev, node, ret, EV_KEY,
+				       &v_dev->key_fd[key_devs]))
+				continue;
+			printf("Found EV_KEY: %s\n", fd_dev);
+			count += 1;
+			key_devs += 1;
+		}
+	}
+
+	return count;
+}
+
+/* D-pad keys in the order of their direction bits */
+static const uint16_t dpad_keys[4] = {
+	BTN_DPAD_UP, BTN_DPAD_DOWN, BTN_DPAD_LEFT, BTN_DPAD_RIGHT,
+};
+
+/**
+ * dpad_sector() - Direction bits of a cell of the stick sector table
+ * @x: horizontal cell coordinate times two plus one, relative to center
+ * @y: vertical cell coordinate times two plus one, relative to center
+ * @cfg: D-pad parameters
+ *
+ * Cells are classified by comparing the coordinates against tan(67.5)
+ * in fixed point, so that each of the eight directions covers 45
+ * degrees. With four ways the larger coordinate wins.
+ */
+uint8_t dpad_sector(int x, int y, const struct dpad_config *cfg)
+{
+	int radius = DPAD_GRID * cfg->deadzone / 100;
+	int ax = abs(x), ay = abs(y);
+	uint8_t bits = 0;
+
+	if (x * x + y * y < radius * radius)
+		return 0;
+
+	if (cfg->ways == 4) {
+		if (ax >= ay)
+			return x < 0 ? DPAD_LEFT : DPAD_RIGHT;
+		return y < 0 ? DPAD_UP : DPAD_DOWN;
+	}
+
+	if (ay * 1000 <= ax * 2414)
+		bits |= x < 0 ? DPAD_LEFT : DPAD_RIGHT;
+	if (ax * 1000 <= ay * 2414)
+		bits |= y < 0 ? DPAD_UP : DPAD_DOWN;
+	return bits;
+}
+
+/**
+ * dpad_set_axis() - Advertise an axis synthesized by the D-pad stage
+ * @v_dev: main virtual device struct
+ * @code: axis code
+ * @minimum: axis minimum if the axis has no range yet
+ * @maximum: axis maximum if the axis has no range yet
+ */
+void dpad_set_axis(struct virtual_device *v_dev, int code, int32_t minimum,
+		   int32_t maximum)
+{
+	struct uinput_abs_setup *setup = &v_dev->uabssetup[code];
+
+	if (setup->absinfo.maximum <= setup->absinfo.minimum) {
+		setup->absinfo.minimum = minimum;
+		setup->absinfo.maximum = maximum;
+	}
+	setup->code = code;
+	ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_ABS);
+	ioctl(v_dev->uinput_fd, UI_SET_ABSBIT, code);
+	ioctl(v_dev->uinput_fd, UI_ABS_SETUP, setup);
+}
+
+/**
+ * dpad_build() - Set up the D-pad conversion stage
+ * @v_dev: main virtual device struct
+ *
+ * Route the input codes of every D-pad in the profile to it, build the
+ * sector table of stick inputs from the absinfo of their axes and
+ * advertise the output codes. Must be called after the sources have
+ * been enumerated and before the virtual device is created. Return
+ * number of D-pads set up.
+ */
+int dpad_build(struct virtual_device *v_dev)
+{
+	memset(v_dev->dpad_key_route, 0, sizeof(v_dev->dpad_key_route));
+	memset(v_dev->dpad_abs_route, 0, sizeof(v_dev->dpad_abs_route));
+
+	v_dev->dpads = v_dev->profile.dpads;
+	for (int i = 0; i < v_dev->dpads; i++) {
+		const struct dpad_config *cfg = &v_dev->profile.dpad[i];
+		struct dpad *d = &v_dev->dpad[i];
+
+		memset(d, 0, sizeof(*d));
+		d->from = cfg->from;
+		d->to = cfg->to;
+
+		if (d->from == DPAD_KEYS) {
+			for (int b = 0; b < 4; b++)
+				v_dev->dpad_key_route[dpad_keys[b]] =
+					(i + 1) | (1 << b) << 4;
+		}
+
+		for (int a = 0; a < 2; a++) {
+			struct input_absinfo *in =
+				&v_dev->uabssetup[cfg->in_code[a]].absinfo;
+			struct input_absinfo *out =
+				&v_dev->uabssetup[cfg->out_code[a]].absinfo;
+			int32_t half;
+
+			if (d->from != DPAD_KEYS)
+				v_dev->dpad_abs_route[cfg->in_code[a]] =
+					(i + 1) | a << 4;
+
+			if (d->from == DPAD_STICK) {
+				d->center[a] = ((int64_t)in->minimum +
+						in->maximum) / 2;
+				half = max(in->maximum - d->center[a], 1);
+				d->scale[a] = ((DPAD_GRID / 2) << 16) / half;
+				d->value[a] = d->center[a];
+			}
+
+			d->out_code[a] = cfg->out_code[a];
+			if (d->to == DPAD_HAT) {
+				dpad_set_axis(v_dev, d->out_code[a], -1, 1);
+			} else if (d->to == DPAD_STICK) {
+				dpad_set_axis(v_dev, d->out_code[a], -32768,
+					      32767);
+				d->out_value[a][0] = out->minimum;
+				d->out_value[a][1] = ((int64_t)out->minimum +
+						      out->maximum) / 2;
+				d->out_value[a][2] = out->maximum;
+			}
+		}
+
+		if (d->to == DPAD_KEYS) {
+			for (int b = 0; b < 4; b++)
+				remap_set_key(v_dev, dpad_keys[b]);
+		}
+
+		if (d->from != DPAD_STICK)
+			continue;
+		for (int x = 0; x < DPAD_GRID; x++) {
+			for (int y = 0; y < DPAD_GRID; y++)
+				d->sector[x][y] = dpad_sector(
+					2 * x + 1 - DPAD_GRID,
+					2 * y + 1 - DPAD_GRID, cfg);
+		}
+	}
+
+	return v_dev->dpads;
+}
+
+/**
+ * chord_build() - Route chord keys through ACTION_CHORD
+ * @v_dev: main virtual device struct
+ *
+ * Must be called before the virtual device is created, so that keys
+ * sent by chords can be advertised. Return number of chords.
+ */
+int chord_build(struct virtual_device *v_dev)
+{
+	memset(v_dev->chord_trigger, 0, sizeof(v_dev->chord_trigger));
+	memset(v_dev->chord_modifier, 0, sizeof(v_dev->chord_modifier));
+
+	v_dev->chords = v_dev->profile.chords;
+	for (int i = 0; i < v_dev->chords; i++) {
+		const struct chord_config *cfg = &v_dev->profile.chord[i];
+		struct chord *c = &v_dev->chord[i];
+
+		memset(c, 0, sizeof(*c));
+		c->keys = cfg->keys;
+		memcpy(c->key, cfg->key, sizeof(c->key));
+		c->action = cfg->action;
+		c->code = cfg->code;
+		c->cmd = cfg->cmd;
+		if (c->action == CHORD_KEY)
+			remap_set_key(v_dev, c->code);
+
+		v_dev->chord_trigger[c->key[c->keys - 1]] |= 1u << i;
+		for (int k = 0; k < c->keys - 1; k++)
+			BITMAP_SET(v_dev->chord_modifier, c->key[k]);
+
+		for (int j = 0; j < KEY_CNT; j++) {
+			struct remap_action *act = &v_dev->key_map[j];
+
+			for (int k = 0; k < c->keys; k++) {
+				if (act->op == ACTION_PASS &&
+				    act->code == c->key[k])
+					act->op = ACTION_CHORD;
+			}
+		}
+	}
+
+	return v_dev->chords;
+}
+
+/**
+ * create_uinput_device() - Create a new composite uinput device
+ * @v_dev: pointer to virtual input device
+ *
+ * Create a uinput device for use by userspace to combine all of the
+ * monitored input devices into a single one that applications are
+ * more capable of dealing with. Return 0 on success, negative on
+ * error.
+ *
+ */
+int create_uinput_device(struct virtual_device *v_dev)
+{
+	int ret = 0;
+
+	v_dev->uinput_fd = open("/dev/uinput", O_RDWR | O_NONBLOCK |
+					       O_DSYNC | O_RSYNC);
+	if (v_dev->uinput_fd == -1)
+		return -ENODEV;
+
+	if (v_dev->abs_fd[0] > 0) {
+		ret = ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_ABS);
+		if (ret)
+			return ret;
+		ret = enumerate_abs_devices(v_dev);
+		if (!(ret > 0)) {
+			printf("No ABS devices found\n");
+			return -ENODEV;
+		}
+	}
+
+	if (v_dev->key_fd[0] > 0) {
+		ret = ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_KEY);
+		if (ret)
+			return ret;
+		ret = enumerate_key_devices(v_dev);
+		if (!(ret > 0)) {
+			printf("No keys found\n");
+			return -ENODEV;
+		}
+	}
+
+	dpad_build(v_dev);
+	chord_build(v_dev);
+
+	/* Frames carry the time their input was sampled at, see flush_frame */
+	ret = ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_MSC);
+	if (ret)
+		return ret;
+	ret = ioctl(v_dev->uinput_fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
+	if (ret)
+		return ret;
+
+	if (v_dev->ff_fd > 0) {
+		ret = ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_FF);
+		if (ret)
+			return ret;
+
+		ret = enumerate_ff_device(v_dev);
+		if (ret)
+			return ret;
+	}
+
+	v_dev->usetup.id.bustype = v_dev->profile.output_bustype;
+	v_dev->usetup.id.vendor = v_dev->profile.output_vendor;
+	v_dev->usetup.id.product = v_dev->profile.output_product;
+	memcpy(v_dev->usetup.name, v_dev->profile.output_name,
+	       sizeof(v_dev->usetup.name));
+
+	ret = ioctl(v_dev->uinput_fd, UI_DEV_SETUP, &v_dev->usetup);
+	if (ret)
+		return ret;
+
+	ret = ioctl(v_dev->uinput_fd, UI_DEV_CREATE);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+/**
+ * ff_flush() - Write the pending FF state to the physical device
+ * @v_dev: main virtual device struct
+ *
+ * Everything that still differs from what the motors were last told,
+ * or restarts an effect of limited length, is written with a single
+ * write(). The motor state is only taken as written once the write
+ * succeeded; if it failed, the state of everything in it is unknown
+ * and the next command for it is never dropped as redundant. Return 0
+ * on success, negative on error.
+ */
+int ff_flush(struct virtual_device *v_dev)
+{
+	struct ff_output *ff = &v_dev->ff;
+	struct input_event evs[FF_EFFECTS + 1];
+	int n = 0, ok, ret;
+
+	if (ff->gain_dirty &&
+	    (int64_t)ff->gain_req * ff->scale / 100 != ff->gain_hw) {
+		evs[n].type = EV_FF;
+		evs[n].code = FF_GAIN;
+		evs[n++].value = (int64_t)ff->gain_req * ff->scale / 100;
+	}
+	ff->gain_dirty = 0;
+
+	for (int i = 0; i < ff->pending; i++) {
+		int id = ff->pending_id[i];
+
+		ff->dirty[id] = 0;
+		if (ff->req[id] == ff->hw[id] && !ff->restart[id]) {
+			ff->coalesced++;
+			continue;
+		}
+		evs[n].type = EV_FF;
+		evs[n].code = id;
+		evs[n++].value = ff->req[id];
+		ff->restart[id] = 0;
+	}
+	ff->pending = 0;
+	ff->armed = 0;
+
+	if (!n)
+		return 0;
+
+	ff->last_us = now_us();
+	ff->writes++;
+	ff->events += n;
+	ret = write(v_dev->ff_fd, evs, n * sizeof(evs[0]));
+	ok = ret == (int)(n * sizeof(evs[0]));
+	for (int i = 0; i < n; i++) {
+		if (evs[i].code == FF_GAIN)
+			ff->gain_hw = ok ? evs[i].value : -1;
+		else
+			ff->hw[evs[i].code] = ok ? evs[i].value : -1;
+	}
+	if (!ok) {
+		printf("Could not set effect status\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * ff_schedule() - Write out pending FF state now or arm the FF timer
+ * @v_dev: main virtual device struct
+ *
+ * Pending state is written once the coalescing window since the first
+ * pending command has passed, and no earlier than the rate limit
+ * allows after the previous write. Return 0 on success, negative on
+ * error.
+ */
+int ff_schedule(struct virtual_device *v_dev)
+{
+	struct ff_output *ff = &v_dev->ff;
+	uint64_t now = now_us(), deadline = now;
+	struct itimerspec its = { 0 };
+
+	if (ff->armed)
+		return 0;
+
+	deadline += v_dev->profile.ff.window_ms * 1000ull;
+	if (ff->interval_us && ff->last_us + ff->interval_us > deadline)
+		deadline = ff->last_us + ff->interval_us;
+	if (deadline <= now || ff->timer_fd <= 0)
+		return ff_flush(v_dev);
+
+	its.it_value.tv_sec = deadline / 1000000;
+	its.it_value.tv_nsec = deadline % 1000000 * 1000;
+	timerfd_settime(ff->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	ff->armed = 1;
+	return 0;
+}
+
+/**
+ * ff_tick() - Handle expiry of the FF timer
+ * @v_dev: main virtual device struct
+ */
+void ff_tick(struct virtual_device *v_dev)
+{
+	uint64_t expirations;
+
+	if (read(v_dev->ff.timer_fd, &expirations, sizeof(expirations)) !=
+	    sizeof(expirations))
+		return;
+
+	ff_flush(v_dev);
+}
+
+/**
+ * ff_erased() - Forget the state of an erased effect
+ * @v_dev: main virtual device struct
+ * @id: effect id
+ *
+ * Erasing an effect stops it, and a play command still pending for it
+ * must not start whatever effect gets that id next.
+ */
+void ff_erased(struct virtual_device *v_dev, int id)
+{
+	struct ff_output *ff = &v_dev->ff;
+
+	if (id < 0 || id >= FF_EFFECTS)
+		return;
+	ff->req[id] = 0;
+	ff->hw[id] = 0;
+	ff->restart[id] = 0;
+}
+
+/**
+ * handle_ff_events() - Respond to ff_events
+ *
+ * @v_dev: main virtual device struct
+ * @ev: input_event initiating ff upload
+ *
+ * Record the requested gain or effect status and hand it to the FF
+ * output stage. Commands that change nothing are dropped: setting the
+ * gain the motors already have, stopping a stopped effect, or playing
+ * an effect of unlimited length that is already playing. Playing an
+ * effect of limited length restarts it, so that always counts. Return
+ * value is 0 for success, negative for error.
+ */
+int handle_ff_events(struct virtual_device *v_dev,
+		     struct input_event ev)
+{
+	struct ff_output *ff = &v_dev->ff;
+	int id = ev.code;
+
+	ff->commands++;
+	if (id == FF_GAIN) {
+		if (!ff->gain_dirty && ev.value == ff->gain_req &&
+		    ff->gain_hw >= 0) {
+			ff->dropped++;
+			return 0;
+		}
+		ff->coalesced += ff->gain_dirty;
+		ff->gain_req = ev.value;
+		ff->gain_dirty = 1;
+		return ff_schedule(v_dev);
+	}
+
+	if (id >= FF_EFFECTS)
+		return 0;
+
+	if (!ff->dirty[id] && ev.value == ff->hw[id] &&
+	    !(ev.value && ff->length_ms[id])) {
+		ff->dropped++;
+		return 0;
+	}
+
+	if (ff->dirty[id]) {
+		ff->coalesced++;
+	} else {
+		ff->dirty[id] = 1;
+		ff->pending_id[ff->pending++] = id;
+	}
+	ff->req[id] = ev.value;
+	ff->restart[id] = ev.value && ff->length_ms[id];
+	return ff_schedule(v_dev);
+}
+
+/**
+ * ff_setup() - Set up the FF output stage
+ * @v_dev: main virtual device struct
+ *
+ * The FF timer is only needed if commands are coalesced or rate
+ * limited. Return 0 on success, negative on error.
+ */
+int ff_setup(struct virtual_device *v_dev)
+{
+	struct ff_output *ff = &v_dev->ff;
+
+	ff->timer_fd = -1;
+	ff->gain_req = 0xffff;
+	ff->gain_hw = -1;
+	ff->scale = 100;
+	if (v_dev->profile.ff.rate_hz)
+		ff->interval_us = 1000000 / v_dev->profile.ff.rate_hz;
+
+	if (v_dev->ff_fd <= 0 ||
+	    (!v_dev->profile.ff.window_ms && !ff->interval_us))
+		return 0;
+
+	ff->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				      TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ff->timer_fd == -1)
+		return -errno;
+	return 0;
+}
+
+/**
+ * read_power_supply() - Read a single attribute of a power supply
+ * @supply: power supply name, such as "battery"
+ * @attr: attribute name
+ * @buf: buffer for the attribute contents
+ * @len: size of buf
+ *
+ * Read an attribute from /sys/class/power_supply/<supply>/ and strip
+ * the trailing newline. Return length read, negative on error.
+ */
+int read_power_supply(const char *supply, const char *attr, char *buf,
+		      size_t len)
+{
+	char path[128];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), POWER_SUPPLY "/%s/%s", supply, attr);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret < 0)
+		return -errno;
+
+	while (ret > 0 && buf[ret - 1] == '\n')
+		ret--;
+	buf[ret] = '\0';
+
+	return ret;
+}
+
+/**
+ * battery_find() - Find the battery to follow
+ * @name: returned power supply name
+ * @size: size of name
+ *
+ * The first power supply of type Battery is used. Return 0 on success,
+ * negative if there is none.
+ */
+int battery_find(char *name, size_t size)
+{
+	struct dirent *entry;
+	char type[16];
+	DIR *dir;
+	int ret = -ENOENT;
+
+	dir = opendir(POWER_SUPPLY);
+	if (!dir)
+		return -errno;
+
+	while (ret && (entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (read_power_supply(entry->d_name, "type", type,
+				      sizeof(type)) < 0 ||
+		    strcmp(type, "Battery"))
+			continue;
+		snprintf(name, size, "%s", entry->d_name);
+		ret = 0;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+/**
+ * battery_read() - Update the rumble scale from the battery state
+ * @v_dev: main virtual device struct
+ *
+ * Rumble plays at full strength while charging. Otherwise the scale is
+ * that of the lowest curve point whose capacity the battery is at or
+ * below. A changed scale is applied to the gain of the physical device
+ * right away, which also rescales effects already playing.
+ */
+void battery_read(struct virtual_device *v_dev)
+{
+	const struct battery_config *cfg = &v_dev->profile.battery;
+	uint32_t scale = 100;
+	char val[16], *end;
+	long capacity;
+
+	if (read_power_supply(v_dev->battery_supply, "capacity", val,
+			      sizeof(val)) <= 0)
+		return;
+	capacity = strtol(val, &end, 10);
+	if (*end)
+		return;
+	v_dev->battery_capacity = capacity;
+
+	if (read_power_supply(v_dev->battery_supply, "status", val,
+			      sizeof(val)) < 0)
+		val[0] = '\0';
+	v_dev->battery_charging = !strcmp(val, "Charging") ||
+				  !strcmp(val, "Full");
+
+	for (int i = 0; i < cfg->points && !v_dev->battery_charging; i++)
+		if (capacity <= cfg->capacity[i])
+			scale = cfg->gain[i];
+
+	if (scale == v_dev->ff.scale)
+		return;
+
+	printf("Battery at %ld%%, rumble at %u%%\n", capacity, scale);
+	v_dev->ff.scale = scale;
+	v_dev->ff.gain_dirty = 1;
+	ff_schedule(v_dev);
+}
+
+/**
+ * battery_tick() - Handle expiry of the battery timer
+ * @v_dev: main virtual device struct
+ */
+void battery_tick(struct virtual_device *v_dev)
+{
+	uint64_t expirations;
+
+	if (read(v_dev->battery_fd, &expirations, sizeof(expirations)) !=
+	    sizeof(expirations))
+		return;
+
+	battery_read(v_dev);
+}
+
+/**
+ * battery_setup() - Start following the battery for rumble scaling
+ * @v_dev: main virtual device struct
+ *
+ * Scaling works through the gain of the physical device, which the
+ * memoryless drivers of vibrator motors all support. Return 0 on
+ * success or if scaling is disabled, negative on error.
+ */
+int battery_setup(struct virtual_device *v_dev)
+{
+	const struct battery_config *cfg = &v_dev->profile.battery;
+	struct itimerspec its = {
+		.it_value.tv_sec = cfg->interval_s,
+		.it_interval.tv_sec = cfg->interval_s,
+	};
+	uint8_t ff_b[FF_MAX / 8 + 1] = { 0 };
+	int ret;
+
+	v_dev->battery_fd = -1;
+	if (!cfg->points || v_dev->ff_fd <= 0)
+		return 0;
+
+	ioctl(v_dev->ff_fd, EVIOCGBIT(EV_FF, sizeof(ff_b)), ff_b);
+	if (!TEST_BIT(FF_GAIN, ff_b)) {
+		printf("Rumble device has no gain control, not scaling\n");
+		return 0;
+	}
+
+	if (cfg->supply[0]) {
+		snprintf(v_dev->battery_supply, sizeof(v_dev->battery_supply),
+			 "%s", cfg->supply);
+	} else {
+		ret = battery_find(v_dev->battery_supply,
+				   sizeof(v_dev->battery_supply));
+		if (ret) {
+			printf("No battery found, not scaling rumble\n");
+			return 0;
+		}
+	}
+
+	v_dev->battery_fd = timerfd_create(CLOCK_MONOTONIC,
+					   TFD_NONBLOCK | TFD_CLOEXEC);
+	if (v_dev->battery_fd == -1)
+		return -errno;
+	timerfd_settime(v_dev->battery_fd, 0, &its, NULL);
+
+	battery_read(v_dev);
+	return 0;
+}
+
+/**
+ * handle_uinput_ff_upload() - Capture and respond to ff_upload
+ * requests
+ * @v_dev: main virtual device struct
+ * @ev: input_event initiating ff upload
+ *
+ * Handle the necessary IOCTLs used for processing an incoming ff
+ * effect upload. Read the upload request from the uinput device and
+ * replay it to the physical ff device. Read the response from the
+ * physical ff device and replay it back to the uinput device.
+ * Return value is 0 for success, negative for error.
+ */
+int handle_uinput_ff_upload(struct virtual_device *v_dev,
+			    struct input_event ev)
+{
+	struct uinput_ff_upload ff_payload;
+	struct ff_effect effect;
+	int ret = 0;
+
+	ff_payload.request_id = ev.value;
+	ret = ioctl(v_dev->uinput_fd, UI_BEGIN_FF_UPLOAD, &ff_payload);
+	if (ret)
+		return ret;
+	effect = ff_payload.effect;
+	effect.id = -1;
+
+	ret = ioctl(v_dev->ff_fd, EVIOCSFF, &effect);
+	if (ret)
+		return ret;
+	ff_payload.retval = ret;
+	if (ff_payload.effect.id >= 0 && ff_payload.effect.id < FF_EFFECTS)
+		v_dev->ff.length_ms[ff_payload.effect.id] =
+			ff_payload.effect.replay.length;
+
+	ret = ioctl(v_dev->uinput_fd, UI_END_FF_UPLOAD, &ff_payload);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+/**
+ * handle_uinput_ff_erase() - Capture and respond to ff_erase
+ * requests
+ * @v_dev: main virtual device struct
+ * @ev: input_event initiating ff erase
+ *
+ * Handle the necessary IOCTLs used for processing an incoming ff
+ * effect erase. Read the erase request from the uinput device and
+ * replay it to the physical ff device. Read the response from the
+ * physical ff device and replay it back to the uinput device.
+ * Return value is 0 for success, negative for error.
+ */
+int handle_uinput_ff_erase(struct virtual_device *v_dev,
+			   struct input_event ev)
+{
+	struct uinput_ff_erase ff_payload;
+	int ret = 0;
+
+	ff_payload.request_id = ev.value;
+	ret = ioctl(v_dev->uinput_fd, UI_BEGIN_FF_ERASE, &ff_payload);
+	if (ret)
+		return ret;
+
+	ret = ioctl(v_dev->ff_fd, EVIOCRMFF, ff_payload.effect_id);
+	if (ret)
+		return ret;
+	ff_payload.retval = ret;
+	ff_erased(v_dev, ff_payload.effect_id);
+
+	ret = ioctl(v_dev->uinput_fd, UI_END_FF_ERASE, &ff_payload);
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+/**
+ * queue_add() - Queue a frame that could not be written
+ * @v_dev: main virtual device struct
+ * @evs: events of the frame
+ * @count: number of events
+ *
+ * Key events are kept in order, axis events only keep the latest
+ * value of each axis. If the key queue is full, the oldest key event
+ * that is superseded by a later one for the same key is dropped, so
+ * that a short tap may be lost under a long stall but the final state
+ * of every key is always correct.
+ */
+void queue_add(struct virtual_device *v_dev, const struct input_event *evs,
+	       int count)
+{
+	struct out_queue *q = &v_dev->queue;
+
+	for (int i = 0; i < count; i++) {
+		const struct input_event *ev = &evs[i];
+		int drop = 0;
+
+		if (ev->type == EV_ABS) {
+			if (q->abs_dirty & (1ull << ev->code))
+				q->coalesced++;
+			q->abs[ev->code] = ev->value;
+			q->abs_dirty |= 1ull << ev->code;
+			continue;
+		}
+		if (ev->type != EV_KEY)
+			continue;
+
+		if (q->keys == QUEUE_KEYS) {
+			for (int j = 0; j < q->keys && !drop; j++) {
+				for (int k = j + 1; k < q->keys; k++) {
+					if (q->key[k].code == q->key[j].code) {
+						drop = j + 1;
+						break;
+					}
+				}
+			}
+			drop = drop ? drop - 1 : 0;
+			q->keys--;
+			memmove(&q->key[drop], &q->key[drop + 1],
+				(q->keys - drop) * sizeof(q->key[0]));
+			q->collapsed++;
+		}
+		q->key[q->keys++] = *ev;
+	}
+	q->queued++;
+}
+
+/**
+ * queue_flush() - Write out the queued output
+ * @v_dev: main virtual device struct
+ *
+ * The latest value of every queued axis goes into the first frame, key
+ * events follow in order, with a new frame started whenever a key
+ * repeats so that no transition is merged away. Whatever was written
+ * is removed from the queue. Return 0 if the queue is empty, negative
+ * otherwise.
+ */
+int queue_flush(struct virtual_device *v_dev)
+{
+	static struct input_event buf[QUEUE_KEYS * 2 + ABS_CNT + 1];
+	struct out_queue *q = &v_dev->queue;
+	uint64_t seen[KEY_CNT / 64] = { 0 };
+	int n = 0, keys = 0, ret;
+
+	for (uint64_t bits = q->abs_dirty; bits; bits &= bits - 1) {
+		int code = __builtin_ctzll(bits);
+
+		buf[n].type = EV_ABS;
+		buf[n].code = code;
+		buf[n++].value = q->abs[code];
+	}
+	for (int i = 0; i < q->keys; i++) {
+		if (BITMAP_TEST(seen, q->key[i].code)) {
+			memset(&buf[n++], 0, sizeof(buf[0]));
+			memset(seen, 0, sizeof(seen));
+		}
+		BITMAP_SET(seen, q->key[i].code);
+		buf[n++] = q->key[i];
+	}
+	memset(&buf[n++], 0, sizeof(buf[0]));
+
+	ret = write(v_dev->uinput_fd, buf, n * sizeof(buf[0]));
+	if (ret == (int)(n * sizeof(buf[0]))) {
+		q->abs_dirty = 0;
+		q->keys = 0;
+		return 0;
+	}
+
+	for (int i = 0; i < ret / (int)sizeof(buf[0]); i++) {
+		if (buf[i].type == EV_ABS)
+			q->abs_dirty &= ~(1ull << buf[i].code);
+		else if (buf[i].type == EV_KEY)
+			keys++;
+	}
+	q->keys -= keys;
+	memmove(q->key, &q->key[keys], q->keys * sizeof(q->key[0]));
+	return -EAGAIN;
+}
+
+/**
+ * queue_wait() - Wait for uinput to accept the queued output
+ * @v_dev: main virtual device struct
+ * @on: whether to wait for EPOLLOUT on uinput
+ */
+void queue_wait(struct virtual_device *v_dev, int on)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN | (on ? EPOLLOUT : 0),
+		.data.fd = v_dev->uinput_fd,
+	};
+
+	if (v_dev->queue.pollout == on || v_dev->ep_fd <= 0)
+		return;
+	v_dev->queue.pollout = on;
+	epoll_ctl(v_dev->ep_fd, EPOLL_CTL_MOD, v_dev->uinput_fd, &event);
+}
+
+/**
+ * queue_ready() - Handle EPOLLOUT on uinput
+ * @v_dev: main virtual device struct
+ *
+ * uinput reports EPOLLOUT whenever no force feedback request is
+ * pending, so if the write still fails the daemon stops waiting for
+ * EPOLLOUT and retries after QUEUE_RETRY_US rather than spinning.
+ */
+void queue_ready(struct virtual_device *v_dev)
+{
+	struct itimerspec its = {
+		.it_value.tv_nsec = QUEUE_RETRY_US * 1000,
+	};
+
+	if (!queue_flush(v_dev)) {
+		queue_wait(v_dev, 0);
+		return;
+	}
+
+	queue_wait(v_dev, 0);
+	timerfd_settime(v_dev->queue.retry_fd, 0, &its, NULL);
+	v_dev->queue.retries++;
+}
+
+/**
+ * queue_retry() - Handle the output retry timer
+ * @v_dev: main virtual device struct
+ */
+void queue_retry(struct virtual_device *v_dev)
+{
+	uint64_t expirations;
+
+	if (read(v_dev->queue.retry_fd, &expirations,
+		 sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	if (v_dev->queue.keys || v_dev->queue.abs_dirty)
+		queue_wait(v_dev, 1);
+}
+
+/**
+ * queue_setup() - Create the output retry timer
+ * @v_dev: main virtual device struct
+ *
+ * Return 0 on success, negative on error.
+ */
+int queue_setup(struct virtual_device *v_dev)
+{
+	v_dev->queue.retry_fd = timerfd_create(CLOCK_MONOTONIC,
+					       TFD_NONBLOCK | TFD_CLOEXEC);
+	if (v_dev->queue.retry_fd == -1)
+		return -errno;
+	return 0;
+}
+
+/**
+ * write_frame() - Write buffered output events to uinput
+ * @v_dev: main virtual device struct
+ *
+ * All events of a frame are handed to uinput with a single write().
+ * If that fails, or earlier output is still queued, the frame is
+ * queued and written once uinput reports EPOLLOUT.
+ */
+void write_frame(struct virtual_device *v_dev)
+{
+	struct out_queue *q = &v_dev->queue;
+	size_t len = v_dev->out_len * sizeof(struct input_event);
+
+	if (!q->keys && !q->abs_dirty &&
+	    write(v_dev->uinput_fd, v_dev->out, len) == (ssize_t)len) {
+		v_dev->out_len = 0;
+		return;
+	}
+
+	queue_add(v_dev, v_dev->out, v_dev->out_len);
+	v_dev->out_len = 0;
+	queue_wait(v_dev, 1);
+}
+
+/**
+ * emit_event() - Queue an event for the virtual device
+ * @v_dev: main virtual device struct
+ * @type: event type
+ * @code: event code
+ * @value: event value
+ *
+ * Append an event to the frame being built. If the frame buffer is
+ * full the events gathered so far are written out early.
+ */
+static inline void emit_event(struct virtual_device *v_dev, __u16 type,
+			      __u16 code, __s32 value)
+{
+	struct input_event *ev;
+
+	if (v_dev->out_len == OUT_FRAME_MAX - 1)
+		write_frame(v_dev);
+
+	ev = &v_dev->out[v_dev->out_len++];
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+/**
+ * isqrt() - Integer square root
+ * @n: value
+ *
+ * Bitwise integer square root, only used while building tables.
+ */
+uint32_t isqrt(uint64_t n)
+{
+	uint64_t res = 0, bit = 1ull << 62;
+
+	while (bit > n)
+		bit >>= 2;
+
+	while (bit) {
+		if (n >= res + bit) {
+			n -= res + bit;
+			res = (res >> 1) + bit;
+		} else {
+			res >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return res;
+}
+
+/**
+ * stick_curve() - Evaluate the radial response of a stick
+ * @cfg: stick parameters
+ * @r: Q15 distance from center
+ *
+ * Return the Q15 output magnitude for input magnitude @r.
+ */
+int32_t stick_curve(const struct stick_config *cfg, int32_t r)
+{
+	int32_t dz = cfg->deadzone * 32767 / 100;
+	int32_t outer = (cfg->outer ? cfg->outer : 100) * 32767 / 100;
+	int32_t anti = cfg->anti * 32767 / 100;
+	int64_t t;
+
+	if (r <= dz)
+		return 0;
+	if (r >= outer)
+		return 32767;
+
+	t = (int64_t)(r - dz) * 32767 / (outer - dz);
+	if (cfg->curve == STICK_CURVE_QUADRATIC)
+		t = t * t / 32767;
+	else if (cfg->curve == STICK_CURVE_CUBIC)
+		t = t * t / 32767 * t / 32767;
+
+	return anti + (32767 - anti) * t / 32767;
+}
+
+/**
+ * stick_build() - Precompute stick processing tables
+ * @v_dev: main virtual device struct
+ *
+ * Build the lookup tables for every stick in the profile from its
+ * parameters and the absinfo of its axes in uabssetup[], and route the
+ * stick axes through ACTION_STICK. Must be called after the virtual
+ * device has been enumerated. Return number of sticks set up.
+ */
+int stick_build(struct virtual_device *v_dev)
+{
+	int sticks = 0;
+
+	for (int i = 0; i < STICK_SQRT_SIZE; i++)
+		v_dev->stick_sqrt[i] = isqrt((uint64_t)i << 8);
+
+	for (int i = 0; i < v_dev->profile.sticks; i++) {
+		const struct stick_config *cfg = &v_dev->profile.stick[i];
+		struct stick *st = &v_dev->stick[i];
+		int32_t axial = cfg->axial * 32767 / 100;
+		int a;
+
+		memset(st, 0, sizeof(*st));
+		for (a = 0; a < 2; a++) {
+			struct input_absinfo *absinfo =
+				&v_dev->uabssetup[cfg->code[a]].absinfo;
+
+			if (absinfo->maximum <= absinfo->minimum)
+				break;
+			st->code[a] = cfg->code[a];
+			st->minimum[a] = absinfo->minimum;
+			st->maximum[a] = absinfo->maximum;
+			st->center[a] = ((int64_t)absinfo->minimum +
+					 absinfo->maximum) / 2;
+			st->span[a][0] = max(st->center[a] - absinfo->minimum,
+					     1);
+			st->span[a][1] = max(absinfo->maximum - st->center[a],
+					     1);
+			st->scale[a][0] = (32767 << 16) / st->span[a][0];
+			st->scale[a][1] = (32767 << 16) / st->span[a][1];
+			st->raw[a] = st->center[a];
+			st->out[a] = st->center[a];
+		}
+		if (a < 2) {
+			printf("Stick axis %d not present\n", cfg->code[a]);
+			continue;
+		}
+
+		st->has_axial = axial > 0;
+		for (int j = 0; j < STICK_LUT_SIZE; j++) {
+			int32_t n = min(j << STICK_LUT_SHIFT, 32767);
+
+			if (n <= axial)
+				st->axial[j] = 0;
+			else
+				st->axial[j] = (int64_t)(n - axial) * 32767 /
+					       (32767 - axial);
+
+			if (n)
+				st->gain[j] = ((int64_t)stick_curve(cfg, n) <<
+					       16) / n;
+		}
+		st->gain[0] = st->gain[1];
+
+		for (int j = 0; j < ABS_CNT * (v_dev->merge_maps + 1); j++) {
+			struct remap_action *act = abs_map_entry(v_dev, j);
+
+			if (act->op != ACTION_PASS)
+				continue;
+			for (a = 0; a < 2; a++) {
+				if (act->code == cfg->code[a]) {
+					act->op = ACTION_STICK;
+					act->code2 = i * 2 + a;
+				}
+			}
+		}
+		sticks++;
+	}
+
+	return sticks;
+}
+
+/**
+ * stick_sqrt() - Table based square root of a squared Q15 magnitude
+ * @v_dev: main virtual device struct
+ * @r2: squared magnitude
+ *
+ * Normalize @r2 to ten significant bits by an even shift and look up
+ * its root, accurate to better than 0.5%.
+ */
+static inline int32_t stick_sqrt(const struct virtual_device *v_dev,
+				 uint32_t r2)
+{
+	int shift = 0;
+
+	if (r2 >= STICK_SQRT_SIZE)
+		shift = (32 - __builtin_clz(r2) - 9) & ~1;
+
+	return (v_dev->stick_sqrt[r2 >> shift] << (shift / 2)) >> 4;
+}
+
+/**
+ * stick_process() - Run deadzone and response processing on a stick
+ * @v_dev: main virtual device struct
+ * @st: stick with new raw values
+ *
+ * Normalize both axes, apply the axial table to each, look the radial
+ * gain up from the combined magnitude and emit whichever axes changed.
+ */
+void stick_process(struct virtual_device *v_dev, struct stick *st)
+{
+	int32_t n[2], val, idx, frac;
+	int64_t gain;
+	uint32_t r;
+
+	for (int a = 0; a < 2; a++) {
+		val = st->raw[a] - st->center[a];
+		n[a] = ((int64_t)val * st->scale[a][val > 0]) >> 16;
+		n[a] = max(min(n[a], 32767), -32767);
+		if (st->has_axial) {
+			val = n[a] < 0 ? -n[a] : n[a];
+			idx = val >> STICK_LUT_SHIFT;
+			frac = val & ((1 << STICK_LUT_SHIFT) - 1);
+			val = st->axial[idx] +
+			      (((int32_t)st->axial[idx + 1] - st->axial[idx]) *
+			       frac >> STICK_LUT_SHIFT);
+			n[a] = n[a] < 0 ? -val : val;
+		}
+	}
+
+	r = min(stick_sqrt(v_dev, n[0] * n[0] + n[1] * n[1]), 32767);
+	idx = r >> STICK_LUT_SHIFT;
+	frac = r & ((1 << STICK_LUT_SHIFT) - 1);
+	gain = st->gain[idx] + ((((int64_t)st->gain[idx + 1] -
+				  st->gain[idx]) * frac) >> STICK_LUT_SHIFT);
+
+	for (int a = 0; a < 2; a++) {
+		val = max(min((n[a] * gain) >> 16, 32767), -32767);
+		val = st->center[a] + (((int64_t)val * st->span[a][val > 0] +
+					(1 << 14)) >> 15);
+		val = max(min(val, st->maximum[a]), st->minimum[a]);
+		if (val != st->out[a]) {
+			st->out[a] = val;
+			emit_event(v_dev, EV_ABS, st->code[a], val);
+		}
+	}
+}
+
+/**
+ * filter_build() - Set up the smoothing filters of the profile
+ * @v_dev: main virtual device struct
+ *
+ * Initialize filter state and tag the remap actions producing each
+ * filtered axis with the filter to use.
+ */
+void filter_build(struct virtual_device *v_dev)
+{
+	v_dev->filters = v_dev->profile.filters;
+	v_dev->filters_unsettled = 0;
+	for (int i = 0; i < v_dev->filters; i++) {
+		const struct filter_config *cfg = &v_dev->profile.filter[i];
+		struct axis_filter *f = &v_dev->filter[i];
+
+		memset(f, 0, sizeof(*f));
+		f->code = cfg->code;
+		f->mincutoff = cfg->mincutoff;
+		f->beta = cfg->beta;
+		f->dtau = 159154943 / cfg->dcutoff;
+
+		for (int j = 0; j < ABS_CNT * (v_dev->merge_maps + 1); j++) {
+			struct remap_action *act = abs_map_entry(v_dev, j);
+
+			if ((act->op == ACTION_PASS ||
+			     act->op == ACTION_STICK ||
+			     act->op == ACTION_TRIGGER) &&
+			    act->code == f->code)
+				act->filter = i + 1;
+		}
+	}
+}
+
+/**
+ * filter_arm() - Start or stop the filter settle timer
+ * @v_dev: main virtual device struct
+ * @on: whether any filter is left to settle
+ */
+void filter_arm(struct virtual_device *v_dev, int on)
+{
+	struct itimerspec its = { 0 };
+
+	if (on) {
+		its.it_value.tv_nsec = FILTER_SETTLE_US * 1000;
+		its.it_interval.tv_nsec = FILTER_SETTLE_US * 1000;
+	}
+	timerfd_settime(v_dev->filter_fd, 0, &its, NULL);
+	v_dev->filter_armed = on;
+}
+
+/**
+ * filter_step() - Advance a 1-euro filter to a new sample
+ * @f: filter of the axis
+ * @now: sample time, low 32 bits in microseconds
+ * @x: sample in Q8
+ *
+ * The cutoff frequency follows the smoothed axis speed, so the filter
+ * smooths heavily at rest and barely at all during fast motion. Time
+ * constants are in microseconds (1e9 / 2pi / cutoff in mHz) and the
+ * smoothing factors are Q16. Return the filtered value.
+ */
+static inline int32_t filter_step(struct axis_filter *f, uint32_t now,
+				  int32_t x)
+{
+	int64_t speed, tau, alpha, err;
+	uint32_t rate;
+	int32_t dt;
+	int bucket;
+
+	dt = max((int32_t)(now - f->last_us), 1);
+	f->last_us = now;
+
+	err = x - f->value;
+	speed = max(min(err * 1000000 / dt, INT32_MAX), -INT32_MAX);
+	alpha = ((int64_t)dt << 16) / (dt + f->dtau);
+	f->speed += ((speed - f->speed) * alpha) >> 16;
+
+	rate = (f->speed < 0 ? -f->speed : f->speed) >> 8;
+	tau = 159154943 / (f->mincutoff + (uint64_t)f->beta * rate);
+	alpha = ((int64_t)dt << 16) / (dt + tau);
+	f->value += (err * alpha) >> 16;
+
+	if (rate) {
+		err = x - f->value;
+		bucket = rate < FILTER_SPEED_BASE ? 0 :
+			 rate < FILTER_SPEED_BASE * 10 ? 1 :
+			 rate < FILTER_SPEED_BASE * 100 ? 2 : 3;
+		f->lag_sum[bucket] += (err < 0 ? -err : err) * 1000000 /
+				      (rate * 256);
+		f->lag_count[bucket]++;
+	}
+
+	return (f->value + 128) >> 8;
+}
+
+/**
+ * filter_apply() - Pass an axis value through its 1-euro filter
+ * @v_dev: main virtual device struct
+ * @act: remap action producing the axis, with its filter set
+ * @ev: source event, for its timestamp
+ * @value: axis value, replaced by the filtered value
+ *
+ * A filter left short of the raw value is handed to the settle timer,
+ * as the source may not send another event to move it on. Return 1 if
+ * the filtered value changed and should be forwarded, 0 if the event
+ * is suppressed.
+ */
+static inline int filter_apply(struct virtual_device *v_dev,
+			       const struct remap_action *act,
+			       const struct input_event *ev, int32_t *value)
+{
+	struct axis_filter *f = &v_dev->filter[act->filter - 1];
+	uint32_t now = ev->input_event_sec * 1000000 + ev->input_event_usec;
+	uint32_t bit = 1u << (act->filter - 1);
+	int32_t out;
+
+	f->raw = *value;
+	f->act = act;
+	if (!f->primed) {
+		f->primed = 1;
+		f->value = *value * 256;
+		f->speed = 0;
+		f->out = *value;
+		f->last_us = now;
+		f->passed++;
+		return 1;
+	}
+
+	out = filter_step(f, now, *value * 256);
+	if (out == f->raw) {
+		v_dev->filters_unsettled &= ~bit;
+	} else if (!(v_dev->filters_unsettled & bit)) {
+		v_dev->filters_unsettled |= bit;
+		if (!v_dev->filter_armed && v_dev->filter_fd > 0)
+			filter_arm(v_dev, 1);
+	}
+
+	if (out == f->out) {
+		f->suppressed++;
+		return 0;
+	}
+
+	f->out = out;
+	f->passed++;
+	*value = out;
+	return 1;
+}
+
+/**
+ * dpad_cell() - Sector table index of a stick axis value
+ * @d: D-pad
+ * @a: axis, 0 for X and 1 for Y
+ */
+static inline int dpad_cell(const struct dpad *d, int a)
+{
+	int32_t q = (((int64_t)d->value[a] - d->center[a]) * d->scale[a]) >>
+		    16;
+
+	return min(max(q + DPAD_GRID / 2, 0), DPAD_GRID - 1);
+}
+
+/**
+ * dpad_emit() - Emit the outputs of a D-pad whose direction changed
+ * @v_dev: main virtual device struct
+ * @d: D-pad
+ * @bits: new direction bits
+ */
+void dpad_emit(struct virtual_device *v_dev, struct dpad *d, uint8_t bits)
+{
+	uint8_t changed = bits ^ d->out;
+
+	d->out = bits;
+	if (d->to == DPAD_KEYS) {
+		for (int b = 0; b < 4; b++) {
+			if (changed & (1 << b))
+				emit_event(v_dev, EV_KEY, dpad_keys[b],
+					   !!(bits & (1 << b)));
+		}
+		return;
+	}
+
+	for (int a = 0; a < 2; a++) {
+		/* Up/down are bits 0/1 and left/right bits 2/3 */
+		int shift = a ? 0 : 2;
+		int dir = !!(bits & (2 << shift)) - !!(bits & (1 << shift));
+
+		if (!(changed & (3 << shift)))
+			continue;
+		if (d->to == DPAD_HAT)
+			emit_event(v_dev, EV_ABS, d->out_code[a], dir);
+		else
+			emit_event(v_dev, EV_ABS, d->out_code[a],
+				   d->out_value[a][dir + 1]);
+	}
+}
+
+/**
+ * dpad_process() - Run the D-pad conversion stage on the output frame
+ * @v_dev: main virtual device struct
+ *
+ * Look every event of the frame up in the D-pad routing tables. Key
+ * and hat inputs are taken out of the frame, stick inputs are left in.
+ * The outputs of every D-pad whose direction changed are appended to
+ * the same frame.
+ */
+void dpad_process(struct virtual_device *v_dev)
+{
+	uint32_t dirty = 0;
+	int n = 0;
+
+	for (int i = 0; i < v_dev->out_len; i++) {
+		struct input_event *ev = &v_dev->out[i];
+		uint8_t route = 0;
+		struct dpad *d;
+
+		if (ev->type == EV_KEY)
+			route = v_dev->dpad_key_route[ev->code];
+		else if (ev->type == EV_ABS)
+			route = v_dev->dpad_abs_route[ev->code];
+		if (!route) {
+			v_dev->out[n++] = *ev;
+			continue;
+		}
+
+		d = &v_dev->dpad[(route & 15) - 1];
+		dirty |= 1u << ((route & 15) - 1);
+		if (d->from == DPAD_KEYS) {
+			if (ev->value)
+				d->held |= route >> 4;
+			else
+				d->held &= ~(route >> 4);
+			continue;
+		}
+
+		d->value[route >> 4] = ev->value;
+		if (d->from == DPAD_STICK)
+			v_dev->out[n++] = *ev;
+	}
+	v_dev->out_len = n;
+
+	while (dirty) {
+		struct dpad *d = &v_dev->dpad[__builtin_ctz(dirty)];
+		uint8_t bits = d->held;
+
+		if (d->from == DPAD_HAT)
+			bits = (d->value[1] < 0 ? DPAD_UP : 0) |
+			       (d->value[1] > 0 ? DPAD_DOWN : 0) |
+			       (d->value[0] < 0 ? DPAD_LEFT : 0) |
+			       (d->value[0] > 0 ? DPAD_RIGHT : 0);
+		else if (d->from == DPAD_STICK)
+			bits = d->sector[dpad_cell(d, 0)][dpad_cell(d, 1)];
+
+		if (bits != d->out)
+			dpad_emit(v_dev, d, bits);
+		dirty &= dirty - 1;
+	}
+}
+
+/**
+ * flush_frame() - Terminate and write the current output frame
+ * @v_dev: main virtual device struct
+ *
+ * Sticks that moved during the frame are processed first so that
+ * their axes are part of the frame, then the D-pad stage sees the
+ * final frame. Frames that ended up empty, for
+ * instance because every event was dropped by the remap stage or
+ * stayed inside a deadzone, are not forwarded at all.
+ *
+ * uinput stamps events with the time they are written, so frames built
+ * from source input also carry the earliest source timestamp of the
+ * frame as MSC_TIMESTAMP, in microseconds of CLOCK_MONOTONIC,
+ * truncated to 32 bits like hardware timestamps.
+ *
+ * Key events queued by chords during the frame follow it, each in a
+ * frame of its own.
+ */
+void flush_frame(struct virtual_device *v_dev)
+{
+	while (v_dev->sticks_dirty) {
+		int i = __builtin_ctz(v_dev->sticks_dirty);
+
+		stick_process(v_dev, &v_dev->stick[i]);
+		v_dev->sticks_dirty &= v_dev->sticks_dirty - 1;
+	}
+
+	if (v_dev->dpads)
+		dpad_process(v_dev);
+
+	if (v_dev->out_len) {
+		if (v_dev->frame_us)
+			emit_event(v_dev, EV_MSC, MSC_TIMESTAMP,
+				   (int32_t)(uint32_t)v_dev->frame_us);
+		emit_event(v_dev, EV_SYN, SYN_REPORT, 0);
+		write_frame(v_dev);
+	}
+	v_dev->frame_us = 0;
+
+	for (int i = 0; i < v_dev->chord_queued; i++) {
+		const struct input_event *ev = &v_dev->chord_queue[i];
+
+		emit_event(v_dev, EV_KEY, ev->code, ev->value);
+		emit_event(v_dev, EV_SYN, SYN_REPORT, 0);
+		write_frame(v_dev);
+	}
+	v_dev->chord_queued = 0;
+}
+
+/**
+ * turbo_arm() - Arm the turbo timer for the earliest deadline
+ * @v_dev: main virtual device struct
+ *
+ * The timer is disarmed while no turbo key is held, so idle turbo
+ * keys cause no wakeups at all.
+ */
+void turbo_arm(struct virtual_device *v_dev)
+{
+	struct itimerspec its = { 0 };
+	uint64_t next;
+
+	if (v_dev->turbo_queued) {
+		next = v_dev->turbo[v_dev->turbo_queue[0]].deadline_us;
+		its.it_value.tv_sec = next / 1000000;
+		its.it_value.tv_nsec = next % 1000000 * 1000;
+	}
+	timerfd_settime(v_dev->turbo_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * turbo_dequeue() - Remove a turbo key from the deadline list
+ * @v_dev: main virtual device struct
+ * @index: index of the turbo key
+ */
+void turbo_dequeue(struct virtual_device *v_dev, int index)
+{
+	int i;
+
+	for (i = 0; i < v_dev->turbo_queued; i++) {
+		if (v_dev->turbo_queue[i] == index)
+			break;
+	}
+	if (i == v_dev->turbo_queued)
+		return;
+
+	v_dev->turbo_queued--;
+	memmove(&v_dev->turbo_queue[i], &v_dev->turbo_queue[i + 1],
+		v_dev->turbo_queued - i);
+}
+
+/**
+ * turbo_enqueue() - Insert a turbo key into the deadline list
+ * @v_dev: main virtual device struct
+ * @index: index of the turbo key, with its deadline set
+ *
+ * The list is kept sorted by deadline, so the timer only ever needs
+ * the first entry.
+ */
+void turbo_enqueue(struct virtual_device *v_dev, int index)
+{
+	uint64_t deadline = v_dev->turbo[index].deadline_us;
+	int i = v_dev->turbo_queued;
+
+	while (i > 0 &&
+	       v_dev->turbo[v_dev->turbo_queue[i - 1]].deadline_us > deadline) {
+		v_dev->turbo_queue[i] = v_dev->turbo_queue[i - 1];
+		i--;
+	}
+	v_dev->turbo_queue[i] = index;
+	v_dev->turbo_queued++;
+}
+
+/**
+ * turbo_grid() - Next toggle time of a turbo key after a given time
+ * @t: turbo key
+ * @after_us: time in microseconds
+ *
+ * Toggles happen on multiples of the period, so that all turbo keys of
+ * the same rate toggle together and share a single timer wakeup.
+ */
+static inline uint64_t turbo_grid(const struct turbo *t, uint64_t after_us)
+{
+	return (after_us / t->period_us + 1) * t->period_us;
+}
+
+/**
+ * turbo_key() - Handle a source event of a turbo key
+ * @v_dev: main virtual device struct
+ * @index: index of the turbo key
+ * @value: key event value
+ *
+ * Pressing the key presses the output key at once and starts toggling
+ * it, releasing the key releases the output key if it is down. The
+ * first press lasts at least half a period.
+ */
+void turbo_key(struct virtual_device *v_dev, int index, int value)
+{
+	struct turbo *t = &v_dev->turbo[index];
+
+	if (value == 2 || !!value == t->held)
+		return;
+
+	t->held = !!value;
+	if (t->held) {
+		t->state = 1;
+		emit_event(v_dev, EV_KEY, t->code, 1);
+		t->deadline_us = turbo_grid(t, now_us() + t->period_us / 2);
+		turbo_enqueue(v_dev, index);
+	} else {
+		turbo_dequeue(v_dev, index);
+		if (t->state)
+			emit_event(v_dev, EV_KEY, t->code, 0);
+		t->state = 0;
+	}
+	turbo_arm(v_dev);
+}
+
+/**
+ * turbo_tick() - Handle the turbo timer
+ * @v_dev: main virtual device struct
+ *
+ * Toggle every turbo key whose deadline has passed and write them out
+ * as one frame. A key that fell behind by more than a period, for
+ * instance after a long stall, skips the missed toggles.
+ */
+void turbo_tick(struct virtual_device *v_dev)
+{
+	uint64_t expirations, now;
+
+	if (read(v_dev->turbo_fd, &expirations, sizeof(expirations)) !=
+	    sizeof(expirations))
+		return;
+
+	now = now_us();
+	while (v_dev->turbo_queued) {
+		int index = v_dev->turbo_queue[0];
+		struct turbo *t = &v_dev->turbo[index];
+
+		if (t->deadline_us > now)
+			break;
+
+		t->state = !t->state;
+		emit_event(v_dev, EV_KEY, t->code, t->state);
+		t->deadline_us += t->period_us;
+		if (t->deadline_us <= now)
+			t->deadline_us = turbo_grid(t, now);
+		turbo_dequeue(v_dev, index);
+		turbo_enqueue(v_dev, index);
+		v_dev->turbo_ticks++;
+	}
+
+	flush_frame(v_dev);
+	turbo_arm(v_dev);
+}
+
+/**
+ * turbo_setup() - Route turbo keys through ACTION_TURBO
+ * @v_dev: main virtual device struct
+ *
+ * Return 0 on success or if no turbo key is configured, negative on
+ * error.
+ */
+int turbo_setup(struct virtual_device *v_dev)
+{
+	v_dev->turbo_fd = -1;
+	v_dev->turbos = v_dev->profile.turbos;
+	if (!v_dev->turbos)
+		return 0;
+
+	v_dev->turbo_fd = timerfd_create(CLOCK_MONOTONIC,
+					 TFD_NONBLOCK | TFD_CLOEXEC);
+	if (v_dev->turbo_fd == -1)
+		return -errno;
+
+	for (int i = 0; i < v_dev->turbos; i++) {
+		const struct turbo_config *cfg = &v_dev->profile.turbo[i];
+		struct turbo *t = &v_dev->turbo[i];
+
+		memset(t, 0, sizeof(*t));
+		t->code = cfg->code;
+		t->period_us = 500000 / cfg->rate;
+
+		for (int j = 0; j < KEY_CNT; j++) {
+			struct remap_action *act = &v_dev->key_map[j];
+
+			if (act->op == ACTION_PASS && act->code == t->code) {
+				act->op = ACTION_TURBO;
+				act->code2 = i;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * chord_exec() - Run the command of a chord without waiting for it
+ * @cmd: shell command
+ *
+ * The command runs in its own session with default signal handling
+ * and none of the descriptors of the daemon, so that it cannot keep
+ * the virtual device alive. Children are reaped automatically as
+ * SIGCHLD is ignored.
+ */
+void chord_exec(const char *cmd)
+{
+	pid_t pid = fork();
+
+	if (pid == -1) {
+		printf("Unable to run \"%s\": %d\n", cmd, -errno);
+		return;
+	}
+	if (pid)
+		return;
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	for (int fd = 3; fd < 1024; fd++)
+		close(fd);
+	setsid();
+	execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+	_exit(127);
+}
+
+/**
+ * chord_queue() - Queue a press and release for the end of the frame
+ * @v_dev: main virtual device struct
+ * @code: key code on the virtual device
+ *
+ * Writing them out at once would split the source frame being
+ * processed, so flush_frame() sends them after it.
+ */
+void chord_queue(struct virtual_device *v_dev, int code)
+{
+	struct input_event *q = v_dev->chord_queue;
+
+	if (v_dev->chord_queued > CHORD_QUEUE - 2)
+		return;
+	q[v_dev->chord_queued].code = code;
+	q[v_dev->chord_queued++].value = 1;
+	q[v_dev->chord_queued].code = code;
+	q[v_dev->chord_queued++].value = 0;
+}
+
+/**
+ * chord_fire() - Consume a completed chord and run its action
+ * @v_dev: main virtual device struct
+ * @c: chord
+ *
+ * Keys of the chord whose press was held back are never forwarded and
+ * their release is swallowed. A key action is a press and release of
+ * its key in frames of their own, after the current frame.
+ */
+void chord_fire(struct virtual_device *v_dev, struct chord *c)
+{
+	for (int i = 0; i < c->keys; i++) {
+		int code = c->key[i];
+
+		if (BITMAP_TEST(v_dev->chord_deferred, code)) {
+			BITMAP_CLEAR(v_dev->chord_deferred, code);
+			BITMAP_SET(v_dev->chord_consumed, code);
+			v_dev->chords_deferred--;
+		}
+	}
+	c->fired++;
+
+	switch (c->action) {
+	case CHORD_KEY:
+		chord_queue(v_dev, c->code);
+		break;
+	case CHORD_EXEC:
+		chord_exec(c->cmd);
+		break;
+	case CHORD_STATS:
+		stats_requested = 1;
+		break;
+	}
+}
+
+/**
+ * chord_flush() - Forward the key presses held back for chords
+ * @v_dev: main virtual device struct
+ *
+ * Called when a key press makes clear that the held keys are not used
+ * for a chord, so that for instance MODE+A still reaches games.
+ */
+void chord_flush(struct virtual_device *v_dev)
+{
+	for (int i = 0; i < (int)ARRAY_SIZE(v_dev->chord_deferred); i++) {
+		while (v_dev->chord_deferred[i]) {
+			int bit = __builtin_ctzll(v_dev->chord_deferred[i]);
+
+			emit_event(v_dev, EV_KEY, i * 64 + bit, 1);
+			v_dev->chord_deferred[i] &= ~(1ull << bit);
+		}
+	}
+	v_dev->chords_deferred = 0;
+}
+
+/**
+ * chord_key() - Handle a key that is part of a chord
+ * @v_dev: main virtual device struct
+ * @code: key code on the virtual device
+ * @value: key event value
+ *
+ * Keys other than the last of a chord are modifiers: their press is
+ * held back until it is clear whether a chord follows. Pressing the
+ * last key of a chord whose other keys are all down fires the chord,
+ * any other press forwards the held back modifiers first. A modifier
+ * released without completing a chord is forwarded as a tap after the
+ * current frame.
+ */
+void chord_key(struct virtual_device *v_dev, int code, int value)
+{
+	uint32_t chords = v_dev->chord_trigger[code];
+
+	if (value == 2)
+		return;
+
+	if (!value) {
+		BITMAP_CLEAR(v_dev->chord_pressed, code);
+		if (BITMAP_TEST(v_dev->chord_consumed, code)) {
+			BITMAP_CLEAR(v_dev->chord_consumed, code);
+			return;
+		}
+		if (BITMAP_TEST(v_dev->chord_deferred, code)) {
+			BITMAP_CLEAR(v_dev->chord_deferred, code);
+			v_dev->chords_deferred--;
+			chord_queue(v_dev, code);
+			return;
+		}
+		emit_event(v_dev, EV_KEY, code, 0);
+		return;
+	}
+
+	BITMAP_SET(v_dev->chord_pressed, code);
+	while (chords) {
+		struct chord *c = &v_dev->chord[__builtin_ctz(chords)];
+		int i;
+
+		for (i = 0; i < c->keys; i++) {
+			if (!BITMAP_TEST(v_dev->chord_pressed, c->key[i]))
+				break;
+		}
+		if (i == c->keys) {
+			BITMAP_SET(v_dev->chord_consumed, code);
+			chord_fire(v_dev, c);
+			return;
+		}
+		chords &= chords - 1;
+	}
+
+	if (BITMAP_TEST(v_dev->chord_modifier, code)) {
+		BITMAP_SET(v_dev->chord_deferred, code);
+		v_dev->chords_deferred++;
+		return;
+	}
+
+	if (v_dev->chords_deferred)
+		chord_flush(v_dev);
+	emit_event(v_dev, EV_KEY, code, 1);
+}
+
+/**
+ * filter_tick() - Handle the filter settle timer
+ * @v_dev: main virtual device struct
+ *
+ * Step every filter whose source has been quiet for FILTER_SETTLE_US
+ * toward the last raw value, so that a stick left at rest or at full
+ * travel is reported there even if its source sends nothing more. A
+ * step too small to move the filter at all snaps it to the raw value.
+ * Changed values go out as one frame.
+ */
+void filter_tick(struct virtual_device *v_dev)
+{
+	uint32_t now = now_us();
+	uint64_t expirations;
+	int32_t out, before;
+
+	if (read(v_dev->filter_fd, &expirations, sizeof(expirations)) !=
+	    sizeof(expirations))
+		return;
+
+	for (uint32_t bits = v_dev->filters_unsettled; bits;
+	     bits &= bits - 1) {
+		int i = __builtin_ctz(bits);
+		struct axis_filter *f = &v_dev->filter[i];
+		const struct remap_action *act = f->act;
+
+		if ((int32_t)(now - f->last_us) < FILTER_SETTLE_US)
+			continue;
+
+		before = f->value;
+		out = filter_step(f, now, f->raw * 256);
+		if (f->value == before) {
+			f->value = f->raw * 256;
+			out = f->raw;
+		}
+		if (out == f->raw)
+			v_dev->filters_unsettled &= ~(1u << i);
+		if (out == f->out)
+			continue;
+
+		f->out = out;
+		f->settled++;
+		if (act->op == ACTION_STICK) {
+			v_dev->stick[act->code2 >> 1].raw[act->code2 & 1] =
+				out;
+			v_dev->sticks_dirty |= 1u << (act->code2 >> 1);
+		} else {
+			emit_event(v_dev, EV_ABS, act->code, out);
+		}
+	}
+
+	flush_frame(v_dev);
+	if (!v_dev->filters_unsettled)
+		filter_arm(v_dev, 0);
+}
+
+/**
+ * filter_setup() - Set up the filter settle timer
+ * @v_dev: main virtual device struct
+ *
+ * Return 0 on success or if no axis is filtered, negative on error.
+ */
+int filter_setup(struct virtual_device *v_dev)
+{
+	v_dev->filter_fd = -1;
+	if (!v_dev->filters)
+		return 0;
+
+	v_dev->filter_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (v_dev->filter_fd == -1)
+		return -errno;
+	return 0;
+}
+
+/**
+ * forward_event() - Pass a source event through the remap stage
+ * @v_dev: main virtual device struct
+ * @abs_map: abs remap table of the source
+ * @ev: event read from a source device
+ *
+ * Look the event up in the flat remap table for its type and emit the
+ * resulting event(s) into the current frame, which is written out on
+ * SYN_REPORT. Stick axes are only recorded here and emitted by the
+ * stick stage at the end of the frame.
+ */
+void forward_event(struct virtual_device *v_dev,
+		   const struct remap_action *abs_map,
+		   const struct input_event *ev)
+{
+	const struct remap_action *act;
+	struct trigger *trig;
+	uint8_t state, changed;
+	int32_t value;
+
+	switch (ev->type) {
+	case EV_SYN:
+		if (ev->code == SYN_REPORT)
+			flush_frame(v_dev);
+		break;
+	case EV_KEY:
+		act = &v_dev->key_map[ev->code];
+		if (v_dev->chords_deferred && ev->value == 1 &&
+		    act->op != ACTION_CHORD)
+			chord_flush(v_dev);
+		if (act->op == ACTION_PASS)
+			emit_event(v_dev, EV_KEY, act->code, ev->value);
+		else if (act->op == ACTION_KEY_TO_ABS)
+			emit_event(v_dev, EV_ABS, act->code,
+				   act->arg[!!ev->value]);
+		else if (act->op == ACTION_TURBO)
+			turbo_key(v_dev, act->code2, ev->value);
+		else if (act->op == ACTION_CHORD)
+			chord_key(v_dev, act->code, ev->value);
+		break;
+	case EV_ABS:
+		act = &abs_map[ev->code];
+		switch (act->op) {
+		case ACTION_PASS:
+			value = ((int64_t)ev->value * act->arg[0] +
+				 act->arg[1]) >> act->shift;
+			if (act->filter &&
+			    !filter_apply(v_dev, act, ev, &value))
+				break;
+			emit_event(v_dev, EV_ABS, act->code, value);
+			break;
+		case ACTION_STICK:
+			value = ((int64_t)ev->value * act->arg[0] +
+				 act->arg[1]) >> act->shift;
+			if (act->filter &&
+			    !filter_apply(v_dev, act, ev, &value))
+				break;
+			v_dev->stick[act->code2 >> 1].raw[act->code2 & 1] =
+				value;
+			v_dev->sticks_dirty |= 1u << (act->code2 >> 1);
+			break;
+		case ACTION_TRIGGER:
+			value = ((int64_t)ev->value * act->arg[0] +
+				 act->arg[1]) >> act->shift;
+			trig = &v_dev->trigger[act->code2];
+			state = value >= trig->threshold;
+			if (state != trig->state) {
+				trig->state = state;
+				trig->threshold = state ? trig->release :
+							  trig->press;
+				emit_event(v_dev, EV_KEY, trig->key, state);
+			}
+			if (act->filter &&
+			    !filter_apply(v_dev, act, ev, &value))
+				break;
+			emit_event(v_dev, EV_ABS, act->code, value);
+			break;
+		case ACTION_ABS_TO_KEY:
+			state = (ev->value >= act->arg[0]) |
+				(ev->value <= act->arg[1]) << 1;
+			changed = state ^ v_dev->abs_key_state[ev->code];
+			v_dev->abs_key_state[ev->code] = state;
+			if (changed & 1)
+				emit_event(v_dev, EV_KEY, act->code,
+					   state & 1);
+			if (changed & 2)
+				emit_event(v_dev, EV_KEY, act->code2,
+					   state >> 1);
+			break;
+		}
+		break;
+	}
+}
+
+/**
+ * find_source() - Look up the source a file descriptor belongs to
+ * @v_dev: main virtual device struct
+ * @fd: file descriptor
+ *
+ * Return the source, or NULL if @fd is not a source.
+ */
+struct source *find_source(struct virtual_device *v_dev, int fd)
+{
+	for (int i = 0; i < v_dev->sources; i++) {
+		if (v_dev->src[i].fd == fd)
+			return &v_dev->src[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * source_commit() - Forward a complete frame from a source
+ * @v_dev: main virtual device struct
+ * @src: source the frame came from
+ * @evs: events of the frame, ending with its SYN_REPORT
+ * @count: number of events
+ *
+ * Update the shadow state of the source and pass the events on. A
+ * device with both keys and axes is opened as two sources, so key and
+ * axis events are only taken from the source opened for their type:
+ * the key source would otherwise forward the axes through the shared
+ * abs remap table, bypassing the one merge_plan() gave the device.
+ */
+void source_commit(struct virtual_device *v_dev, struct source *src,
+		   const struct input_event *evs, int count)
+{
+	if (count && (!v_dev->frame_us || event_us(evs) < v_dev->frame_us))
+		v_dev->frame_us = event_us(evs);
+
+	for (int i = 0; i < count; i++) {
+		const struct input_event *ev = &evs[i];
+		uint8_t bit = 1 << (ev->code % 8);
+
+		if ((ev->type == EV_KEY || ev->type == EV_ABS) &&
+		    ev->type != src->type)
+			continue;
+
+		if (ev->type == EV_KEY) {
+			if (ev->value)
+				src->keys[ev->code / 8] |= bit;
+			else
+				src->keys[ev->code / 8] &= ~bit;
+		} else if (ev->type == EV_ABS) {
+			src->abs[ev->code] = ev->value;
+			if (ev->value < src->cal_min[ev->code])
+				src->cal_min[ev->code] = ev->value;
+			if (ev->value > src->cal_max[ev->code])
+				src->cal_max[ev->code] = ev->value;
+		}
+		forward_event(v_dev, src->abs_map, ev);
+	}
+}
+
+/**
+ * source_resync() - Bring a source back in sync with its device
+ * @v_dev: main virtual device struct
+ * @src: source to resynchronize
+ * @when_us: timestamp to give the synthesized events
+ *
+ * Read the true key and axis state of the device and forward only the
+ * keys and axes that differ from the shadow state, as they would have
+ * been reported by the device. The caller terminates the frame.
+ * Return the number of events synthesized.
+ */
+int source_resync(struct virtual_device *v_dev, struct source *src,
+		  uint64_t when_us)
+{
+	struct input_event ev = {
+		.input_event_sec = when_us / 1000000,
+		.input_event_usec = when_us % 1000000,
+	};
+	struct input_absinfo absinfo;
+	uint8_t keys[KEY_CNT / 8];
+	int count = 0;
+
+	if (ioctl(src->fd, EVIOCGKEY(sizeof(keys)), keys) >= 0) {
+		ev.type = EV_KEY;
+		for (int i = 0; i < (int)sizeof(keys); i++) {
+			uint8_t diff = (keys[i] ^ src->keys[i]) &
+				       src->key_bits[i];
+
+			while (diff) {
+				int bit = __builtin_ctz(diff);
+
+				ev.code = i * 8 + bit;
+				ev.value = !!(keys[i] & (1 << bit));
+				source_commit(v_dev, src, &ev, 1);
+				diff &= diff - 1;
+				count++;
+			}
+		}
+	}
+
+	ev.type = EV_ABS;
+	for (uint64_t bits = src->abs_bits; bits; bits &= bits - 1) {
+		ev.code = __builtin_ctzll(bits);
+		if (ioctl(src->fd, EVIOCGABS(ev.code), &absinfo) ||
+		    absinfo.value == src->abs[ev.code])
+			continue;
+		ev.value = absinfo.value;
+		source_commit(v_dev, src, &ev, 1);
+		count++;
+	}
+
+	v_dev->resync_events += count;
+	return count;
+}
+
+/**
+ * reconnect_arm() - Arm the reconnect timer for the earliest retry
+ * @v_dev: main virtual device struct
+ *
+ * All lost sources share one timer, which is disarmed when no source
+ * is waiting to be reconnected.
+ */
+void reconnect_arm(struct virtual_device *v_dev)
+{
+	struct itimerspec its = { 0 };
+	uint64_t next = UINT64_MAX;
+
+	for (int i = 0; i < v_dev->sources; i++) {
+		if (v_dev->src[i].fd < 0 && v_dev->src[i].retry_us)
+			next = min(next, v_dev->src[i].retry_us);
+	}
+
+	if (next != UINT64_MAX) {
+		its.it_value.tv_sec = next / 1000000;
+		its.it_value.tv_nsec = next % 1000000 * 1000;
+	}
+	timerfd_settime(v_dev->reconnect_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * source_lost() - Handle removal of a source device
+ * @v_dev: main virtual device struct
+ * @src: source that went away
+ *
+ * Stop monitoring the source and release everything it was holding in
+ * a single frame, so that no key stays pressed and no axis stays
+ * deflected on the virtual device. The source keeps its entry in the
+ * registry and a reconnect is scheduled if enabled.
+ */
+void source_lost(struct virtual_device *v_dev, struct source *src)
+{
+	uint64_t now = now_us();
+	struct input_event ev = {
+		.input_event_sec = now / 1000000,
+		.input_event_usec = now % 1000000,
+	};
+
+	printf("Lost source %s\n", src->node);
+	epoll_ctl(v_dev->ep_fd, EPOLL_CTL_DEL, src->fd, NULL);
+	close(src->fd);
+	*src->fd_slot = 0;
+	src->fd = -1;
+	src->pending = 0;
+	src->dropping = 0;
+	v_dev->sources_lost++;
+
+	ev.type = EV_KEY;
+	for (int i = 0; i < (int)sizeof(src->keys); i++) {
+		while (src->keys[i]) {
+			ev.code = i * 8 + __builtin_ctz(src->keys[i]);
+			ev.value = 0;
+			source_commit(v_dev, src, &ev, 1);
+		}
+	}
+
+	ev.type = EV_ABS;
+	for (uint64_t bits = src->abs_bits; bits; bits &= bits - 1) {
+		ev.code = __builtin_ctzll(bits);
+		if (src->abs[ev.code] == src->abs_center[ev.code])
+			continue;
+		ev.value = src->abs_center[ev.code];
+		source_commit(v_dev, src, &ev, 1);
+	}
+	flush_frame(v_dev);
+
+	if (v_dev->reconnect_fd < 0)
+		return;
+	src->backoff_ms = v_dev->profile.reconnect.initial_ms;
+	src->retry_us = now + src->backoff_ms * 1000ull;
+	reconnect_arm(v_dev);
+}
+
+/**
+ * trace_flush() - Write out the recorded events
+ * @v_dev: main virtual device struct
+ *
+ * Recording stops if the trace cannot be written.
+ */
+void trace_flush(struct virtual_device *v_dev)
+{
+	size_t len = v_dev->traced * sizeof(struct trace_record);
+
+	if (v_dev->trace_fd <= 0 || !v_dev->traced)
+		return;
+
+	if (write(v_dev->trace_fd, v_dev->trace, len) != (ssize_t)len) {
+		printf("Unable to write event trace, recording stopped\n");
+		close(v_dev->trace_fd);
+		v_dev->trace_fd = -1;
+	}
+	v_dev->traced = 0;
+}
+
+/**
+ * trace_events() - Record events read from a source
+ * @v_dev: main virtual device struct
+ * @src: source the events were read from
+ * @evs: events read
+ * @count: number of events
+ *
+ * Records are buffered and written out once TRACE_BATCH of them are
+ * pending, or once a second has passed since the last write.
+ */
+void trace_events(struct virtual_device *v_dev, const struct source *src,
+		  const struct input_event *evs, int count)
+{
+	for (int i = 0; i < count; i++) {
+		struct trace_record *rec = &v_dev->trace[v_dev->traced++];
+
+		rec->time_us = event_us(&evs[i]);
+		rec->source = src - v_dev->src;
+		rec->type = evs[i].type;
+		rec->code = evs[i].code;
+		rec->value = evs[i].value;
+		v_dev->trace_records++;
+
+		if (v_dev->traced == TRACE_BATCH ||
+		    rec->time_us - v_dev->trace_flush_us > TRACE_FLUSH_US) {
+			trace_flush(v_dev);
+			v_dev->trace_flush_us = rec->time_us;
+		}
+	}
+}
+
+/**
+ * trace_start() - Start recording source events
+ * @v_dev: main virtual device struct, with all sources opened
+ * @path: file to record to
+ *
+ * The trace header describes every source, followed by the events as
+ * they are read from the sources. See trace.h for the format. Return 0
+ * on success, negative on error.
+ */
+int trace_start(struct virtual_device *v_dev, const char *path)
+{
+	static struct trace_header hdr;
+
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(struct trace_record);
+	hdr.sources = v_dev->sources;
+	for (int i = 0; i < v_dev->sources; i++) {
+		struct trace_source *ts = &hdr.source[i];
+		struct source *src = &v_dev->src[i];
+
+		memcpy(ts->node, src->node, sizeof(ts->node));
+		if (src->fd >= 0)
+			ioctl(src->fd, EVIOCGNAME(sizeof(ts->name) - 1),
+			      ts->name);
+		ts->abs_bits = src->abs_bits;
+		memcpy(ts->abs_min, src->abs_min, sizeof(ts->abs_min));
+		memcpy(ts->abs_max, src->abs_max, sizeof(ts->abs_max));
+	}
+
+	v_dev->trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC |
+				     O_CLOEXEC, 0644);
+	if (v_dev->trace_fd == -1)
+		return -errno;
+
+	if (write(v_dev->trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(v_dev->trace_fd);
+		v_dev->trace_fd = -1;
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * source_read() - Read and forward events from a source
+ * @v_dev: main virtual device struct
+ * @src: source with pending input
+ *
+ * Events are only passed on once their frame is complete, so a frame
+ * is never split and a frame cut short by SYN_DROPPED is discarded as
+ * a whole. Events up to the SYN_REPORT following a SYN_DROPPED are
+ * discarded too, after which the source is resynchronized in a single
+ * frame. An incomplete frame at the end of a read is kept at the start
+ * of the source buffer until the rest of it arrives.
+ */
+void source_read(struct virtual_device *v_dev, struct source *src)
+{
+	int len, count, start = 0;
+
+	len = read(src->fd, src->buf + src->pending,
+		   (READ_BATCH - src->pending) * sizeof(struct input_event));
+	if (len == -1) {
+		if (errno == ENODEV)
+			source_lost(v_dev, src);
+		else if (errno != EAGAIN)
+			printf("read failed descriptor %d, errno %d\n",
+			       src->fd, errno);
+		return;
+	}
+
+	count = src->pending + len / sizeof(struct input_event);
+	if (v_dev->trace_fd > 0)
+		trace_events(v_dev, src, &src->buf[src->pending],
+			     count - src->pending);
+
+	if (count > src->pending &&
+	    (!v_dev->stall_input_us ||
+	     event_us(&src->buf[src->pending]) < v_dev->stall_input_us))
+		v_dev->stall_input_us = event_us(&src->buf[src->pending]);
+
+	for (int i = src->pending; i < count; i++) {
+		const struct input_event *ev = &src->buf[i];
+
+		flight_record(v_dev, FLIGHT_EVENT, ev->type, ev->code,
+			      ev->value, event_us(ev));
+		if (ev->type != EV_SYN)
+			continue;
+
+		if (ev->code == SYN_DROPPED) {
+			src->dropping = 1;
+			v_dev->sync_dropped++;
+			start = i + 1;
+		} else if (ev->code == SYN_REPORT && src->dropping) {
+			src->dropping = 0;
+			source_resync(v_dev, src, event_us(ev));
+			flush_frame(v_dev);
+			start = i + 1;
+		} else if (ev->code == SYN_REPORT) {
+			source_commit(v_dev, src, &src->buf[start],
+				      i + 1 - start);
+			start = i + 1;
+		}
+	}
+
+	/* A frame too large for the buffer is forwarded in pieces */
+	if (start == 0 && count == READ_BATCH && !src->dropping) {
+		source_commit(v_dev, src, src->buf, count);
+		start = count;
+	}
+
+	src->pending = src->dropping ? 0 : count - start;
+	if (src->pending && start)
+		memmove(src->buf, &src->buf[start],
+			src->pending * sizeof(struct input_event));
+
+	if (count) {
+		poll_activity(v_dev, event_us(&src->buf[count - 1]));
+		cal_activity(v_dev, event_us(&src->buf[count - 1]));
+		qos_activity(v_dev, event_us(&src->buf[count - 1]));
+		boost_activity(v_dev, event_us(&src->buf[count - 1]));
+	}
+}
+
+/**
+ * source_reprobe() - Look for the device of a lost source
+ * @v_dev: main virtual device struct
+ * @src: lost source
+ *
+ * A device is taken as the lost one if it matches the same rule and
+ * has the event type the source was opened for. Nodes already opened
+ * for the same role are skipped. On success the source is reopened
+ * and monitored again, and its device state is forwarded as it
+ * differs from the released state. Return 0 on success, negative if
+ * the device has not come back.
+ */
+int source_reprobe(struct virtual_device *v_dev, struct source *src)
+{
+	struct epoll_event event = { .events = EPOLLIN };
+	struct dev_id id;
+	char node[16];
+	int in_use, shared;
+
+	for (int i = 0; i < 256; i++) {
+		snprintf(node, sizeof(node), "event%d", i);
+		if (input_device_match(&v_dev->profile.rules, node, &id) !=
+		    src->rule)
+			continue;
+
+		read_dev_id(node, &id);
+		if (!(id.evbits & (1 << src->type)))
+			continue;
+
+		in_use = 0;
+		shared = 0;
+		for (int j = 0; j < v_dev->sources; j++) {
+			struct source *s = &v_dev->src[j];
+
+			if (s->fd < 0 || strcmp(s->node, node))
+				continue;
+			if (s->type == src->type)
+				in_use = 1;
+			else
+				shared = 1;
+		}
+		if (in_use)
+			continue;
+
+		snprintf(src->node, sizeof(src->node), "%s", node);
+		if (source_open(src) < 0)
+			continue;
+
+		event.data.fd = src->fd;
+		if (epoll_ctl(v_dev->ep_fd, EPOLL_CTL_ADD, src->fd, &event)) {
+			close(src->fd);
+			src->fd = -1;
+			return -errno;
+		}
+		*src->fd_slot = src->fd;
+		source_resync(v_dev, src, now_us());
+		flush_frame(v_dev);
+		/* The poll attribute is per node, not per source */
+		if (v_dev->poll_timer.fd >= 0 && !shared)
+			poll_add_device(v_dev, node);
+		return 0;
+	}
+
+	return -ENODEV;
+}
+
+/**
+ * reconnect_sources() - Handle the reconnect timer
+ * @v_dev: main virtual device struct
+ *
+ * Reprobe every lost source whose retry time has come. The retry
+ * interval of a source doubles on each failed attempt, up to the
+ * configured maximum.
+ */
+void reconnect_sources(struct virtual_device *v_dev)
+{
+	uint32_t max_ms = v_dev->profile.reconnect.max_ms;
+	uint64_t expirations, now;
+
+	if (read(v_dev->reconnect_fd, &expirations, sizeof(expirations)) !=
+	    sizeof(expirations))
+		return;
+
+	now = now_us();
+	for (int i = 0; i < v_dev->sources; i++) {
+		struct source *src = &v_dev->src[i];
+
+		if (src->fd >= 0 || !src->retry_us || src->retry_us > now)
+			continue;
+
+		if (!source_reprobe(v_dev, src)) {
+			printf("Reconnected source %s\n", src->node);
+			src->retry_us = 0;
+			v_dev->sources_reconnected++;
+			continue;
+		}
+		src->backoff_ms = min(src->backoff_ms * 2, max_ms);
+		src->retry_us = now + src->backoff_ms * 1000ull;
+	}
+	reconnect_arm(v_dev);
+}
+
+/**
+ * reconnect_setup() - Create the reconnect timer
+ * @v_dev: main virtual device struct
+ *
+ * Return 0 on success or if reconnecting is disabled, negative on
+ * error.
+ */
+int reconnect_setup(struct virtual_device *v_dev)
+{
+	v_dev->reconnect_fd = -1;
+	if (!v_dev->profile.reconnect.initial_ms)
+		return 0;
+
+	v_dev->reconnect_fd = timerfd_create(CLOCK_MONOTONIC,
+					     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (v_dev->reconnect_fd == -1)
+		return -errno;
+	return 0;
+}
+
+/**
+ * suspend_offset() - Time spent in suspend since boot
+ *
+ * CLOCK_BOOTTIME keeps running during suspend while CLOCK_MONOTONIC
+ * does not, so their difference grows by the length of each suspend.
+ * Return the difference in microseconds.
+ */
+int64_t suspend_offset(void)
+{
+	struct timespec boot, mono;
+
+	clock_gettime(CLOCK_BOOTTIME, &boot);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	return (boot.tv_sec - mono.tv_sec) * 1000000ll +
+	       (boot.tv_nsec - mono.tv_nsec) / 1000;
+}
+
+/**
+ * check_resume() - Resynchronize all sources after system suspend
+ * @v_dev: main virtual device struct
+ *
+ * If the system was suspended since the last check, anything queued
+ * by the sources meanwhile is dropped and every source is
+ * resynchronized in one frame.
+ */
+void check_resume(struct virtual_device *v_dev)
+{
+	struct input_event evs[READ_BATCH];
+	int64_t offset = suspend_offset();
+
+	if (offset - v_dev->suspend_offset < SUSPEND_THRESHOLD_US) {
+		v_dev->suspend_offset = offset;
+		return;
+	}
+	v_dev->suspend_offset = offset;
+	v_dev->resumes++;
+
+	v_dev->out_len = 0;
+	for (int i = 0; i < v_dev->sources; i++) {
+		struct source *src = &v_dev->src[i];
+
+		if (src->fd < 0)
+			continue;
+		while (read(src->fd, evs, sizeof(evs)) > 0)
+			;
+		src->pending = 0;
+		src->dropping = 0;
+		source_resync(v_dev, src, now_us());
+	}
+	flush_frame(v_dev);
+}
+
+/**
+ * parse_ev_incoming() - Process incoming event and hand off to correct
+ * helper function.
+ *
+ * @v_dev: main virtual device struct
+ * @fd_in: file descriptor responsible for event
+ *
+ * Process an EPOLLIN request and hand off necessary data to correct
+ * function. Events from source devices are handled by source_read().
+ * Return value is 0 for success, negative for error.
+ */
+void parse_ev_incoming(struct virtual_device *v_dev, int fd_in)
+{
+	struct input_event ev;
+	struct source *src;
+	uint64_t start;
+	int len;
+
+	if (v_dev->uinput_fd != fd_in) {
+		src = find_source(v_dev, fd_in);
+		if (src)
+			source_read(v_dev, src);
+		return;
+	}
+
+	len = read(fd_in, &ev, sizeof(ev));
+	if (len != -1) {
+		switch (ev.type) {
+		case EV_UINPUT:
+			start = flight_now(v_dev);
+			if (ev.code == UI_FF_UPLOAD) {
+				handle_uinput_ff_upload(v_dev, ev);
+				flight_call(v_dev, CALL_FF_UPLOAD, start);
+				break;
+			} else if (ev.code == UI_FF_ERASE) {
+				handle_uinput_ff_erase(v_dev, ev);
+				flight_call(v_dev, CALL_FF_ERASE, start);
+				break;
+			}
+			printf("UINPUT ev %d not handled\n", ev.code);
+			break;
+		case EV_FF:
+			start = flight_now(v_dev);
+			handle_ff_events(v_dev, ev);
+			flight_call(v_dev, CALL_FF_PLAY, start);
+			break;
+		case EV_SYN:
+		case EV_ABS:
+		case EV_KEY:
+			break;
+		default:
+			/* Catch for events we don't support yet */
+			printf("EV type %d EV code %d not handled\n",
+			       ev.type, ev.code);
+		}
+
+	} else {
+		printf("read failed descriptor %d, errno %d\n",
+		       fd_in, errno);
+	}
+}
+
+/**
+ * define_epoll_fds() - Add all required file descriptors to epoll to
+ * be monitored.
+ *
+ * @v_dev: main virtual device struct
+ * @ep_fd: epoll file descriptor
+ *
+ * Iterate through all file descriptors to monitor and add those which
+ * need to be monitored by epoll. At a minimum we need to monitor the
+ * uinput device for force feedback effects and at least 1 of either
+ * an ABS device or 1 or more key devices.
+ */
+int define_epoll_fds(struct virtual_device *v_dev, int ep_fd)
+{
+	struct epoll_event event;
+	int ret = 0;
+
+	event.events = EPOLLIN;
+	event.data.fd = v_dev->uinput_fd;
+	ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->uinput_fd,
+			&event);
+	if (ret == -1) {
+		printf("Cannot monitor uinput device\n");
+		return -1;
+	}
+
+	for (int i = 0; i < MAX_DEVS; i++) {
+		if (!(v_dev->abs_fd[i] > 0))
+			continue;
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->abs_fd[i];
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->abs_fd[i],
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor abs device %d\n", i);
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < MAX_DEVS; i++) {
+		if (!(v_dev->key_fd[i] > 0))
+			continue;
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->key_fd[i];
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->key_fd[i],
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor key device %d\n", i);
+			return -1;
+		}
+	}
+
+	if (v_dev->poll_timer.fd > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->poll_timer.fd;
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->poll_timer.fd,
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor poll timer\n");
+			return -1;
+		}
+	}
+
+	if (v_dev->cal_timer.fd > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->cal_timer.fd;
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->cal_timer.fd,
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor calibration timer\n");
+			return -1;
+		}
+	}
+
+	if (v_dev->turbo_fd > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->turbo_fd;
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->turbo_fd,
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor turbo timer\n");
+			return -1;
+		}
+	}
+
+	if (v_dev->reconnect_fd > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->reconnect_fd;
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->reconnect_fd,
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor reconnect timer\n");
+			return -1;
+		}
+	}
+
+	if (v_dev->filter_fd > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->filter_fd;
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->filter_fd,
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor filter settle timer\n");
+			return -1;
+		}
+	}
+
+	if (v_dev->ff.timer_fd > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->ff.timer_fd;
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->ff.timer_fd,
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor force feedback timer\n");
+			return -1;
+		}
+	}
+
+	if (v_dev->qos_timer.fd > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->qos_timer.fd;
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->qos_timer.fd,
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor CPU latency timer\n");
+			return -1;
+		}
+	}
+
+	if (v_dev->boost_fd > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->boost_fd;
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->boost_fd,
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor input boost timer\n");
+			return -1;
+		}
+	}
+
+	if (v_dev->battery_fd > 0) {
+		event.events = EPOLLIN;
+		event.data.fd = v_dev->battery_fd;
+		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->battery_fd,
+				&event);
+		if (ret == -1) {
+			printf("Cannot monitor battery timer\n");
+			return -1;
+		}
+	}
+
+	event.events = EPOLLIN;
+	event.data.fd = v_dev->queue.retry_fd;
+	ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->queue.retry_fd, &event);
+	if (ret == -1) {
+		printf("Cannot monitor output retry timer\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Event types that may be required by a device rule, as named in the
+ * configuration file.
+ */
+static const struct {
+	const char *name;
+	int type;
+} ev_type_names[] = {
+	{ "syn", EV_SYN }, { "key", EV_KEY }, { "rel", EV_REL },
+	{ "abs", EV_ABS }, { "msc", EV_MSC }, { "sw", EV_SW },
+	{ "led", EV_LED }, { "snd", EV_SND }, { "rep", EV_REP },
+	{ "ff", EV_FF },
+};
+
+/**
+ * config_split() - Split a key=value configuration argument
+ * @arg: argument to split, modified in place
+ * @val: returned pointer to the value
+ *
+ * Return pointer to the key, with @val set to the value or NULL if
+ * the argument had no '='.
+ */
+char *config_split(char *arg, char **val)
+{
+	char *eq = strchr(arg, '=');
+
+	*val = NULL;
+	if (eq) {
+		*eq = '\0';
+		*val = eq + 1;
+	}
+
+	return arg;
+}
+
+/**
+ * config_number() - Parse a numeric configuration value
+ * @val: string to parse, decimal or 0x prefixed hex
+ * @out: returned value
+ *
+ * Return 0 on success, -EINVAL if @val is not a number.
+ */
+int config_number(const char *val, long *out)
+{
+	char *end;
+
+	if (!val || !*val)
+		return -EINVAL;
+
+	errno = 0;
+	*out = strtol(val, &end, 0);
+	if (errno || *end)
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * config_device() - Parse a "device" rule
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * A device rule is a list of key=value matches, any of name, phys,
+ * bus, vendor, product and caps. Name and phys may be globs, caps is
+ * a comma separated list of event types the device must support. The
+ * additional ff=yes routes force feedback to devices of this rule.
+ * Return 0 on success, negative on error.
+ */
+int config_device(struct profile *prof, int argc, char **argv)
+{
+	struct dev_rule rule;
+	char *key, *val, *tok;
+	long num;
+
+	memset(&rule, 0, sizeof(rule));
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!val)
+			return -EINVAL;
+
+		if (!strcmp(key, "name")) {
+			snprintf(rule.name, sizeof(rule.name), "%s", val);
+			rule.flags |= RULE_NAME;
+			if (strpbrk(val, "*?["))
+				rule.flags |= RULE_NAME_GLOB;
+		} else if (!strcmp(key, "phys")) {
+			snprintf(rule.phys, sizeof(rule.phys), "%s", val);
+			rule.flags |= RULE_PHYS;
+			if (strpbrk(val, "*?["))
+				rule.flags |= RULE_PHYS_GLOB;
+		} else if (!strcmp(key, "bus")) {
+			if (config_number(val, &num))
+				return -EINVAL;
+			rule.bustype = num;
+			rule.flags |= RULE_BUSTYPE;
+		} else if (!strcmp(key, "vendor")) {
+			if (config_number(val, &num))
+				return -EINVAL;
+			rule.vendor = num;
+			rule.flags |= RULE_VENDOR;
+		} else if (!strcmp(key, "product")) {
+			if (config_number(val, &num))
+				return -EINVAL;
+			rule.product = num;
+			rule.flags |= RULE_PRODUCT;
+		} else if (!strcmp(key, "caps")) {
+			for (tok = strtok(val, ","); tok;
+			     tok = strtok(NULL, ",")) {
+				int j;
+
+				for (j = 0; j < (int)ARRAY_SIZE(ev_type_names);
+				     j++) {
+					if (!strcmp(tok, ev_type_names[j].name))
+						break;
+				}
+				if (j == (int)ARRAY_SIZE(ev_type_names))
+					return -EINVAL;
+				rule.evbits |= 1u << ev_type_names[j].type;
+			}
+			rule.flags |= RULE_EVBITS;
+		} else if (!strcmp(key, "ff")) {
+			if (!strcmp(val, "yes"))
+				rule.flags |= RULE_FF;
+			else if (strcmp(val, "no"))
+				return -EINVAL;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	if (!(rule.flags & ~RULE_FF))
+		return -EINVAL;
+
+	return rule_set_add(&prof->rules, &rule) < 0 ? -ENOSPC : 0;
+}
+
+/**
+ * config_output() - Parse the "output" identity of the virtual device
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * Accepts name, bus, vendor and product. Return 0 on success,
+ * negative on error.
+ */
+int config_output(struct profile *prof, int argc, char **argv)
+{
+	char *key, *val;
+	long num = 0;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!val)
+			return -EINVAL;
+
+		if (!strcmp(key, "name")) {
+			snprintf(prof->output_name, sizeof(prof->output_name),
+				 "%s", val);
+			continue;
+		}
+
+		if (config_number(val, &num) || num < 0 || num > 0xffff)
+			return -EINVAL;
+		if (!strcmp(key, "bus"))
+			prof->output_bustype = num;
+		else if (!strcmp(key, "vendor"))
+			prof->output_vendor = num;
+		else if (!strcmp(key, "product"))
+			prof->output_product = num;
+		else
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * config_profile() - Parse the match keys of a "profile" directive
+ * @prof: newly started profile
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * Accepts a name, and up to PROFILE_MATCHES each of compatible=<dt
+ * compatible> and dmi=<field>:<glob>. Return 0 on success, negative
+ * on error.
+ */
+int config_profile(struct profile *prof, int argc, char **argv)
+{
+	int compatibles = 0, dmis = 0;
+	char *key, *val;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!val)
+			return -EINVAL;
+
+		if (!strcmp(key, "name")) {
+			snprintf(prof->name, sizeof(prof->name), "%s", val);
+		} else if (!strcmp(key, "compatible")) {
+			if (compatibles == PROFILE_MATCHES)
+				return -ENOSPC;
+			snprintf(prof->compatible[compatibles++],
+				 sizeof(prof->compatible[0]), "%s", val);
+		} else if (!strcmp(key, "dmi")) {
+			if (dmis == PROFILE_MATCHES || !strchr(val, ':'))
+				return -EINVAL;
+			snprintf(prof->dmi[dmis++], sizeof(prof->dmi[0]),
+				 "%s", val);
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Event codes that may be referred to by name in the configuration
+ * file. Any other code can be given numerically with a KEY: or ABS:
+ * prefix, such as KEY:0x2c0.
+ */
+#define CODE_NAME(type, code)	{ #code, type, code }
+static const struct {
+	const char *name;
+	int type;
+	int code;
+} code_names[] = {
+	CODE_NAME(EV_KEY, BTN_SOUTH), CODE_NAME(EV_KEY, BTN_EAST),
+	CODE_NAME(EV_KEY, BTN_C), CODE_NAME(EV_KEY, BTN_NORTH),
+	CODE_NAME(EV_KEY, BTN_WEST), CODE_NAME(EV_KEY, BTN_Z),
+	CODE_NAME(EV_KEY, BTN_A), CODE_NAME(EV_KEY, BTN_B),
+	CODE_NAME(EV_KEY, BTN_X), CODE_NAME(EV_KEY, BTN_Y),
+	CODE_NAME(EV_KEY, BTN_TL), CODE_NAME(EV_KEY, BTN_TR),
+	CODE_NAME(EV_KEY, BTN_TL2), CODE_NAME(EV_KEY, BTN_TR2),
+	CODE_NAME(EV_KEY, BTN_SELECT), CODE_NAME(EV_KEY, BTN_START),
+	CODE_NAME(EV_KEY, BTN_MODE), CODE_NAME(EV_KEY, BTN_THUMBL),
+	CODE_NAME(EV_KEY, BTN_THUMBR), CODE_NAME(EV_KEY, BTN_DPAD_UP),
+	CODE_NAME(EV_KEY, BTN_DPAD_DOWN), CODE_NAME(EV_KEY, BTN_DPAD_LEFT),
+	CODE_NAME(EV_KEY, BTN_DPAD_RIGHT),
+	CODE_NAME(EV_KEY, BTN_TRIGGER_HAPPY1),
+	CODE_NAME(EV_KEY, BTN_TRIGGER_HAPPY2),
+	CODE_NAME(EV_KEY, BTN_TRIGGER_HAPPY3),
+	CODE_NAME(EV_KEY, BTN_TRIGGER_HAPPY4),
+	CODE_NAME(EV_KEY, KEY_VOLUMEUP), CODE_NAME(EV_KEY, KEY_VOLUMEDOWN),
+	CODE_NAME(EV_KEY, KEY_POWER), CODE_NAME(EV_KEY, KEY_MENU),
+	CODE_NAME(EV_KEY, KEY_HOME), CODE_NAME(EV_KEY, KEY_BACK),
+	CODE_NAME(EV_KEY, KEY_ESC), CODE_NAME(EV_KEY, KEY_ENTER),
+	CODE_NAME(EV_KEY, KEY_UP), CODE_NAME(EV_KEY, KEY_DOWN),
+	CODE_NAME(EV_KEY, KEY_LEFT), CODE_NAME(EV_KEY, KEY_RIGHT),
+	CODE_NAME(EV_KEY, KEY_MUTE), CODE_NAME(EV_KEY, KEY_SYSRQ),
+	CODE_NAME(EV_KEY, KEY_BRIGHTNESSUP),
+	CODE_NAME(EV_KEY, KEY_BRIGHTNESSDOWN),
+	CODE_NAME(EV_ABS, ABS_X), CODE_NAME(EV_ABS, ABS_Y),
+	CODE_NAME(EV_ABS, ABS_Z), CODE_NAME(EV_ABS, ABS_RX),
+	CODE_NAME(EV_ABS, ABS_RY), CODE_NAME(EV_ABS, ABS_RZ),
+	CODE_NAME(EV_ABS, ABS_THROTTLE), CODE_NAME(EV_ABS, ABS_RUDDER),
+	CODE_NAME(EV_ABS, ABS_WHEEL), CODE_NAME(EV_ABS, ABS_GAS),
+	CODE_NAME(EV_ABS, ABS_BRAKE), CODE_NAME(EV_ABS, ABS_HAT0X),
+	CODE_NAME(EV_ABS, ABS_HAT0Y), CODE_NAME(EV_ABS, ABS_HAT1X),
+	CODE_NAME(EV_ABS, ABS_HAT1Y), CODE_NAME(EV_ABS, ABS_HAT2X),
+	CODE_NAME(EV_ABS, ABS_HAT2Y), CODE_NAME(EV_ABS, ABS_HAT3X),
+	CODE_NAME(EV_ABS, ABS_HAT3Y),
+};
+
+/**
+ * config_code() - Parse an event code name
+ * @val: code name, or KEY:<number> / ABS:<number>
+ * @type: returned event type, EV_KEY or EV_ABS
+ * @code: returned event code
+ *
+ * Return 0 on success, -EINVAL for an unknown or out of range code.
+ */
+int config_code(const char *val, int *type, int *code)
+{
+	long num;
+
+	for (int i = 0; i < (int)ARRAY_SIZE(code_names); i++) {
+		if (!strcmp(val, code_names[i].name)) {
+			*type = code_names[i].type;
+			*code = code_names[i].code;
+			return 0;
+		}
+	}
+
+	if (!strncmp(val, "KEY:", 4) && !config_number(val + 4, &num) &&
+	    num > 0 && num <= KEY_MAX) {
+		*type = EV_KEY;
+		*code = num;
+		return 0;
+	}
+
+	if (!strncmp(val, "ABS:", 4) && !config_number(val + 4, &num) &&
+	    num >= 0 && num < ABS_MAX) {
+		*type = EV_ABS;
+		*code = num;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * config_add_remap() - Append a remap directive to a profile
+ * @prof: profile being parsed
+ * @op: REMAP_* operation
+ * @type: event type of the source code
+ * @code: source code
+ * @target: target code
+ * @arg0: first argument
+ * @arg1: second argument
+ *
+ * Return 0 on success, -ENOSPC if the profile is full.
+ */
+int config_add_remap(struct profile *prof, int op, int type, int code,
+		     int target, int32_t arg0, int32_t arg1)
+{
+	struct remap_entry *entry;
+
+	if (prof->remaps == MAX_REMAPS)
+		return -ENOSPC;
+
+	entry = &prof->remap[prof->remaps++];
+	entry->op = op;
+	entry->type = type;
+	entry->code = code;
+	entry->target = target;
+	entry->arg[0] = arg0;
+	entry->arg[1] = arg1;
+	return 0;
+}
+
+/**
+ * config_remap() - Parse a "remap" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "remap <from> <to>" rewrites a key to another key or an axis to
+ * another axis. A key remapped to an axis takes press=<value> and
+ * release=<value>, an axis remapped to a key takes above=<value> or
+ * below=<value> and may be given twice to drive a key for each
+ * direction. Return 0 on success, negative on error.
+ */
+int config_remap(struct profile *prof, int argc, char **argv)
+{
+	int from_type, from, to_type, to;
+	long press = 1, release = 0, threshold;
+	char *key, *val;
+
+	if (argc < 3 || config_code(argv[1], &from_type, &from) ||
+	    config_code(argv[2], &to_type, &to))
+		return -EINVAL;
+
+	if (from_type == to_type) {
+		if (argc != 3)
+			return -EINVAL;
+		return config_add_remap(prof, REMAP_CODE, from_type, from, to,
+					0, 0);
+	}
+
+	if (from_type == EV_KEY) {
+		for (int i = 3; i < argc; i++) {
+			key = config_split(argv[i], &val);
+			if (!strcmp(key, "press") && !config_number(val, &press))
+				continue;
+			if (!strcmp(key, "release") &&
+			    !config_number(val, &release))
+				continue;
+			return -EINVAL;
+		}
+		return config_add_remap(prof, REMAP_KEY_TO_ABS, EV_KEY, from,
+					to, release, press);
+	}
+
+	if (argc != 4)
+		return -EINVAL;
+	key = config_split(argv[3], &val);
+	if (config_number(val, &threshold))
+		return -EINVAL;
+	if (!strcmp(key, "above"))
+		return config_add_remap(prof, REMAP_ABS_ABOVE, EV_ABS, from,
+					to, threshold, 0);
+	if (!strcmp(key, "below"))
+		return config_add_remap(prof, REMAP_ABS_BELOW, EV_ABS, from,
+					to, threshold, 0);
+
+	return -EINVAL;
+}
+
+/**
+ * config_drop() - Parse a "drop" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "drop <code>..." stops the listed codes from being forwarded.
+ * Return 0 on success, negative on error.
+ */
+int config_drop(struct profile *prof, int argc, char **argv)
+{
+	int type, code, ret;
+
+	if (argc < 2)
+		return -EINVAL;
+
+	for (int i = 1; i < argc; i++) {
+		if (config_code(argv[i], &type, &code))
+			return -EINVAL;
+		ret = config_add_remap(prof, REMAP_DROP, type, code, 0, 0, 0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * config_invert() - Parse an "invert" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "invert <axis>..." mirrors the listed axes around the middle of
+ * their range. Return 0 on success, negative on error.
+ */
+int config_invert(struct profile *prof, int argc, char **argv)
+{
+	int type, code, ret;
+
+	if (argc < 2)
+		return -EINVAL;
+
+	for (int i = 1; i < argc; i++) {
+		if (config_code(argv[i], &type, &code) || type != EV_ABS)
+			return -EINVAL;
+		ret = config_add_remap(prof, REMAP_INVERT, type, code, 0, 0, 0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * config_swap() - Parse a "swap" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "swap <axis> <axis>" exchanges the codes two axes are reported as.
+ * Return 0 on success, negative on error.
+ */
+int config_swap(struct profile *prof, int argc, char **argv)
+{
+	int type_a, code_a, type_b, code_b;
+
+	if (argc != 3 || config_code(argv[1], &type_a, &code_a) ||
+	    config_code(argv[2], &type_b, &code_b) ||
+	    type_a != EV_ABS || type_b != EV_ABS)
+		return -EINVAL;
+
+	return config_add_remap(prof, REMAP_SWAP, EV_ABS, code_a, code_b,
+				0, 0);
+}
+
+/**
+ * config_stick() - Parse a "stick" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "stick <x axis> <y axis>" followed by any of deadzone, axial, outer
+ * and anti in percent of the axis half range and curve=linear,
+ * quadratic or cubic. Return 0 on success, negative on error.
+ */
+int config_stick(struct profile *prof, int argc, char **argv)
+{
+	struct stick_config *cfg;
+	int type[2], code[2];
+	char *key, *val;
+	long num;
+
+	if (prof->sticks == MAX_STICKS)
+		return -ENOSPC;
+	if (argc < 3 || config_code(argv[1], &type[0], &code[0]) ||
+	    config_code(argv[2], &type[1], &code[1]) ||
+	    type[0] != EV_ABS || type[1] != EV_ABS || code[0] == code[1])
+		return -EINVAL;
+
+	cfg = &prof->stick[prof->sticks];
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->code[0] = code[0];
+	cfg->code[1] = code[1];
+	cfg->outer = 100;
+
+	for (int i = 3; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!val)
+			return -EINVAL;
+
+		if (!strcmp(key, "curve")) {
+			if (!strcmp(val, "linear"))
+				cfg->curve = STICK_CURVE_LINEAR;
+			else if (!strcmp(val, "quadratic"))
+				cfg->curve = STICK_CURVE_QUADRATIC;
+			else if (!strcmp(val, "cubic"))
+				cfg->curve = STICK_CURVE_CUBIC;
+			else
+				return -EINVAL;
+			continue;
+		}
+
+		if (config_number(val, &num) || num < 0 || num > 100)
+			return -EINVAL;
+		if (!strcmp(key, "deadzone"))
+			cfg->deadzone = num;
+		else if (!strcmp(key, "axial"))
+			cfg->axial = num;
+		else if (!strcmp(key, "outer"))
+			cfg->outer = num;
+		else if (!strcmp(key, "anti"))
+			cfg->anti = num;
+		else
+			return -EINVAL;
+	}
+
+	if (cfg->deadzone >= cfg->outer || cfg->axial >= 100)
+		return -EINVAL;
+
+	prof->sticks++;
+	return 0;
+}
+
+/**
+ * config_filter() - Parse a "filter" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "filter <axis>..." enables 1-euro smoothing on the listed axes of
+ * the virtual device, with optional mincutoff and dcutoff in mHz and
+ * beta in mHz per unit/s. Return 0 on success, negative on error.
+ */
+int config_filter(struct profile *prof, int argc, char **argv)
+{
+	long mincutoff = 1000, dcutoff = 1000, beta = 10;
+	int type, code[MAX_FILTERS];
+	int axes = 0;
+	char *key, *val;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!val) {
+			if (axes == MAX_FILTERS ||
+			    config_code(key, &type, &code[axes]) ||
+			    type != EV_ABS)
+				return -EINVAL;
+			axes++;
+		} else if (!strcmp(key, "mincutoff")) {
+			if (config_number(val, &mincutoff) || mincutoff <= 0)
+				return -EINVAL;
+		} else if (!strcmp(key, "dcutoff")) {
+			if (config_number(val, &dcutoff) || dcutoff <= 0)
+				return -EINVAL;
+		} else if (!strcmp(key, "beta")) {
+			if (config_number(val, &beta) || beta < 0)
+				return -EINVAL;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	if (!axes || prof->filters + axes > MAX_FILTERS)
+		return -EINVAL;
+
+	for (int i = 0; i < axes; i++) {
+		struct filter_config *cfg = &prof->filter[prof->filters++];
+
+		cfg->code = code[i];
+		cfg->mincutoff = mincutoff;
+		cfg->dcutoff = dcutoff;
+		cfg->beta = beta;
+	}
+
+	return 0;
+}
+
+/**
+ * config_normalize() - Parse a "normalize" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "normalize stick <axis>..." rescales axes of the virtual device to
+ * -32768..32767 and "normalize trigger [max=<n>] <axis>..." to 0..n,
+ * 1023 by default. Return 0 on success, negative on error.
+ */
+int config_normalize(struct profile *prof, int argc, char **argv)
+{
+	long minimum, maximum = 1023;
+	int type, code[MAX_NORMS];
+	int axes = 0, stick;
+	char *key, *val;
+
+	if (argc < 3)
+		return -EINVAL;
+	if (!strcmp(argv[1], "stick"))
+		stick = 1;
+	else if (!strcmp(argv[1], "trigger"))
+		stick = 0;
+	else
+		return -EINVAL;
+
+	for (int i = 2; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!val) {
+			if (axes == MAX_NORMS ||
+			    config_code(key, &type, &code[axes]) ||
+			    type != EV_ABS)
+				return -EINVAL;
+			axes++;
+		} else if (!strcmp(key, "max") && !stick) {
+			if (config_number(val, &maximum) || maximum <= 0 ||
+			    maximum > 65535)
+				return -EINVAL;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	if (!axes || prof->norms + axes > MAX_NORMS)
+		return -EINVAL;
+
+	minimum = stick ? -32768 : 0;
+	if (stick)
+		maximum = 32767;
+
+	for (int i = 0; i < axes; i++) {
+		struct norm_config *cfg = &prof->norm[prof->norms++];
+
+		cfg->code = code[i];
+		cfg->minimum = minimum;
+		cfg->maximum = maximum;
+	}
+
+	return 0;
+}
+
+/**
+ * config_calibrate() - Parse a "calibrate" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "calibrate [file=<path>] [idle=<ms>]" learns the travel and rest
+ * center of normalized axes, sampling the rest center once input has
+ * been idle for idle ms, and stores them in file. Return 0 on success,
+ * negative on error.
+ */
+int config_calibrate(struct profile *prof, int argc, char **argv)
+{
+	long idle = 2000;
+	char *key, *val;
+
+	snprintf(prof->cal.path, sizeof(prof->cal.path), CAL_FILE);
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!val) {
+			return -EINVAL;
+		} else if (!strcmp(key, "file")) {
+			if (strlen(val) >= sizeof(prof->cal.path))
+				return -EINVAL;
+			strcpy(prof->cal.path, val);
+		} else if (!strcmp(key, "idle")) {
+			if (config_number(val, &idle) || idle <= 0 ||
+			    idle > 600000)
+				return -EINVAL;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	prof->cal.idle_ms = idle;
+	return 0;
+}
+
+/**
+ * config_trigger() - Parse a "trigger" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "trigger <axis> <key> press=<n> [release=<n>]" presses key whenever
+ * the axis of the virtual device reaches press and releases it again
+ * once it drops to release or below, which defaults to just under
+ * press. The axis is still forwarded. Return 0 on success, negative on error.
+ */
+int config_trigger(struct profile *prof, int argc, char **argv)
+{
+	int have_press = 0, have_release = 0;
+	struct trigger_config *cfg;
+	int type, code, key_type, key;
+	long press, release;
+	char *name, *val;
+
+	if (argc < 4 || prof->triggers == MAX_TRIGGERS ||
+	    config_code(argv[1], &type, &code) || type != EV_ABS ||
+	    config_code(argv[2], &key_type, &key) || key_type != EV_KEY)
+		return -EINVAL;
+
+	for (int i = 3; i < argc; i++) {
+		name = config_split(argv[i], &val);
+		if (!val)
+			return -EINVAL;
+		if (!strcmp(name, "press") && !config_number(val, &press))
+			have_press = 1;
+		else if (!strcmp(name, "release") &&
+			 !config_number(val, &release))
+			have_release = 1;
+		else
+			return -EINVAL;
+	}
+
+	if (!have_press)
+		return -EINVAL;
+	if (!have_release)
+		release = press - 1;
+	if (release >= press)
+		return -EINVAL;
+
+	cfg = &prof->trigger[prof->triggers++];
+	cfg->code = code;
+	cfg->key = key;
+	cfg->press = press;
+	cfg->release = release;
+	return 0;
+}
+
+/**
+ * config_dpad() - Parse a "dpad" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "dpad <from> <to> [<axis> <axis>]... [deadzone=<percent>]
+ * [ways=4|8]" converts D-pad input between the BTN_DPAD_* keys, a hat
+ * and a stick, given as "keys", "hat" and "stick". Axis pairs name the
+ * input axes first, if the input is not keys, then the output axes,
+ * if the output is not keys. Hat axes default to ABS_HAT0X/Y, stick
+ * axes must be given. Return 0 on success, negative on error.
+ */
+int config_dpad(struct profile *prof, int argc, char **argv)
+{
+	static const char * const kinds[] = { "keys", "hat", "stick" };
+	int type, code[4], axes = 0, need = 0;
+	struct dpad_config *cfg;
+	int from = -1, to = -1;
+	char *key, *val;
+	long num;
+
+	if (prof->dpads == MAX_DPADS)
+		return -ENOSPC;
+	for (int k = 0; k < (int)ARRAY_SIZE(kinds) && argc >= 3; k++) {
+		if (!strcmp(argv[1], kinds[k]))
+			from = k;
+		if (!strcmp(argv[2], kinds[k]))
+			to = k;
+	}
+	if (from < 0 || to < 0 || from == to)
+		return -EINVAL;
+
+	cfg = &prof->dpad[prof->dpads];
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->from = from;
+	cfg->to = to;
+	cfg->ways = 8;
+	cfg->deadzone = 50;
+
+	for (int i = 3; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!val) {
+			if (axes == 4 || config_code(key, &type, &code[axes]) ||
+			    type != EV_ABS)
+				return -EINVAL;
+			axes++;
+			continue;
+		}
+
+		if (config_number(val, &num))
+			return -EINVAL;
+		if (!strcmp(key, "deadzone") && num >= 0 && num < 100)
+			cfg->deadzone = num;
+		else if (!strcmp(key, "ways") && (num == 4 || num == 8))
+			cfg->ways = num;
+		else
+			return -EINVAL;
+	}
+
+	/* Hats may leave out their axes, sticks may not */
+	need = (from != DPAD_KEYS) + (to != DPAD_KEYS);
+	if (axes != need * 2) {
+		if (axes != (need - 1) * 2 ||
+		    (from != DPAD_HAT && to != DPAD_HAT))
+			return -EINVAL;
+		if (from == DPAD_HAT) {
+			memmove(&code[2], &code[0], sizeof(int) * 2);
+			code[0] = ABS_HAT0X;
+			code[1] = ABS_HAT0Y;
+		} else {
+			code[axes] = ABS_HAT0X;
+			code[axes + 1] = ABS_HAT0Y;
+		}
+	}
+
+	axes = 0;
+	if (from != DPAD_KEYS) {
+		cfg->in_code[0] = code[axes++];
+		cfg->in_code[1] = code[axes++];
+	}
+	if (to != DPAD_KEYS) {
+		cfg->out_code[0] = code[axes++];
+		cfg->out_code[1] = code[axes++];
+	}
+
+	prof->dpads++;
+	return 0;
+}
+
+/**
+ * config_turbo() - Parse a "turbo" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "turbo <key>... [rate=<hz>]" makes the listed keys of the virtual
+ * device repeat rate times per second while held, 10 by default.
+ * Return 0 on success, negative on error.
+ */
+int config_turbo(struct profile *prof, int argc, char **argv)
+{
+	int type, code[MAX_TURBOS];
+	int keys = 0;
+	char *key, *val;
+	long rate = 10;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!val) {
+			if (keys == MAX_TURBOS ||
+			    config_code(key, &type, &code[keys]) ||
+			    type != EV_KEY)
+				return -EINVAL;
+			keys++;
+		} else if (!strcmp(key, "rate")) {
+			if (config_number(val, &rate) || rate <= 0 ||
+			    rate > 100)
+				return -EINVAL;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	if (!keys || prof->turbos + keys > MAX_TURBOS)
+		return -EINVAL;
+
+	for (int i = 0; i < keys; i++) {
+		struct turbo_config *cfg = &prof->turbo[prof->turbos++];
+
+		cfg->code = code[i];
+		cfg->rate = rate;
+	}
+
+	return 0;
+}
+
+/**
+ * config_chord() - Parse a "chord" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "chord <key>+<key>... key=<key>|exec=<command>|stats" runs an action
+ * when the keys of the virtual device are pressed in the given order,
+ * and hides the keys from applications. Return 0 on success, negative
+ * on error.
+ */
+int config_chord(struct profile *prof, int argc, char **argv)
+{
+	struct chord_config *cfg;
+	char *name, *val, *next;
+	int type, code;
+
+	if (argc != 3 || prof->chords == MAX_CHORDS)
+		return -EINVAL;
+
+	cfg = &prof->chord[prof->chords];
+	memset(cfg, 0, sizeof(*cfg));
+	for (name = argv[1]; name; name = next) {
+		next = strchr(name, '+');
+		if (next)
+			*next++ = '\0';
+		if (cfg->keys == CHORD_KEYS ||
+		    config_code(name, &type, &code) || type != EV_KEY)
+			return -EINVAL;
+		cfg->key[cfg->keys++] = code;
+	}
+	if (cfg->keys < 2)
+		return -EINVAL;
+
+	name = config_split(argv[2], &val);
+	if (!strcmp(name, "stats") && !val) {
+		cfg->action = CHORD_STATS;
+	} else if (!strcmp(name, "key") && val) {
+		if (config_code(val, &type, &code) || type != EV_KEY)
+			return -EINVAL;
+		cfg->action = CHORD_KEY;
+		cfg->code = code;
+	} else if (!strcmp(name, "exec") && val) {
+		if (strlen(val) >= sizeof(cfg->cmd))
+			return -EINVAL;
+		cfg->action = CHORD_EXEC;
+		strcpy(cfg->cmd, val);
+	} else {
+		return -EINVAL;
+	}
+
+	prof->chords++;
+	return 0;
+}
+
+/**
+ * config_poll() - Parse a "poll" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "poll fast=<ms> slow=<ms> [idle=<ms>]" sets the poll interval of
+ * polled sources while input is active and once it has been idle for
+ * idle ms. Return 0 on success, negative on error.
+ */
+int config_poll(struct profile *prof, int argc, char **argv)
+{
+	long fast = 0, slow = 0, idle = 2000;
+	char *key, *val;
+	long *dst;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!strcmp(key, "fast"))
+			dst = &fast;
+		else if (!strcmp(key, "slow"))
+			dst = &slow;
+		else if (!strcmp(key, "idle"))
+			dst = &idle;
+		else
+			return -EINVAL;
+		if (config_number(val, dst) || *dst <= 0 || *dst > 0xffff)
+			return -EINVAL;
+	}
+
+	if (!fast || !slow || fast > slow)
+		return -EINVAL;
+
+	prof->poll.fast_ms = fast;
+	prof->poll.slow_ms = slow;
+	prof->poll.idle_ms = idle;
+	return 0;
+}
+
+/**
+ * config_reconnect() - Parse a "reconnect" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "reconnect initial=<ms> max=<ms>" sets how soon a lost source device
+ * is looked for again and how far the interval backs off. An initial
+ * interval of 0 disables reconnecting. Return 0 on success, negative
+ * on error.
+ */
+int config_reconnect(struct profile *prof, int argc, char **argv)
+{
+	long initial = prof->reconnect.initial_ms;
+	long max = prof->reconnect.max_ms;
+	char *key, *val;
+	long *dst;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!strcmp(key, "initial"))
+			dst = &initial;
+		else if (!strcmp(key, "max"))
+			dst = &max;
+		else
+			return -EINVAL;
+		if (config_number(val, dst) || *dst < 0 || *dst > 3600000)
+			return -EINVAL;
+	}
+
+	if (initial && max < initial)
+		return -EINVAL;
+
+	prof->reconnect.initial_ms = initial;
+	prof->reconnect.max_ms = max;
+	return 0;
+}
+
+/**
+ * config_selftest() - Parse a "selftest" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "selftest [frames=<n>]" measures the forwarding latency at startup
+ * by looping n frames back through the virtual device. n is rounded up
+ * to an even number so that the injected key ends up released. Return
+ * 0 on success, negative on error.
+ */
+int config_selftest(struct profile *prof, int argc, char **argv)
+{
+	long frames = SELFTEST_FRAMES;
+	char *key, *val;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (strcmp(key, "frames") || config_number(val, &frames) ||
+		    frames < 0 || frames > SELFTEST_MAX)
+			return -EINVAL;
+	}
+
+	prof->selftest.frames = (frames + 1) & ~1;
+	return 0;
+}
+
+/**
+ * config_stall() - Parse a "stall" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "stall budget=<ms>" dumps the flight recorder whenever a main loop
+ * iteration, or the wait for input to be read, exceeds budget ms. A
+ * budget of 0 disables stall detection. Return 0 on success, negative
+ * on error.
+ */
+int config_stall(struct profile *prof, int argc, char **argv)
+{
+	long budget = prof->stall.budget_ms;
+	char *key, *val;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (strcmp(key, "budget") || config_number(val, &budget) ||
+		    budget < 0 || budget > 10000)
+			return -EINVAL;
+	}
+
+	prof->stall.budget_ms = budget;
+	return 0;
+}
+
+/**
+ * config_ff() - Parse an "ff" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "ff [window=<ms>] [rate=<hz>]" collects force feedback commands for
+ * window ms after the first one before updating the motors, and
+ * updates them at most rate times per second. Return 0 on success,
+ * negative on error.
+ */
+int config_ff(struct profile *prof, int argc, char **argv)
+{
+	long window = prof->ff.window_ms, rate = prof->ff.rate_hz;
+	char *key, *val;
+	long *dst;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!strcmp(key, "window"))
+			dst = &window;
+		else if (!strcmp(key, "rate"))
+			dst = &rate;
+		else
+			return -EINVAL;
+		if (config_number(val, dst) || *dst < 0 || *dst > 1000)
+			return -EINVAL;
+	}
+
+	prof->ff.window_ms = window;
+	prof->ff.rate_hz = rate;
+	return 0;
+}
+
+/**
+ * config_battery() - Parse a "battery" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "battery [supply=<name>] [interval=<s>] <capacity>:<percent>..."
+ * scales rumble to percent of its strength while the battery is at or
+ * below capacity percent and not charging. The battery defaults to the
+ * first power supply of type Battery, checked every 60 s. Return 0 on
+ * success, negative on error.
+ */
+int config_battery(struct profile *prof, int argc, char **argv)
+{
+	struct battery_config *cfg = &prof->battery;
+	long interval = 60, capacity, gain;
+	char *key, *val, *end;
+	int i;
+
+	memset(cfg, 0, sizeof(*cfg));
+	for (int arg = 1; arg < argc; arg++) {
+		key = config_split(argv[arg], &val);
+		if (!strcmp(key, "supply")) {
+			if (!val || strlen(val) >= sizeof(cfg->supply))
+				return -EINVAL;
+			strcpy(cfg->supply, val);
+			continue;
+		}
+		if (!strcmp(key, "interval")) {
+			if (config_number(val, &interval) || interval <= 0 ||
+			    interval > 3600)
+				return -EINVAL;
+			continue;
+		}
+
+		capacity = strtol(key, &end, 10);
+		if (val || *end != ':' || cfg->points == BATTERY_POINTS ||
+		    config_number(end + 1, &gain) || capacity < 0 ||
+		    capacity > 100 || gain < 0 || gain > 100)
+			return -EINVAL;
+
+		for (i = cfg->points++; i > 0 &&
+		     cfg->capacity[i - 1] < capacity; i--) {
+			cfg->capacity[i] = cfg->capacity[i - 1];
+			cfg->gain[i] = cfg->gain[i - 1];
+		}
+		cfg->capacity[i] = capacity;
+		cfg->gain[i] = gain;
+	}
+
+	if (!cfg->points)
+		return -EINVAL;
+	cfg->interval_s = interval;
+	return 0;
+}
+
+/**
+ * config_qos() - Parse a "qos" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "qos [latency=<us>] [idle=<ms>] [slack=<ns>]" holds a CPU latency
+ * limit of latency us while input has been seen within idle ms, and
+ * sets the timer slack of the daemon to slack ns. The defaults are
+ * 50 us, 5000 ms and 1 ns. Return 0 on success, negative on error.
+ */
+int config_qos(struct profile *prof, int argc, char **argv)
+{
+	long latency = 50, idle = 5000, slack = 1;
+	char *key, *val;
+	long *dst;
+
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!strcmp(key, "latency"))
+			dst = &latency;
+		else if (!strcmp(key, "idle"))
+			dst = &idle;
+		else if (!strcmp(key, "slack"))
+			dst = &slack;
+		else
+			return -EINVAL;
+		if (config_number(val, dst) || *dst < 0 || *dst > 10000000)
+			return -EINVAL;
+	}
+
+	if (!idle)
+		return -EINVAL;
+	prof->qos.latency_us = latency;
+	prof->qos.idle_ms = idle;
+	prof->qos.slack_ns = slack;
+	return 0;
+}
+
+/**
+ * config_boost() - Parse a "boost" directive
+ * @prof: profile being parsed
+ * @argc: number of arguments, including the directive
+ * @argv: directive arguments
+ *
+ * "boost [min=<0..1024>] [window=<ms>] [idle=<ms>] [cgroup=<path>]"
+ * raises the minimum utilization clamp of the daemon, and of the
+ * cgroup directory path if given, to min for window ms on the first
+ * input after idle ms without any. The defaults are 512, 200 ms and
+ * 1000 ms. Return 0 on success, negative on error.
+ */
+int config_boost(struct profile *prof, int argc, char **argv)
+{
+	long min = 512, window = 200, idle = 1000;
+	char *key, *val;
+	long *dst;
+
+	prof->boost.cgroup[0] = '\0';
+	for (int i = 1; i < argc; i++) {
+		key = config_split(argv[i], &val);
+		if (!strcmp(key, "cgroup")) {
+			if (!val || strlen(val) >= sizeof(prof->boost.cgroup))
+				return -EINVAL;
+			strcpy(prof->boost.cgroup, val);
+			continue;
+		}
+		if (!strcmp(key, "min"))
+			dst = &min;
+		else if (!strcmp(key, "window"))
+			dst = &window;
+		else if (!strcmp(key, "idle"))
+			dst = &idle;
+		else
+			return -EINVAL;
+		if (config_number(val, dst) || *dst < 0 || *dst > 60000)
+			return -EINVAL;
+	}
+
+	if (min > 1024 || !window)
+		return -EINVAL;
+	prof->boost.min = min;
+	prof->boost.window_ms = window;
+	prof->boost.idle_ms = idle;
+	return 0;
+}
+
+/*
+ * Directives understood in the configuration file. Each line is a
+ * directive name followed by its arguments.
+ */
+static const struct {
+	const char *name;
+	int (*parse)(struct profile *prof, int argc, char **argv);
+} config_directives[] = {
+	{ "profile", config_profile },
+	{ "device", config_device },
+	{ "output", config_output },
+	{ "remap", config_remap },
+	{ "drop", config_drop },
+	{ "invert", config_invert },
+	{ "swap", config_swap },
+	{ "stick", config_stick },
+	{ "filter", config_filter },
+	{ "normalize", config_normalize },
+	{ "calibrate", config_calibrate },
+	{ "trigger", config_trigger },
+	{ "dpad", config_dpad },
+	{ "turbo", config_turbo },
+	{ "chord", config_chord },
+	{ "poll", config_poll },
+	{ "reconnect", config_reconnect },
+	{ "selftest", config_selftest },
+	{ "stall", config_stall },
+	{ "ff", config_ff },
+	{ "battery", config_battery },
+	{ "qos", config_qos },
+	{ "boost", config_boost },
+};
+
+/**
+ * config_tokenize() - Split a configuration line into arguments
+ * @line: line to split, modified in place
+ * @argv: returned arguments
+ * @max: size of argv
+ *
+ * Arguments are separated by whitespace, double quotes may be used to
+ * include whitespace in an argument and '#' starts a comment. Return
+ * number of arguments, or -E2BIG if there are more than @max.
+ */
+int config_tokenize(char *line, char **argv, int max)
+{
+	char *in = line, *out;
+	int argc = 0;
+
+	while (1) {
+		int quoted = 0;
+
+		while (isspace((unsigned char)*in))
+			in++;
+		if (!*in || *in == '#')
+			break;
+		if (argc == max)
+			return -E2BIG;
+
+		argv[argc++] = out = in;
+		while (*in && (quoted || !isspace((unsigned char)*in))) {
+			if (*in == '"')
+				quoted = !quoted;
+			else if (*in == '#' && !quoted)
+				break;
+			else
+				*out++ = *in;
+			in++;
+		}
+		if (*in && *in != '#')
+			in++;
+		else if (*in == '#')
+			*in = '\0';
+		*out = '\0';
+	}
+
+	return argc;
+}
+
+/**
+ * profile_init() - Initialize a profile to the built-in defaults
+ * @prof: profile to initialize
+ * @name: name of the profile
+ */
+void profile_init(struct profile *prof, const char *name)
+{
+	memset(prof, 0, sizeof(*prof));
+	snprintf(prof->name, sizeof(prof->name), "%s", name);
+	snprintf(prof->output_name, sizeof(prof->output_name), DEVICE_NAME);
+	prof->output_bustype = BUS_HOST;
+	prof->output_vendor = DEVICE_VID;
+	prof->output_product = DEVICE_PID;
+	prof->reconnect.initial_ms = 250;
+	prof->reconnect.max_ms = 8000;
+	prof->stall.budget_ms = 20;
+}
+
+/**
+ * profile_finish() - Compile a fully parsed profile
+ * @prof: profile to compile
+ *
+ * Build the rule lookup tables, falling back to the default rules if
+ * the profile did not list any devices.
+ */
+void profile_finish(struct profile *prof)
+{
+	if (prof->rules.count)
+		rule_set_compile(&prof->rules);
+	else
+		load_default_rules(&prof->rules);
+}
+
+/**
+ * parse_config() - Load a configuration file into a profile database
+ * @db: returned profile database
+ * @path: configuration file path
+ *
+ * Parse every directive in the configuration file. Directives before
+ * the first "profile" line form a fallback profile named "default",
+ * each "profile" line starts a new one. Everything is compiled here so
+ * that no parsing happens after startup. Return 0 on success, -ENOENT
+ * if the file does not exist and -EINVAL on a syntax error.
+ */
+int parse_config(struct profile_db *db, const char *path)
+{
+	struct profile *prof;
+	char line[512];
+	char *argv[16];
+	FILE *file;
+	int argc, lineno = 0;
+	int keep = 0;
+	int ret = 0;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -errno;
+
+	db->profile = calloc(MAX_PROFILES, sizeof(*db->profile));
+	if (!db->profile) {
+		fclose(file);
+		return -ENOMEM;
+	}
+	db->count = 1;
+	prof = &db->profile[0];
+	profile_init(prof, "default");
+
+	while (fgets(line, sizeof(line), file)) {
+		int i;
+
+		lineno++;
+		argc = config_tokenize(line, argv, ARRAY_SIZE(argv));
+		if (argc == 0)
+			continue;
+
+		for (i = 0; argc > 0 &&
+		     i < (int)ARRAY_SIZE(config_directives); i++) {
+			if (!strcmp(argv[0], config_directives[i].name))
+				break;
+		}
+
+		if (argc < 0 || i == (int)ARRAY_SIZE(config_directives)) {
+			ret = -EINVAL;
+		} else if (config_directives[i].parse == config_profile &&
+			   db->count == MAX_PROFILES) {
+			ret = -ENOSPC;
+		} else {
+			/* An unused implicit default profile is dropped */
+			if (config_directives[i].parse == config_profile) {
+				if (keep)
+					prof = &db->profile[db->count++];
+				profile_init(prof, "unnamed");
+			}
+			ret = config_directives[i].parse(prof, argc, argv);
+			keep = 1;
+		}
+		if (ret) {
+			printf("%s:%d: invalid %s directive\n", path, lineno,
+			       argc > 0 ? argv[0] : "");
+			break;
+		}
+	}
+	fclose(file);
+
+	if (ret) {
+		free(db->profile);
+		return ret;
+	}
+
+	for (int i = 0; i < db->count; i++)
+		profile_finish(&db->profile[i]);
+
+	return 0;
+}
+
+/**
+ * write_profile_db() - Save a profile database in binary form
+ * @db: profile database
+ * @path: output file
+ *
+ * The binary database is the profiles exactly as held in memory,
+ * preceded by a header identifying the layout, so that it can be used
+ * at startup without any parsing. Return 0 on success, negative on
+ * error.
+ */
+int write_profile_db(const struct profile_db *db, const char *path)
+{
+	struct profile_db_header hdr = {
+		.magic = PROFILE_MAGIC,
+		.version = PROFILE_VERSION,
+		.profile_size = sizeof(struct profile),
+		.count = db->count,
+	};
+	size_t len = sizeof(struct profile) * db->count;
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -errno;
 
-/*
- * List of all the "devices of interest" that we're looking to
- * capture. Only the first 8 key and abs devices and last ff device
- * that match the names below will be used by the driver.
- */
-static struct dev_info input_devs[] = {
-	{ .name = "adc-joystick" },
-	{ .name = "adc-keys" },
-	{ .name = "adc-trigger" },
-	{ .name = "gpio-keys" },
-	{ .name = "gpio-keys-control" },
-	{ .name = "gpio-keys-vol" },
-	{ .name = "gpio-vibrator" },
-	{ .name = "gpio-vibrator-l" },
-	{ .name = "gpio-vibrator-r" },
-	{ .name = "pwm-vibrator" },
-	{ .name = "pwm-vibrator-l" },
-	{ .name = "pwm-vibrator-r" },
-};
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, db->profile, len) != (ssize_t)len)
+		ret = -EIO;
+
+	close(fd);
+	return ret;
+}
 
 /**
- * enumerate_abs_devices() - Identify ABS axes and features
- * @v_dev: pointer to virtual_device struct
+ * load_profile_db() - Map a binary profile database
+ * @db: returned profile database, pointing into the mapping
+ * @path: database file
  *
- * Enumerate ABS axes and add them to the uinput virtual device.
- * Return number of devices found on success or negative on error.
+ * Map the database read-only and validate its header. The caller
+ * copies the profile it selects and unmaps the file again with
+ * munmap() on the header. Return 0 on success, negative on error.
  */
-int enumerate_abs_devices(struct virtual_device *v_dev)
+int load_profile_db(struct profile_db *db, const char *path)
 {
-	uint8_t abs_b[ABS_MAX/8 + 1];
-	int dev_count = 0;
-	int ret = 0;
-	uint8_t abs_index = 0;
+	struct profile_db_header *hdr;
+	struct stat st;
+	int fd;
 
-	if (v_dev->abs_fd[0] <= 0)
-		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
 
-	for (int dev_num = 0; dev_num < MAX_DEVS; dev_num++) {
-		if (v_dev->abs_fd[dev_num] > 0)
-			dev_count += 1;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -EINVAL;
 	}
 
-	for (int k = 0; k < dev_count; k++) {
-		ioctl(v_dev->abs_fd[k],
-		      EVIOCGBIT(EV_ABS, sizeof(abs_b)), abs_b);
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return -errno;
 
-		for (int i = 0; i < ABS_MAX; i++) {
-			if (TEST_BIT(i, abs_b)) {
-				ret = ioctl(v_dev->abs_fd[k], EVIOCGABS(i),
-					    &v_dev->uabssetup[i].absinfo);
-				if (ret)
-					continue;
-
-				ret = ioctl(v_dev->uinput_fd,
-					    UI_SET_ABSBIT, i);
-				if (ret)
-					continue;
-				abs_index |= i;
-				v_dev->uabssetup[i].code = i;
-				ret = ioctl(v_dev->uinput_fd, UI_ABS_SETUP,
-					    &v_dev->uabssetup[i]);
-				if (ret)
-					printf("Unable to set abs axis %d\n",
-					       i);
-			}
-		}
+	if (hdr->magic != PROFILE_MAGIC || hdr->version != PROFILE_VERSION ||
+	    hdr->profile_size != sizeof(struct profile) ||
+	    hdr->count == 0 || hdr->count > MAX_PROFILES ||
+	    st.st_size != (off_t)(sizeof(*hdr) +
+				  hdr->count * sizeof(struct profile))) {
+		printf("%s: incompatible profile database\n", path);
+		munmap(hdr, st.st_size);
+		return -EINVAL;
 	}
 
-	v_dev->usetup.id.version |= abs_index;
-	return dev_count;
+	db->profile = (struct profile *)(hdr + 1);
+	db->count = hdr->count;
+	return 0;
 }
 
 /**
- * enumerate_ff_device() - Identify supported force feedback features
- * @v_dev: pointer to virtual_device struct
+ * dmi_match() - Check a "field:glob" DMI match against the system
+ * @match: DMI match string
  *
- * Enumerate force feedback features and add them to the uinput virtual
- * device. Return 0 on success.
+ * Return 1 if the DMI field exists and matches, 0 otherwise.
  */
-int enumerate_ff_device(struct virtual_device *v_dev)
+int dmi_match(const char *match)
 {
-	uint8_t ff_b[FF_MAX/8 + 1];
-	int ret = 0;
-	uint8_t ff_index = 0;
+	char path[128], buf[128];
+	const char *glob = strchr(match, ':');
+	int fd, len;
 
-	if (v_dev->ff_fd <= 0)
+	snprintf(path, sizeof(path), SYSFS_DMI "/%.*s",
+		 (int)(glob - match), match);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
 		return 0;
 
-	ret = ioctl(v_dev->ff_fd,
-		    EVIOCGBIT(EV_FF, sizeof(ff_b)), ff_b);
-	if (ret < 0) {
-		printf("Unable to enumerate FF device: %d\n", ret);
-		return -ENODEV;
-	}
-
-	for (int i = 0; i < FF_MAX; i++) {
-		if (TEST_BIT(i, ff_b)) {
-			ioctl(v_dev->uinput_fd, UI_SET_FFBIT, i);
-			ff_index |= i;
-		}
-	}
-
-	ret = ioctl(v_dev->ff_fd, EVIOCGEFFECTS, &v_dev->usetup.ff_effects_max);
-	if (ret < 0) {
-		printf("Unable to determine max FF effects\n");
-		return -EIO;
-	};
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return 0;
+	while (len > 0 && buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
 
-	v_dev->usetup.id.version ^= ff_index;
-	return 0;
+	return !fnmatch(glob + 1, buf, 0);
 }
 
 /**
- * enumerate_key_devices() - Identify supported keys
- * @v_dev: pointer to virtual_device struct
+ * select_profile() - Choose the profile for the running system
+ * @db: profile database
  *
- * Enumerate keys and add them to the uinput virtual device. Return
- * number of keys identified.
+ * The device-tree compatible list is walked from the most specific
+ * entry, returning the first profile that lists it. Otherwise the
+ * first profile whose DMI matches all hold is used, and finally the
+ * first profile with no match keys. Return the profile index or
+ * -ENOENT.
  */
-int enumerate_key_devices(struct virtual_device *v_dev)
+int select_profile(const struct profile_db *db)
 {
-	uint8_t key_b[KEY_MAX/8 + 1];
-	int dev_count = 0;
-	int keys = 0;
-	uint16_t key_index = 0;
+	char compat[1024];
+	int fd, len = 0;
 
-	for (int dev_num = 0; dev_num < MAX_DEVS; dev_num++) {
-		if (v_dev->key_fd[dev_num] > 0)
-			dev_count += 1;
+	fd = open(DT_COMPATIBLE, O_RDONLY);
+	if (fd != -1) {
+		len = read(fd, compat, sizeof(compat) - 1);
+		close(fd);
+		if (len < 0)
+			len = 0;
+		compat[len] = '\0';
 	}
 
-	for (int k = 0; k < dev_count; k++) {
-		ioctl(v_dev->key_fd[k],
-		      EVIOCGBIT(EV_KEY, sizeof(key_b)), key_b);
-		for (int i = 0; i < KEY_MAX; i++) {
-			if (TEST_BIT(i, key_b)) {
-				ioctl(v_dev->uinput_fd,
-				      UI_SET_KEYBIT, i);
-				key_index |= (i << 6);
-				keys += 1;
+	for (int off = 0; off < len; off += strlen(compat + off) + 1) {
+		for (int i = 0; i < db->count; i++) {
+			for (int j = 0; j < PROFILE_MATCHES; j++) {
+				if (!strcmp(db->profile[i].compatible[j],
+					    compat + off))
+					return i;
 			}
 		}
 	}
 
-	v_dev->usetup.id.version ^= key_index;
-	return keys;
+	for (int i = 0; i < db->count; i++) {
+		const struct profile *prof = &db->profile[i];
+		int j;
+
+		if (!prof->dmi[0][0])
+			continue;
+		for (j = 0; j < PROFILE_MATCHES && prof->dmi[j][0]; j++) {
+			if (!dmi_match(prof->dmi[j]))
+				break;
+		}
+		if (j == PROFILE_MATCHES || !prof->dmi[j][0])
+			return i;
+	}
+
+	for (int i = 0; i < db->count; i++) {
+		if (!db->profile[i].compatible[0][0] &&
+		    !db->profile[i].dmi[0][0])
+			return i;
+	}
+
+	return -ENOENT;
 }
 
 /**
- * input_device_match() - Check input device name against table
- * @name: pointer to device name to check
+ * load_profile() - Pick the profile to run with
+ * @v_dev: main virtual device struct
+ * @config: text configuration given on the command line, or NULL
+ * @db_path: binary profile database given on the command line, or NULL
  *
- * Check if the device name is one that we want to monitor. Return
- * 1 if there is a match and 0 if there is not.
+ * An explicit configuration file or database must exist. Otherwise
+ * the default binary database is preferred over the default text
+ * configuration, and the built-in profile is used if neither exists.
+ * Return 0 on success, negative on error.
  */
-int input_device_match(char *name)
+int load_profile(struct virtual_device *v_dev, const char *config,
+		 const char *db_path)
 {
-	for (int i = 0; i < (int)ARRAY_SIZE(input_devs); i++) {
-		if (!strcmp(name, input_devs[i].name))
-			return 1;
+	struct profile_db db;
+	int ret, idx;
+
+	if (!config) {
+		ret = load_profile_db(&db, db_path ? db_path : PROFILE_DB);
+		if (ret == 0) {
+			idx = select_profile(&db);
+			if (idx >= 0)
+				v_dev->profile = db.profile[idx];
+			munmap((struct profile_db_header *)db.profile - 1,
+			       sizeof(struct profile_db_header) +
+			       db.count * sizeof(struct profile));
+			goto selected;
+		}
+		if (ret != -ENOENT || db_path)
+			return ret;
+
+		ret = parse_config(&db, CONFIG_FILE);
+		if (ret == -ENOENT) {
+			profile_init(&v_dev->profile, "built-in");
+			profile_finish(&v_dev->profile);
+			return 0;
+		}
+	} else {
+		ret = parse_config(&db, config);
+	}
+	if (ret)
+		return ret;
+
+	idx = select_profile(&db);
+	if (idx >= 0)
+		v_dev->profile = db.profile[idx];
+	free(db.profile);
+
+selected:
+	if (idx < 0) {
+		printf("No profile matches this system\n");
+		return -ENOENT;
 	}
 
+	printf("Using profile %s\n", v_dev->profile.name);
 	return 0;
 }
 
 /**
- * iterate_input_devices() - Identify input devices to be monitored
- * @v_dev: pointer to virtual_device struct
- *
- * Iterate over all of the event input devices to find the ones we
- * want to monitor and start adding them to the virtual_device struct.
- * FF devices are closed as read-only and reopened as write-only, since
- * we need to write to them but not necessarily read them. Return is
- * total number of devices found.
+ * code_name() - Look up the name of an event code
+ * @type: event type
+ * @code: event code
  *
+ * Return the name from code_names[], or NULL if it has none.
  */
-int iterate_input_devices(struct virtual_device *v_dev)
+const char *code_name(int type, int code)
 {
-	char fd_dev[20];
-	char name[256];
-	int fd, ret;
-	int count = 0;
-	int key_devs = 0;
-	int abs_devs = 0;
-	unsigned long evbit = 0;
+	for (int i = 0; i < (int)ARRAY_SIZE(code_names); i++) {
+		if (code_names[i].type == type && code_names[i].code == code)
+			return code_names[i].name;
+	}
 
-	for (int i = 0; i < 256; i++) {
-		sprintf(fd_dev, "/dev/input/event%d", i);
-		fd = open(fd_dev, O_RDONLY);
-		if (fd == -1)
-			continue;
+	return NULL;
+}
 
-		ioctl(fd, EVIOCGNAME(256), name);
-		ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), &evbit);
-		close(fd);
+/**
+ * print_stats() - Write runtime statistics
+ * @v_dev: main virtual device struct
+ * @out: stream to write to
+ *
+ * Statistics are written as one line per item, a keyword followed by
+ * key=value pairs.
+ */
+void print_stats(struct virtual_device *v_dev, FILE *out)
+{
+	fprintf(out, "profile name=%s\n", v_dev->profile.name);
 
-		ret = input_device_match(name);
-		if (!ret)
-			continue;
+	for (int i = 0; i < v_dev->filters; i++) {
+		struct axis_filter *f = &v_dev->filter[i];
+		const char *name = code_name(EV_ABS, f->code);
 
-		if (evbit & (1 << EV_FF)) {
-			v_dev->ff_fd = open(fd_dev, O_WRONLY);
-			printf("Found EV_FF: %s\n", fd_dev);
-			count += 1;
+		if (name)
+			fprintf(out, "filter axis=%s", name);
+		else
+			fprintf(out, "filter axis=ABS:%d", f->code);
+		fprintf(out, " passed=%llu suppressed=%llu settled=%llu "
+			"lag_us=", (unsigned long long)f->passed,
+			(unsigned long long)f->suppressed,
+			(unsigned long long)f->settled);
+		for (int b = 0; b < FILTER_BUCKETS; b++) {
+			fprintf(out, "%s%llu", b ? "," : "",
+				(unsigned long long)(f->lag_count[b] ?
+				f->lag_sum[b] / f->lag_count[b] : 0));
 		}
+		fprintf(out, "\n");
+	}
 
-		if (evbit & (1 << EV_ABS)) {
-			if (abs_devs >= MAX_DEVS)
-				continue;
+	for (int i = 0; i < v_dev->norms; i++) {
+		struct axis_norm *n = &v_dev->norm[i];
+		const char *name = code_name(EV_ABS, n->code);
 
-			v_dev->abs_fd[abs_devs] = open(fd_dev,
-						       O_RDONLY |
-						       O_NONBLOCK);
-			printf("Found EV_ABS: %s\n", fd_dev);
-			count += 1;
-			abs_devs += 1;
-		}
+		if (name)
+			fprintf(out, "norm axis=%s", name);
+		else
+			fprintf(out, "norm axis=ABS:%d", n->code);
+		fprintf(out, " in=%d..%d out=%d..%d mul=%d shift=%d\n",
+			n->in_min, n->in_max, n->minimum, n->maximum, n->mul,
+			n->shift);
+	}
 
-		if (evbit & (1 << EV_KEY)) {
-			if (key_devs >= MAX_DEVS)
-				continue;
+	for (int i = 0; i < v_dev->sources; i++) {
+		struct source *src = &v_dev->src[i];
 
-			v_dev->key_fd[key_devs] = open(fd_dev,
-						       O_RDONLY |
-						       O_NONBLOCK);
-			printf("Found EV_KEY: %s\n", fd_dev);
-			count += 1;
-			key_devs += 1;
+		for (uint64_t bits = src->cal_axes; bits; bits &= bits - 1) {
+			int code = __builtin_ctzll(bits);
+			uint64_t bit = 1ull << code;
+			const char *name = code_name(EV_ABS, code);
+
+			fprintf(out, "cal source=%s unit=%08x ", src->node,
+				src->unit);
+			if (name)
+				fprintf(out, "axis=%s", name);
+			else
+				fprintf(out, "axis=ABS:%d", code);
+			fprintf(out, " state=%s", src->cal_learned & bit ?
+				"learned" : "absinfo");
+			if (src->cal_max[code] >= src->cal_min[code])
+				fprintf(out, " seen=%d..%d",
+					src->cal_min[code], src->cal_max[code]);
+			if (src->cal_centered & bit)
+				fprintf(out, " center=%d",
+					src->cal_center[code]);
+			fprintf(out, "\n");
 		}
 	}
 
-	return count;
-}
+	fprintf(out, "sync dropped=%llu resumes=%llu resync_events=%llu\n",
+		(unsigned long long)v_dev->sync_dropped,
+		(unsigned long long)v_dev->resumes,
+		(unsigned long long)v_dev->resync_events);
 
-/**
- * create_uinput_device() - Create a new composite uinput device
- * @v_dev: pointer to virtual input device
- *
- * Create a uinput device for use by userspace to combine all of the
- * monitored input devices into a single one that applications are
- * more capable of dealing with. Return 0 on success, negative on
- * error.
- *
- */
-int create_uinput_device(struct virtual_device *v_dev)
-{
-	int ret = 0;
+	for (int i = 0; i < v_dev->chords; i++) {
+		static const char * const actions[] = {
+			"key", "exec", "stats",
+		};
+		struct chord *c = &v_dev->chord[i];
 
-	v_dev->uinput_fd = open("/dev/uinput", O_RDWR | O_NONBLOCK |
-					       O_DSYNC | O_RSYNC);
-	if (v_dev->uinput_fd == -1)
-		return -ENODEV;
+		fprintf(out, "chord keys=");
+		for (int k = 0; k < c->keys; k++) {
+			const char *name = code_name(EV_KEY, c->key[k]);
 
-	if (v_dev->abs_fd[0] > 0) {
-		ret = ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_ABS);
-		if (ret)
-			return ret;
-		ret = enumerate_abs_devices(v_dev);
-		if (!(ret > 0)) {
-			printf("No ABS devices found\n");
-			return -ENODEV;
+			if (name)
+				fprintf(out, "%s%s", k ? "+" : "", name);
+			else
+				fprintf(out, "%sKEY:%d", k ? "+" : "",
+					c->key[k]);
 		}
+		fprintf(out, " action=%s fired=%llu\n", actions[c->action],
+			(unsigned long long)c->fired);
 	}
 
-	if (v_dev->key_fd[0] > 0) {
-		ret = ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_KEY);
-		if (ret)
-			return ret;
-		ret = enumerate_key_devices(v_dev);
-		if (!(ret > 0)) {
-			printf("No keys found\n");
-			return -ENODEV;
-		}
+	if (v_dev->turbos) {
+		fprintf(out, "turbo keys=%d held=%d ticks=%llu\n",
+			v_dev->turbos, v_dev->turbo_queued,
+			(unsigned long long)v_dev->turbo_ticks);
 	}
 
-	if (v_dev->ff_fd > 0) {
-		ret = ioctl(v_dev->uinput_fd, UI_SET_EVBIT, EV_FF);
-		if (ret)
-			return ret;
+	fprintf(out, "sources count=%d lost=%llu reconnected=%llu\n",
+		v_dev->sources, (unsigned long long)v_dev->sources_lost,
+		(unsigned long long)v_dev->sources_reconnected);
 
-		ret = enumerate_ff_device(v_dev);
-		if (ret)
-			return ret;
-	}
+	fprintf(out, "queue keys=%d axes=%d queued=%llu coalesced=%llu "
+		"collapsed=%llu retries=%llu\n", v_dev->queue.keys,
+		__builtin_popcountll(v_dev->queue.abs_dirty),
+		(unsigned long long)v_dev->queue.queued,
+		(unsigned long long)v_dev->queue.coalesced,
+		(unsigned long long)v_dev->queue.collapsed,
+		(unsigned long long)v_dev->queue.retries);
 
-	v_dev->usetup.id.bustype = BUS_HOST;
-	v_dev->usetup.id.vendor = DEVICE_VID;
-	v_dev->usetup.id.product = DEVICE_PID;
-	sprintf(v_dev->usetup.name, DEVICE_NAME);
+	if (v_dev->ff_fd > 0)
+		fprintf(out, "ff commands=%llu dropped=%llu coalesced=%llu "
+			"writes=%llu events=%llu\n",
+			(unsigned long long)v_dev->ff.commands,
+			(unsigned long long)v_dev->ff.dropped,
+			(unsigned long long)v_dev->ff.coalesced,
+			(unsigned long long)v_dev->ff.writes,
+			(unsigned long long)v_dev->ff.events);
 
-	ret = ioctl(v_dev->uinput_fd, UI_DEV_SETUP, &v_dev->usetup);
-	if (ret)
-		return ret;
+	if (v_dev->qos_fd > 0)
+		fprintf(out, "qos latency_us=%d state=%s holds=%llu\n",
+			v_dev->profile.qos.latency_us,
+			v_dev->qos_timer.active ? "held" : "released",
+			(unsigned long long)v_dev->qos_holds);
 
-	ret = ioctl(v_dev->uinput_fd, UI_DEV_CREATE);
-	if (ret)
-		return ret;
+	if (v_dev->boost_fd > 0)
+		fprintf(out, "boost min=%u state=%s boosts=%llu\n",
+			v_dev->profile.boost.min,
+			v_dev->boosted ? "boosted" : "idle",
+			(unsigned long long)v_dev->boosts);
 
-	return 0;
+	if (v_dev->battery_fd > 0)
+		fprintf(out, "battery supply=%s capacity=%d charging=%d "
+			"rumble_pct=%u\n", v_dev->battery_supply,
+			v_dev->battery_capacity, v_dev->battery_charging,
+			v_dev->ff.scale);
+
+	if (v_dev->profile.stall.budget_ms)
+		fprintf(out, "stall budget_ms=%u stalls=%llu worst_us=%llu "
+			"late_wakes=%llu late_worst_us=%llu\n",
+			v_dev->profile.stall.budget_ms,
+			(unsigned long long)v_dev->stalls,
+			(unsigned long long)v_dev->stall_worst_us,
+			(unsigned long long)v_dev->late_wakes,
+			(unsigned long long)v_dev->late_worst_us);
+
+	if (v_dev->selftest_frames)
+		fprintf(out, "selftest frames=%u lost=%u min_us=%.1f "
+			"median_us=%.1f p99_us=%.1f\n", v_dev->selftest_frames,
+			v_dev->selftest_lost, v_dev->selftest_min_ns / 1000.0,
+			v_dev->selftest_median_ns / 1000.0,
+			v_dev->selftest_p99_ns / 1000.0);
+
+	if (v_dev->polled) {
+		fprintf(out, "poll sources=%d state=%s interval_ms=%d "
+			"raised=%llu dropped=%llu\n", v_dev->polled,
+			v_dev->poll_timer.active ? "active" : "idle",
+			v_dev->poll_timer.active ? v_dev->profile.poll.fast_ms :
+						   v_dev->profile.poll.slow_ms,
+			(unsigned long long)v_dev->poll_raised,
+			(unsigned long long)v_dev->poll_dropped);
+	}
 }
 
 /**
- * handle_uinput_ff_upload() - Capture and respond to ff_upload
- * requests
+ * dump_stats() - Publish runtime statistics
  * @v_dev: main virtual device struct
- * @ev: input_event initiating ff upload
  *
- * Handle the necessary IOCTLs used for processing an incoming ff
- * effect upload. Read the upload request from the uinput device and
- * replay it to the physical ff device. Read the response from the
- * physical ff device and replay it back to the uinput device.
- * Return value is 0 for success, negative for error.
+ * Print statistics to stdout, and if a statistics file was given
+ * replace it atomically with the current statistics.
  */
-int handle_uinput_ff_upload(struct virtual_device *v_dev,
-			    struct input_event ev)
+void dump_stats(struct virtual_device *v_dev)
 {
-	struct uinput_ff_upload ff_payload;
-	struct ff_effect effect;
-	int ret = 0;
+	char tmp[PATH_MAX];
+	FILE *out;
 
-	ff_payload.request_id = ev.value;
-	ret = ioctl(v_dev->uinput_fd, UI_BEGIN_FF_UPLOAD, &ff_payload);
-	if (ret)
-		return ret;
-	effect = ff_payload.effect;
-	effect.id = -1;
+	print_stats(v_dev, stdout);
+	fflush(stdout);
 
-	ret = ioctl(v_dev->ff_fd, EVIOCSFF, &effect);
-	if (ret)
-		return ret;
-	ff_payload.retval = ret;
+	if (!v_dev->stats_path)
+		return;
 
-	ret = ioctl(v_dev->uinput_fd, UI_END_FF_UPLOAD, &ff_payload);
-	if (ret)
-		return ret;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", v_dev->stats_path);
+	out = fopen(tmp, "w");
+	if (!out) {
+		printf("Unable to write %s\n", tmp);
+		return;
+	}
+	print_stats(v_dev, out);
+	if (fclose(out) || rename(tmp, v_dev->stats_path))
+		printf("Unable to write %s\n", v_dev->stats_path);
+}
 
-	return 0;
+/**
+ * flight_fd_name() - Describe what a file descriptor is used for
+ * @v_dev: main virtual device struct
+ * @fd: file descriptor
+ */
+const char *flight_fd_name(struct virtual_device *v_dev, int fd)
+{
+	struct source *src = find_source(v_dev, fd);
+
+	if (src)
+		return src->node;
+	if (fd == v_dev->uinput_fd)
+		return "uinput";
+	if (fd == v_dev->poll_timer.fd)
+		return "poll-timer";
+	if (fd == v_dev->turbo_fd)
+		return "turbo-timer";
+	if (fd == v_dev->cal_timer.fd)
+		return "cal-timer";
+	if (fd == v_dev->reconnect_fd)
+		return "reconnect-timer";
+	if (fd == v_dev->queue.retry_fd)
+		return "queue-timer";
+	if (fd == v_dev->filter_fd)
+		return "filter-timer";
+	if (fd == v_dev->ff.timer_fd)
+		return "ff-timer";
+	if (fd == v_dev->battery_fd)
+		return "battery-timer";
+	if (fd == v_dev->qos_timer.fd)
+		return "qos-timer";
+	if (fd == v_dev->boost_fd)
+		return "boost-timer";
+	return "unknown";
+}
+
+/**
+ * flight_dump() - Print the flight recorder
+ * @v_dev: main virtual device struct
+ * @end_us: time the stalled loop iteration ended
+ *
+ * Entries are printed oldest first with their time relative to the
+ * end of the stalled iteration. Handlers are shown with the time until
+ * the next handler started or the iteration ended.
+ */
+void flight_dump(struct virtual_device *v_dev, uint64_t end_us)
+{
+	static const char * const calls[] = {
+		"ff-upload", "ff-erase", "ff-play", "stats",
+	};
+	uint32_t first = v_dev->flight_head > FLIGHT_SIZE ?
+			 v_dev->flight_head - FLIGHT_SIZE : 0;
+
+	for (uint32_t i = first; i < v_dev->flight_head; i++) {
+		const struct flight_entry *e = &v_dev->flight[i % FLIGHT_SIZE];
+		const char *name;
+		uint64_t until = end_us;
+
+		printf("  %+8lld us ", (long long)(e->time_us - end_us));
+		switch (e->kind) {
+		case FLIGHT_WAKE:
+			printf("wake events=%d\n", e->value);
+			break;
+		case FLIGHT_HANDLER:
+			for (uint32_t j = i + 1; j < v_dev->flight_head; j++) {
+				const struct flight_entry *n =
+					&v_dev->flight[j % FLIGHT_SIZE];
+
+				if (n->kind == FLIGHT_HANDLER ||
+				    n->kind == FLIGHT_DONE) {
+					until = n->time_us;
+					break;
+				}
+			}
+			printf("handler %s fd=%d epoll=0x%x took %lld us\n",
+			       flight_fd_name(v_dev, e->value), e->value,
+			       e->arg, (long long)(until - e->time_us));
+			break;
+		case FLIGHT_EVENT:
+			name = code_name(e->arg, e->code);
+			if (name)
+				printf("event %s=%d\n", name, e->value);
+			else
+				printf("event %d:%d=%d\n", e->arg, e->code,
+				       e->value);
+			break;
+		case FLIGHT_CALL:
+			printf("call %s took %d us\n", calls[e->arg],
+			       e->value);
+			break;
+		case FLIGHT_DONE:
+			printf("done, loop took %d us\n", e->value);
+			break;
+		}
+	}
 }
 
 /**
- * handle_uinput_ff_erase() - Capture and respond to ff_erase
- * requests
+ * stall_check() - Check a main loop iteration against the budget
  * @v_dev: main virtual device struct
- * @ev: input_event initiating ff erase
+ * @wake_us: time the iteration started
  *
- * Handle the necessary IOCTLs used for processing an incoming ff
- * effect erase. Read the erase request from the uinput device and
- * replay it to the physical ff device. Read the response from the
- * physical ff device and replay it back to the uinput device.
- * Return value is 0 for success, negative for error.
+ * An iteration stalled if it took longer than the budget, or if input
+ * it read had already waited longer than the budget for the daemon to
+ * wake up, which points at scheduling. The flight recorder is dumped
+ * at most every STALL_DUMP_US so a slow console cannot keep the daemon
+ * stalled.
  */
-int handle_uinput_ff_erase(struct virtual_device *v_dev,
-			   struct input_event ev)
+void stall_check(struct virtual_device *v_dev, uint64_t wake_us)
 {
-	struct uinput_ff_erase ff_payload;
-	int ret = 0;
+	uint64_t budget_us = v_dev->profile.stall.budget_ms * 1000ull;
+	uint64_t end_us = now_us();
+	uint64_t took = end_us - wake_us, waited = 0;
 
-	ff_payload.request_id = ev.value;
-	ret = ioctl(v_dev->uinput_fd, UI_BEGIN_FF_ERASE, &ff_payload);
-	if (ret)
-		return ret;
+	if (v_dev->stall_input_us && v_dev->stall_input_us < wake_us)
+		waited = wake_us - v_dev->stall_input_us;
+	v_dev->stall_input_us = 0;
+	flight_record(v_dev, FLIGHT_DONE, 0, 0, took, end_us);
 
-	ret = ioctl(v_dev->ff_fd, EVIOCRMFF, ff_payload.effect_id);
-	if (ret)
-		return ret;
-	ff_payload.retval = ret;
+	if (took <= budget_us && waited <= budget_us)
+		return;
 
-	ret = ioctl(v_dev->uinput_fd, UI_END_FF_ERASE, &ff_payload);
-	if (ret)
-		return ret;
+	if (took > budget_us)
+		v_dev->stalls++;
+	else
+		v_dev->late_wakes++;
+	if (took > v_dev->stall_worst_us)
+		v_dev->stall_worst_us = took;
+	if (waited > v_dev->late_worst_us)
+		v_dev->late_worst_us = waited;
 
-	return 0;
+	if (v_dev->stall_dump_us &&
+	    end_us - v_dev->stall_dump_us < STALL_DUMP_US)
+		return;
+	v_dev->stall_dump_us = end_us;
+
+	printf("Stall: loop took %llu us, input waited %llu us to be read, "
+	       "budget %llu us\n", (unsigned long long)took,
+	       (unsigned long long)waited, (unsigned long long)budget_us);
+	flight_dump(v_dev, end_us);
+}
+
+/**
+ * stats_signal() - SIGUSR1 handler requesting a statistics dump
+ * @sig: signal number
+ */
+void stats_signal(int sig)
+{
+	(void)sig;
+	stats_requested = 1;
+}
+
+/**
+ * stop_signal() - SIGTERM and SIGINT handler while recording a trace
+ * @sig: signal number
+ */
+void stop_signal(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
 }
 
 /**
- * set_ff_gain() - Set gain on physical ff hardware
+ * bench_pass() - Time one pass of synthetic events through forwarding
  * @v_dev: main virtual device struct
- * @gain: value to set for gain
+ * @evs: synthetic events
+ * @count: number of events in evs
+ * @loops: number of times to replay evs
  *
- * Set the gain value of the physical ff hardware based on event
- * received by uinput device. Return value is 0 for success,
- * negative for error.
+ * Timestamps of evs are advanced by @span microseconds each replay so
+ * that time keeps moving forward. Return the average cost per source
+ * event in nanoseconds.
  */
-int set_ff_gain(struct virtual_device *v_dev, __u16 gain)
+double bench_pass(struct virtual_device *v_dev, struct input_event *evs,
+		  int count, long loops, long span)
 {
-	struct input_event ff_event = {
-		.type = EV_FF,
-		.code = FF_GAIN,
-		.value = gain,
-	};
-	int ret = 0;
+	struct timespec start, end;
 
-	ret = write(v_dev->ff_fd, (const void *) &ff_event,
-		    sizeof(ff_event));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long l = 0; l < loops; l++) {
+		for (int i = 0; i < count; i++) {
+			evs[i].input_event_usec += span;
+			forward_event(v_dev, v_dev->abs_map, &evs[i]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-	if (ret != sizeof(ff_event)) {
-		printf("Could not set device gain\n");
-		return -EIO;
+	return ((end.tv_sec - start.tv_sec) * 1e9 +
+		(end.tv_nsec - start.tv_nsec)) / ((double)count * loops);
+}
+
+/**
+ * run_benchmark() - Measure the cost of the forwarding path
+ * @v_dev: main virtual device struct, with the profile loaded
+ * @frames: number of synthetic frames to forward per pass
+ *
+ * Forward a synthetic stream of stick, trigger and button frames to
+ * /dev/null, once with identity tables and once with the tables of
+ * the selected profile, and report the per-event cost of each. All
+ * axes are given a 0..1023 range as a typical ADC would report. The
+ * difference is the cost of the profile's processing stages. Return
+ * 0 on success, negative on error.
+ */
+int run_benchmark(struct virtual_device *v_dev, long frames)
+{
+	static struct input_event evs[256 * 5];
+	struct profile prof = v_dev->profile;
+	double identity, profiled;
+	int count = 0;
+
+	v_dev->uinput_fd = open("/dev/null", O_WRONLY);
+	if (v_dev->uinput_fd == -1)
+		return -errno;
+
+	for (int f = 0; f < 256; f++) {
+		for (int i = count; i < count + 5; i++)
+			evs[i].input_event_usec = f * 2000;
+		evs[count].type = EV_ABS;
+		evs[count].code = ABS_X;
+		evs[count++].value = f * 4;
+		evs[count].type = EV_ABS;
+		evs[count].code = ABS_Y;
+		evs[count++].value = 1023 - f * 4;
+		evs[count].type = EV_ABS;
+		evs[count].code = ABS_Z;
+		evs[count++].value = (f * 37) & 1023;
+		if (f % 4 == 0) {
+			evs[count].type = EV_KEY;
+			evs[count].code = f % 8 ? BTN_SOUTH : KEY_VOLUMEUP;
+			evs[count++].value = (f / 8) & 1;
+		}
+		evs[count].type = EV_SYN;
+		evs[count++].code = SYN_REPORT;
+	}
+
+	for (int i = 0; i < ABS_MAX; i++) {
+		v_dev->uabssetup[i].absinfo.minimum = 0;
+		v_dev->uabssetup[i].absinfo.maximum = 1023;
+	}
+
+	v_dev->profile.remaps = 0;
+	v_dev->profile.sticks = 0;
+	v_dev->profile.filters = 0;
+	v_dev->profile.norms = 0;
+	v_dev->profile.triggers = 0;
+	v_dev->profile.dpads = 0;
+	remap_build(v_dev);
+	identity = bench_pass(v_dev, evs, count, frames / 256 + 1, 256 * 2000);
+
+	v_dev->profile = prof;
+	remap_build(v_dev);
+	for (int i = 0; i < ABS_CNT; i++) {
+		struct remap_action *act = &v_dev->abs_map[i];
+		struct axis_norm *norm = norm_find(v_dev, act->code);
+
+		if (act->op != ACTION_PASS || !norm)
+			continue;
+		if (act->arg[0] < 0)
+			act->arg[1] = 1023;
+		norm_apply(act, norm, 0, 1023);
+		norm_absinfo(act, norm, &v_dev->uabssetup[act->code].absinfo);
 	}
+	trigger_build(v_dev);
+	dpad_build(v_dev);
+	stick_build(v_dev);
+	filter_build(v_dev);
+	profiled = bench_pass(v_dev, evs, count, frames / 256 + 1, 256 * 2000);
 
+	printf("forwarding, identity tables: %.1f ns/event\n", identity);
+	printf("forwarding, profile %s: %.1f ns/event\n", prof.name,
+	       profiled);
+	print_stats(v_dev, stdout);
+
+	close(v_dev->uinput_fd);
 	return 0;
 }
 
 /**
- * set_ff_effect_status() - Set ff effect on physical ff hardware
- * @v_dev: main virtual device struct
- * @int: id of effect
- * @status: status of effect - 1 or 0
+ * selftest_open() - Open the evdev node of the virtual device
+ * @v_dev: main virtual device struct, with the device created
  *
- * Set the effect status of the physical ff hardware based on event
- * received by uinput device. Return value is 0 for success,
- * negative for error.
+ * The node is created along with the device, but may take a moment to
+ * appear in /dev. Return the file descriptor, negative on error.
  */
-int set_ff_effect_status(struct virtual_device *v_dev, int effect,
-			 int status)
+int selftest_open(struct virtual_device *v_dev)
 {
-	struct input_event ff_event = {
-		.type = EV_FF,
-		.code = effect,
-		.value = status,
-	};
-	int ret = 0;
+	int clock = CLOCK_MONOTONIC;
+	char sysname[32];
+	char path[96];
+	int fd;
 
-	ret = write(v_dev->ff_fd, (const void *) &ff_event,
-		    sizeof(ff_event));
-	if (ret != sizeof(ff_event)) {
-		printf("Could not set effect status\n");
-		return -EIO;
+	if (ioctl(v_dev->uinput_fd, UI_GET_SYSNAME(sizeof(sysname)),
+		  sysname) < 0)
+		return -errno;
+
+	for (int i = 0; i < 256; i++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/virtual/input/%s/event%d", sysname, i);
+		if (access(path, F_OK))
+			continue;
+
+		snprintf(path, sizeof(path), "/dev/input/event%d", i);
+		for (int retry = 0; retry < 50; retry++) {
+			fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			if (fd >= 0) {
+				ioctl(fd, EVIOCSCLOCKID, &clock);
+				return fd;
+			}
+			if (errno != ENOENT)
+				return -errno;
+			usleep(10000);
+		}
+		return -ENOENT;
 	}
 
-	return 0;
+	return -ENODEV;
 }
 
 /**
- * handle_ff_events() - Respond to ff_events
+ * selftest_button() - Check that a key is a gamepad button
+ * @code: key code
  *
+ * Keys outside the button ranges, such as KEY_POWER or KEY_VOLUMEDOWN
+ * of a gpio-keys source, are acted on by the rest of the system.
+ */
+static inline int selftest_button(int code)
+{
+	return (code >= BTN_MISC && code <= BTN_THUMBR) ||
+	       (code >= BTN_TRIGGER_HAPPY && code <= BTN_TRIGGER_HAPPY40);
+}
+
+/**
+ * selftest_key() - Pick the key the self-test injects
  * @v_dev: main virtual device struct
- * @ev: input_event initiating ff upload
+ * @fd: evdev node of the virtual device
  *
- * Dispatch an ff event to the correct ff handler. Return value is 0
- * for success, negative for error. For some reason it was insufficient
- * to simply forward the input_event, we had to create a new one.
+ * The key must be a gamepad button passed straight through to a button
+ * the virtual device has and is not currently held, so that every
+ * injected frame comes back and nothing but games sees it. Return the
+ * source key code, negative if there is none.
  */
-int handle_ff_events(struct virtual_device *v_dev,
-		     struct input_event ev)
+int selftest_key(struct virtual_device *v_dev, int fd)
 {
-	int ret = 0;
+	uint8_t bits[KEY_CNT / 8] = { 0 };
+	uint8_t state[KEY_CNT / 8] = { 0 };
 
-	if (ev.code == FF_GAIN)
-		return set_ff_gain(v_dev, ev.value);
+	ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits);
+	ioctl(fd, EVIOCGKEY(sizeof(state)), state);
 
-	if (ev.code <= FF_GAIN)
-		return set_ff_effect_status(v_dev, ev.code, ev.value);
+	for (int i = BTN_MISC; i < KEY_CNT; i++) {
+		const struct remap_action *act = &v_dev->key_map[i];
+		uint8_t bit = 1 << (act->code % 8);
 
-	return ret;
+		if (!selftest_button(i) || act->op != ACTION_PASS ||
+		    !selftest_button(act->code) ||
+		    v_dev->dpad_key_route[act->code] ||
+		    !(bits[act->code / 8] & bit) ||
+		    (state[act->code / 8] & bit))
+			continue;
+		return i;
+	}
+
+	return -ENOENT;
 }
 
 /**
- * parse_ev_incoming() - Process incoming event and hand off to correct
- * helper function.
- *
+ * selftest_frame() - Loop one frame back through the virtual device
  * @v_dev: main virtual device struct
- * @fd_in: file descriptor responsible for event
+ * @fd: evdev node of the virtual device
+ * @code: source key code to inject
+ * @value: key value to inject
  *
- * Process an EPOLLIN request and hand off necessary data to correct
- * function. Return value is 0 for success, negative for error.
+ * The frame takes the same path as one read from a source. Return the
+ * time until it could be read back from the virtual device in ns,
+ * negative if it did not come back in time.
  */
-void parse_ev_incoming(struct virtual_device *v_dev, int fd_in)
+int64_t selftest_frame(struct virtual_device *v_dev, int fd, int code,
+		       int value)
 {
-	struct input_event ev;
-	int len, ret;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct input_event ev = {
+		.type = EV_KEY,
+		.code = code,
+		.value = value,
+	};
+	struct input_event in[16];
+	struct timespec start, end;
 
-	len = read(fd_in, &ev, sizeof(ev));
-	if (len != -1) {
-		switch (ev.type) {
-		case EV_SYN:
-		case EV_ABS:
-		case EV_KEY:
-			if (v_dev->uinput_fd != fd_in) {
-				ret = write(v_dev->uinput_fd,
-				      &ev, sizeof(ev));
-				if (ret < 0)
-					printf("Event dropped\n");
-			}
-			break;
-		case EV_UINPUT:
-			if (ev.code == UI_FF_UPLOAD) {
-				handle_uinput_ff_upload(v_dev, ev);
-				break;
-			} else if (ev.code == UI_FF_ERASE) {
-				handle_uinput_ff_erase(v_dev, ev);
-				break;
-			}
-			printf("UINPUT ev %d not handled\n", ev.code);
-			break;
-		case EV_FF:
-			if (v_dev->uinput_fd == fd_in)
-				handle_ff_events(v_dev, ev);
-			break;
-		default:
-			/* Catch for events we don't support yet */
-			printf("EV type %d EV code %d not handled\n",
-			       ev.type, ev.code);
-		}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ev.input_event_sec = start.tv_sec;
+	ev.input_event_usec = start.tv_nsec / 1000;
+	v_dev->frame_us = event_us(&ev);
+	forward_event(v_dev, v_dev->abs_map, &ev);
+	ev.type = EV_SYN;
+	ev.code = SYN_REPORT;
+	ev.value = 0;
+	forward_event(v_dev, v_dev->abs_map, &ev);
 
-	} else {
-		printf("read failed descriptor %d, errno %d\n",
-		       fd_in, errno);
+	while (poll(&pfd, 1, SELFTEST_TIMEOUT_MS) > 0) {
+		int len = read(fd, in, sizeof(in));
+
+		for (int i = 0; i < len / (int)sizeof(in[0]); i++) {
+			if (in[i].type != EV_SYN || in[i].code != SYN_REPORT)
+				continue;
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			return (end.tv_sec - start.tv_sec) * 1000000000ll +
+			       end.tv_nsec - start.tv_nsec;
+		}
 	}
+
+	return -ETIMEDOUT;
 }
 
 /**
- * define_epoll_fds() - Add all required file descriptors to epoll to
- * be monitored.
+ * selftest_run() - Measure the forwarding latency of this unit
+ * @v_dev: main virtual device struct, with the pipeline set up
  *
- * @v_dev: main virtual device struct
- * @ep_fd: epoll file descriptor
- *
- * Iterate through all file descriptors to monitor and add those which
- * need to be monitored by epoll. At a minimum we need to monitor the
- * uinput device for force feedback effects and at least 1 of either
- * an ABS device or 1 or more key devices.
+ * Toggle a key through the forwarding pipeline a number of times and
+ * read each frame back from the evdev node of the virtual device. The
+ * minimum, median and 99th percentile round trip are logged and kept
+ * for the statistics. The key ends up released again.
  */
-int define_epoll_fds(struct virtual_device *v_dev, int ep_fd)
+void selftest_run(struct virtual_device *v_dev)
 {
-	struct epoll_event event;
-	int ret = 0;
+	static uint32_t ns[SELFTEST_MAX];
+	int frames = v_dev->profile.selftest.frames;
+	int fd, code, n = 0;
 
-	event.events = EPOLLIN;
-	event.data.fd = v_dev->uinput_fd;
-	ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->uinput_fd,
-			&event);
-	if (ret == -1) {
-		printf("Cannot monitor uinput device\n");
-		return -1;
+	fd = selftest_open(v_dev);
+	if (fd < 0) {
+		printf("Self-test cannot open the virtual device: %d\n", fd);
+		return;
 	}
 
-	for (int i = 0; i < MAX_DEVS; i++) {
-		if (!(v_dev->abs_fd[i] > 0))
-			continue;
-		event.events = EPOLLIN;
-		event.data.fd = v_dev->abs_fd[i];
-		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->abs_fd[i],
-				&event);
-		if (ret == -1) {
-			printf("Cannot monitor abs device %d\n", i);
-			return -1;
-		}
+	code = selftest_key(v_dev, fd);
+	if (code < 0) {
+		printf("Self-test found no key to inject\n");
+		close(fd);
+		return;
 	}
 
-	for (int i = 0; i < MAX_DEVS; i++) {
-		if (!(v_dev->key_fd[i] > 0))
+	for (int i = 0; i < frames; i++) {
+		int64_t t = selftest_frame(v_dev, fd, code, !(i & 1));
+		int j;
+
+		if (t < 0) {
+			v_dev->selftest_lost++;
 			continue;
-		event.events = EPOLLIN;
-		event.data.fd = v_dev->key_fd[i];
-		ret = epoll_ctl(ep_fd, EPOLL_CTL_ADD, v_dev->key_fd[i],
-				&event);
-		if (ret == -1) {
-			printf("Cannot monitor key device %d\n", i);
-			return -1;
 		}
+		/* Keep the samples sorted, there are only a few hundred */
+		for (j = n++; j > 0 && ns[j - 1] > t; j--)
+			ns[j] = ns[j - 1];
+		ns[j] = t > UINT32_MAX ? UINT32_MAX : t;
 	}
+	close(fd);
 
-	return 0;
+	v_dev->selftest_frames = n;
+	if (!n) {
+		printf("Self-test frames did not come back\n");
+		return;
+	}
+	v_dev->selftest_min_ns = ns[0];
+	v_dev->selftest_median_ns = ns[n / 2];
+	v_dev->selftest_p99_ns = ns[(n - 1) * 99 / 100];
+	printf("Self-test round trip over %d frames: min %.1f median %.1f "
+	       "p99 %.1f us, %u lost\n", n, v_dev->selftest_min_ns / 1000.0,
+	       v_dev->selftest_median_ns / 1000.0,
+	       v_dev->selftest_p99_ns / 1000.0, v_dev->selftest_lost);
+}
+
+/**
+ * usage() - Print command line help
+ * @prog: program name
+ */
+void usage(const char *prog)
+{
+	printf("Usage: %s [-c config] [-p database] [-w database] [-b frames]\n"
+	       "          [-s statsfile] [-r tracefile]\n"
+	       "  -c config    configuration file (default %s)\n"
+	       "  -p database  binary profile database (default %s)\n"
+	       "  -w database  compile the configuration file into a\n"
+	       "               binary profile database and exit\n"
+	       "  -b frames    benchmark the forwarding path and exit\n"
+	       "  -s file      also write statistics to file on SIGUSR1\n"
+	       "  -r file      record source events to file for\n"
+	       "               trace_analyzer\n",
+	       prog, CONFIG_FILE, PROFILE_DB);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
 	struct epoll_event event_queue[MAX_EVENTS];
+	struct sigaction sa = { .sa_handler = stats_signal };
 	struct virtual_device *v_dev;
-	int ep_fd;
+	const char *stats_path = NULL;
+	const char *trace_path = NULL;
+	const char *config = NULL;
+	const char *db_path = NULL;
+	const char *db_out = NULL;
+	long bench_frames = 0;
+	int ep_fd, opt;
 	int ret = 0;
 
+	while ((opt = getopt(argc, argv, "c:p:w:b:s:r:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			config = optarg;
+			break;
+		case 'p':
+			db_path = optarg;
+			break;
+		case 'w':
+			db_out = optarg;
+			break;
+		case 'b':
+			bench_frames = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			stats_path = optarg;
+			break;
+		case 'r':
+			trace_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -EINVAL;
+		}
+	}
+
 	v_dev = malloc(sizeof(struct virtual_device));
 	if (v_dev == NULL) {
 		printf("Unable to allocate memory for virtual dev.\n");
@@ -626,6 +7763,30 @@ int main(void)
 	};
 
 	memset(v_dev, 0, sizeof(struct virtual_device));
+	v_dev->stats_path = stats_path;
+
+	if (db_out) {
+		struct profile_db db;
+
+		ret = parse_config(&db, config ? config : CONFIG_FILE);
+		if (ret == 0)
+			ret = write_profile_db(&db, db_out);
+		if (ret)
+			printf("Unable to compile profile database: %d\n",
+			       ret);
+		return ret;
+	}
+
+	ret = load_profile(v_dev, config, db_path);
+	if (ret) {
+		printf("Unable to load configuration: %d\n", ret);
+		return ret;
+	}
+
+	if (bench_frames > 0)
+		return run_benchmark(v_dev, bench_frames);
+
+	remap_build(v_dev);
 
 	ret = iterate_input_devices(v_dev);
 	if (ret == 0) {
@@ -639,11 +7800,90 @@ int main(void)
 		return -ENODEV;
 	}
 
+	stick_build(v_dev);
+	filter_build(v_dev);
+
+	ret = filter_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up filter settle timer: %d\n", ret);
+		return ret;
+	}
+
+	ret = poll_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up poll interval control: %d\n", ret);
+		return ret;
+	}
+
+	ret = turbo_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up turbo keys: %d\n", ret);
+		return ret;
+	}
+
+	ret = cal_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up calibration: %d\n", ret);
+		return ret;
+	}
+
+	ret = reconnect_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up reconnecting: %d\n", ret);
+		return ret;
+	}
+
+	ret = queue_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up output queue: %d\n", ret);
+		return ret;
+	}
+
+	ret = ff_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up force feedback output: %d\n", ret);
+		return ret;
+	}
+
+	ret = battery_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up rumble scaling: %d\n", ret);
+		return ret;
+	}
+
+	ret = qos_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up CPU latency control: %d\n", ret);
+		return ret;
+	}
+
+	ret = boost_setup(v_dev);
+	if (ret) {
+		printf("Unable to set up input boost: %d\n", ret);
+		return ret;
+	}
+
+	if (v_dev->profile.selftest.frames)
+		selftest_run(v_dev);
+
+	if (trace_path) {
+		struct sigaction stop = { .sa_handler = stop_signal };
+
+		ret = trace_start(v_dev, trace_path);
+		if (ret) {
+			printf("Unable to record to %s: %d\n", trace_path, ret);
+			return ret;
+		}
+		sigaction(SIGTERM, &stop, NULL);
+		sigaction(SIGINT, &stop, NULL);
+	}
+
 	ep_fd = epoll_create1(0);
 	if (ep_fd == -1) {
 		printf("Unable to start epoll\n");
 		return -1;
 	}
+	v_dev->ep_fd = ep_fd;
 
 	ret = define_epoll_fds(v_dev, ep_fd);
 	if (ret) {
@@ -651,20 +7891,82 @@ int main(void)
 		return ret;
 	}
 
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGCHLD, SIG_IGN);
+	v_dev->suspend_offset = suspend_offset();
+
 	while (1) {
+		uint64_t wake_us;
 		int n, i;
 
 		n = epoll_wait(ep_fd, event_queue, (MAX_DEVS * 3), -1);
+		wake_us = flight_now(v_dev);
+		flight_record(v_dev, FLIGHT_WAKE, 0, 0, n, wake_us);
+		check_resume(v_dev);
 		for (i = 0; i < n; i++) {
-			if (event_queue[i].events & EPOLLIN)
-				parse_ev_incoming(v_dev,
-						  event_queue[i].data.fd);
+			int fd = event_queue[i].data.fd;
+			struct source *src = find_source(v_dev, fd);
+
+			flight_record(v_dev, FLIGHT_HANDLER,
+				      event_queue[i].events, 0, fd,
+				      flight_now(v_dev));
+
+			if (fd == v_dev->poll_timer.fd)
+				poll_idle(v_dev);
+			else if (fd == v_dev->turbo_fd)
+				turbo_tick(v_dev);
+			else if (fd == v_dev->cal_timer.fd)
+				cal_idle(v_dev);
+			else if (fd == v_dev->reconnect_fd)
+				reconnect_sources(v_dev);
+			else if (fd == v_dev->queue.retry_fd)
+				queue_retry(v_dev);
+			else if (fd == v_dev->filter_fd)
+				filter_tick(v_dev);
+			else if (fd == v_dev->ff.timer_fd)
+				ff_tick(v_dev);
+			else if (fd == v_dev->battery_fd)
+				battery_tick(v_dev);
+			else if (fd == v_dev->qos_timer.fd)
+				qos_idle(v_dev);
+			else if (fd == v_dev->boost_fd)
+				boost_tick(v_dev);
+			else if (src && (event_queue[i].events &
+					 (EPOLLERR | EPOLLHUP)))
+				source_lost(v_dev, src);
+			else if (fd == v_dev->uinput_fd &&
+				 (event_queue[i].events & EPOLLOUT)) {
+				queue_ready(v_dev);
+				if (event_queue[i].events & EPOLLIN)
+					parse_ev_incoming(v_dev, fd);
+			} else if (event_queue[i].events & EPOLLIN)
+				parse_ev_incoming(v_dev, fd);
 			else {
 				printf("epoll error, type %u\n",
 				       event_queue[i].events);
-				close(event_queue[i].data.fd);
+				close(fd);
 				continue;
 			}
 		}
+
+		/* Requested by SIGUSR1 or by a chord */
+		if (stats_requested) {
+			uint64_t start = flight_now(v_dev);
+
+			stats_requested = 0;
+			trace_flush(v_dev);
+			dump_stats(v_dev);
+			flight_call(v_dev, CALL_STATS, start);
+		}
+
+		if (wake_us)
+			stall_check(v_dev, wake_us);
+
+		if (stop_requested) {
+			trace_flush(v_dev);
+			printf("Recorded %llu events\n",
+			       (unsigned long long)v_dev->trace_records);
+			return 0;
+		}
 	}
 }